@@ -26,8 +26,12 @@
 #include <sys/stat.h>
 #endif
 #include <string>
+#include <vector>
+#include <atomic>
 
 #define LIBNET_IP_SIZE 64
+//Listen and Connect take "unix:/path" for a local stream socket, or "unix:@name" in the abstract namespace, the port is ignored
+#define LIBNET_UNIX_PREFIX "unix:"
 
 namespace libnet {
 	class NetBuffer {
@@ -39,20 +43,33 @@ namespace libnet {
 			_sizePlus = sizePlus;
 		}
 
+		//all of the data when the ring didn't wrap, which a mirrored recv ring never does
+		inline bool IsContiguous() const { return _sizePlus == 0; }
+		//the first span, Size() bytes when contiguous
+		inline const char* Data() const { return _buff; }
+
 		inline int32_t Find(int32_t offset, char c) const {
-			for (int32_t i = offset; i < _size + _sizePlus; ++i) {
-				char check = (i >= _size ? _buffPlus[i - _size] : _buff[i]);
-				if (check == c)
-					return i;
-			}
-			return -1;
+			return Find(offset, _size + _sizePlus, c);
 		}
 
+		//memchr over each span, the seam costs one more call
 		inline int32_t Find(int32_t offset, int32_t end, char c) const {
-			for (int32_t i = offset; i < _size + _sizePlus && i < end; ++i) {
-				char check = (i >= _size ? _buffPlus[i - _size] : _buff[i]);
-				if (check == c)
-					return i;
+			if (end > _size + _sizePlus)
+				end = _size + _sizePlus;
+			if (offset >= end)
+				return -1;
+
+			if (offset < _size) {
+				const char* p = (const char*)memchr(_buff + offset, c, (end < _size ? end : _size) - offset);
+				if (p)
+					return (int32_t)(p - _buff);
+				offset = _size;
+			}
+
+			if (offset < end) {
+				const char* p = (const char*)memchr(_buffPlus + (offset - _size), c, end - offset);
+				if (p)
+					return _size + (int32_t)(p - _buffPlus);
 			}
 			return -1;
 		}
@@ -78,15 +95,20 @@ namespace libnet {
 
 		inline int32_t Find(int32_t offset, const char* str) const {
 			int32_t len = (int32_t)strlen(str);
-			for (int32_t i = offset; i < _size + _sizePlus; ++i) {
-				int32_t j = 0;
-				for (; j < len; ++j) {
-					char check = (i + j >= _size ? _buffPlus[(i + j) - _size] : _buff[i + j]);
-					if (check != str[j])
-						break;
+			if (len == 0)
+				return offset < _size + _sizePlus ? offset : -1;
+
+			//candidates by their first byte, compared in place unless they run over the seam
+			for (int32_t i = Find(offset, str[0]); i >= 0 && i + len <= _size + _sizePlus; i = Find(i + 1, str[0])) {
+				if (i + len <= _size) {
+					if (memcmp(_buff + i, str, len) == 0)
+						return i;
 				}
-
-				if (j == len)
+				else if (i >= _size) {
+					if (memcmp(_buffPlus + (i - _size), str, len) == 0)
+						return i;
+				}
+				else if (memcmp(_buff + i, str, _size - i) == 0 && memcmp(_buffPlus, str + (_size - i), len - (_size - i)) == 0)
 					return i;
 			}
 			return -1;
@@ -120,7 +142,7 @@ namespace libnet {
 					return false;
 
 				memcpy(&t, _buff + offset, _size - offset);
-				memcpy(&t + (_size - offset), _buffPlus, sizeof(T) - (_size - offset));
+				memcpy((char*)&t + (_size - offset), _buffPlus, sizeof(T) - (_size - offset));
 			}
 			else
 				memcpy(&t, _buff + offset, sizeof(T));
@@ -144,7 +166,7 @@ namespace libnet {
 					return false;
 
 				memcpy(_buff + offset, &t, _size - offset);
-				memcpy(_buffPlus, &t + (_size - offset), sizeof(T) - (_size - offset));
+				memcpy(_buffPlus, (const char*)&t + (_size - offset), sizeof(T) - (_size - offset));
 			}
 			else
 				memcpy(_buff + offset, &t, sizeof(T));
@@ -161,17 +183,87 @@ namespace libnet {
 		int32_t _sizePlus = 0;
 	};
 
+	//application memory a pipe sends without copying it in, Release is called once nothing reads Data any more
+	struct ISendBuffer {
+		virtual ~ISendBuffer() {}
+
+		virtual const char* Data() const = 0;
+		virtual int32_t Size() const = 0;
+		virtual void Release() = 0;
+	};
+
+	/**
+	* An immutable block sent to many pipes without a copy per pipe, serialized once for a broadcast.
+	* Create hands the caller one reference, every ITcpSession::Send takes its own and drops it once sent
+	*/
+	class SharedBuffer : public ISendBuffer {
+	public:
+		static SharedBuffer* Create(const char* data, const int32_t size);
+
+		inline void AddRef() { _refs.fetch_add(1, std::memory_order_relaxed); }
+
+		virtual const char* Data() const { return _data; }
+		virtual int32_t Size() const { return _size; }
+		//pipes drop theirs from whichever thread dispatches them
+		virtual void Release();
+
+	private:
+		SharedBuffer(const int32_t size) : _size(size), _refs(1) {}
+
+		int32_t _size;
+		std::atomic<int32_t> _refs;
+		char _data[1];
+	};
+
 	class IPipe {
 	public:
 		virtual ~IPipe() {}
 
 		virtual void Send(const char* context, const int32_t size) = 0;
+
+		//ordered with Send, released from the thread dispatching the pipe's session.
+		//copied into the send buffer where the backend has no zero-copy path
+		virtual void Send(ISendBuffer* buffer) {
+			Send(buffer->Data(), buffer->Size());
+			buffer->Release();
+		}
+
+		//size bytes of fd from offset, ordered with Send. the pipe keeps its own duplicate of fd, the caller may close it right away.
+		//read into the send buffer where the backend has no file path, a range it can't hold fails the pipe.
+		//files go out on the io workers, which block SIGPIPE, a reset peer fails the pipe
+		virtual void SendFile(int32_t fd, int64_t offset, int64_t size) {
+#ifdef WIN32
+			Shutdown();
+#else
+			char buf[16 << 10];
+			while (size > 0) {
+				ssize_t len = pread(fd, buf, size < (int64_t)sizeof(buf) ? (size_t)size : sizeof(buf), (off_t)offset);
+				if (len <= 0) {
+					if (len < 0 && errno == EINTR)
+						continue;
+
+					Shutdown();
+					return;
+				}
+
+				Send(buf, (int32_t)len);
+				offset += len;
+				size -= len;
+			}
+#endif
+		}
+
 		virtual void Close() = 0;
 		virtual void Shutdown() = 0;
 
 		virtual void AdjustSendBuffSize(const int32_t size) = 0;
 		virtual void AdjustRecvBuffSize(const int32_t size) = 0;
 
+		//one of NET_FLUSH_*, backends without it keep NET_FLUSH_ROUND
+		virtual void SetFlushPolicy(const int8_t policy) {}
+		//everything sent so far leaves now, a corked pipe is pushed out to the peer
+		virtual void Flush() {}
+
 		inline const char* GetRemoteIp() const { return _remoteIp; }
 		inline int32_t GetRemotePort() { return _remotePort; }
 
@@ -201,6 +293,26 @@ namespace libnet {
 				_pipe->Send(context, size);
 		}
 
+		inline void Send(ISendBuffer* buffer) {
+			if (_pipe)
+				_pipe->Send(buffer);
+			else
+				buffer->Release();
+		}
+
+		//the caller keeps its reference, the pipe takes one of its own
+		inline void Send(SharedBuffer* buffer) {
+			if (_pipe) {
+				buffer->AddRef();
+				_pipe->Send(buffer);
+			}
+		}
+
+		inline void SendFile(int32_t fd, int64_t offset, int64_t size) {
+			if (_pipe)
+				_pipe->SendFile(fd, offset, size);
+		}
+
 		inline void Close() {
 			if (_pipe)
 				_pipe->Close();
@@ -221,6 +333,16 @@ namespace libnet {
 				_pipe->AdjustRecvBuffSize(size);
 		}
 
+		inline void SetFlushPolicy(const int8_t policy) {
+			if (_pipe)
+				_pipe->SetFlushPolicy(policy);
+		}
+
+		inline void Flush() {
+			if (_pipe)
+				_pipe->Flush();
+		}
+
 	protected:
 		IPipe* _pipe = nullptr;
 	};
@@ -234,18 +356,222 @@ namespace libnet {
 		virtual ITcpSession* MallocConnection() = 0;
 	};
 
+	//an ipv4 endpoint, both fields in network byte order so a datagram's peer is kept and compared without formatting
+	struct NetAddress {
+		uint32_t ip = 0;
+		uint16_t port = 0;
+
+		inline bool operator==(const NetAddress& other) const { return ip == other.ip && port == other.port; }
+		inline bool operator!=(const NetAddress& other) const { return !(*this == other); }
+	};
+
+	bool MakeNetAddress(const char* ip, const int32_t port, NetAddress& address);
+	void FormatNetAddress(const NetAddress& address, char* ip, int32_t size, int32_t& port);
+
+	class IUdpPipe {
+	public:
+		virtual ~IUdpPipe() {}
+
+		//one datagram, queued and sent with the others queued in the same round by one sendmmsg.
+		//false when it was dropped, the pipe is closing or its send buffer is full
+		virtual bool SendTo(const char* context, const int32_t size, const NetAddress& to) = 0;
+
+		//flushes what is queued, OnClose follows
+		virtual void Close() = 0;
+
+		virtual const NetAddress& GetLocalAddress() const = 0;
+	};
+
+	class IUdpSession {
+	public:
+		IUdpSession() {}
+		virtual ~IUdpSession() {}
+
+		//registered on its worker, on the thread dispatching it. with worker dispatch the first place the pipe may be used
+		virtual void OnBind() {}
+
+		//one whole datagram, data is only valid during the call
+		virtual void OnRecv(const char* context, const int32_t size, const NetAddress& from) = 0;
+
+		//after Close or a socket error, the pipe is gone and Release follows
+		virtual void OnClose() = 0;
+
+		virtual void Release() = 0;
+
+		inline void SetPipe(IUdpPipe* pipe) { _pipe = pipe; }
+		inline IUdpPipe* GetPipe() const { return _pipe; }
+
+		inline bool SendTo(const char* context, const int32_t size, const NetAddress& to) {
+			return _pipe ? _pipe->SendTo(context, size, to) : false;
+		}
+
+		inline void Close() {
+			if (_pipe)
+				_pipe->Close();
+		}
+
+	protected:
+		IUdpPipe* _pipe = nullptr;
+	};
+
+	struct UdpOptions {
+		int32_t sendSize = 256 << 10; //bytes of datagrams queued for the socket, each takes a few more for its header
+		int32_t recvSize = 256 << 10; //bytes of datagrams waiting for Poll, poll dispatch only. datagrams that don't fit are dropped
+		int32_t maxDatagram = 2048; //longer datagrams are truncated by the kernel and dropped
+
+		//runs of equally sized datagrams to one peer leave as one UDP_SEGMENT send, the kernel or the nic splits them
+		bool gso = false;
+		//the kernel coalesces datagrams of a flow into one buffer (UDP_GRO), split back before OnRecv. takes 64K receive buffers
+		bool gro = false;
+	};
+
+	struct ListenOptions {
+		//one SO_REUSEPORT socket per io worker, the kernel spreads new connections
+		//and each acceptor keeps its connections on its own worker
+		bool reusePort = false;
+
+		int32_t backlog = 128; //completed handshakes the kernel queues ahead of accept
+
+		//seconds a connection may stay silent after the handshake (TCP_DEFER_ACCEPT), 0 hands it over at once.
+		//a connection is accepted once its first data arrives, one that never sends never reaches a session
+		int32_t deferAccept = 0;
+
+		//kernel send buffer of the accepted tcp sockets (SO_SNDBUF), 0 leaves it to the kernel's autotuning.
+		//bytes past it wait in the connection's send ring and send queue
+		int32_t sendBuffer = 0;
+	};
+
+	struct NetWorkerStat {
+		int32_t connections = 0;
+		int64_t recvBytes = 0;
+		int64_t sendBytes = 0;
+		int64_t bytesPerSecond = 0; //recv and send over the last sampling interval
+		int64_t recvCalls = 0; //recv syscalls issued, including the one finding the socket empty. io_uring_enter calls on the uring backend
+		int64_t sendCalls = 0; //send syscalls issued, including the one finding the socket full. 0 on the uring backend
+		int64_t acceptCalls = 0; //syscalls taking connections in and registering them, including the accept finding the queue empty
+		int64_t recvDatagrams = 0; //udp datagrams received, recvmmsg calls count in recvCalls and sendmmsg calls in sendCalls
+		int64_t sendDatagrams = 0;
+		int64_t dropDatagrams = 0; //received but dropped, truncated or with the socket's receive buffer full
+		int32_t sendChunks = 0; //send queue chunks held by connections past their send buffer, see NetEngineConfig::sendQueueLimit
+		int64_t ringHits = 0; //connection ring buffers taken from the worker's free blocks
+		int64_t ringMisses = 0; //the ones the arena or the heap had to provide
+		int64_t ringCached = 0; //bytes of free blocks the worker keeps for new connections
+	};
+
+	struct PollResult {
+		int32_t processed = 0;
+		bool remain = false; //events are still queued, Poll again when the frame allows
+	};
+
 	struct INetEngine {
 		virtual ~INetEngine() {}
 
-		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) = 0;
+		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options) = 0;
+		inline bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) {
+			return Listen(server, ip, port, sendSize, recvSize, fast, ListenOptions());
+		}
+
 		virtual void Stop(ITcpServer* server) = 0;
 		virtual bool Connect(ITcpSession* session, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) = 0;
 
-		virtual void Poll(int64_t frame) = 0;
+		//frame: time budget in microseconds, maxEvents: event budget, 0 for no limit on either.
+		//at least one event is dispatched per call, events out of budget stay queued in order
+		virtual PollResult Poll(int64_t frame, int32_t maxEvents = 0) = 0;
+
+		//stops every server, drains queued sends up to drainTimeout, joins the workers and releases all sessions.
+		//call it from the thread that runs Poll when sessions are dispatched there
 		virtual void Release() = 0;
+
+		virtual int32_t GetWorkerCount() const = 0;
+		virtual bool GetWorkerStat(int32_t index, NetWorkerStat& stat) const = 0;
+
+		//a datagram socket on ip:port, port 0 picks one. the session has its pipe once this returns true
+		//and OnBind tells when it is registered. epoll only, other backends return false
+		virtual bool Bind(IUdpSession* session, const char* ip, const int32_t port, const UdpOptions& options) { return false; }
+		inline bool Bind(IUdpSession* session, const char* ip, const int32_t port) {
+			return Bind(session, ip, port, UdpOptions());
+		}
+	};
+
+	//when a pipe's sends reach the socket
+	enum {
+		NET_FLUSH_ROUND = 0, //at the end of the round, earlier once more than a small write is queued
+		NET_FLUSH_WRITE_THROUGH, //every send is written right away, the lowest latency for one syscall per send
+		NET_FLUSH_CORK, //held until Flush or a large batch, written with MSG_MORE so the kernel fills whole segments
+	};
+
+	enum {
+		NET_WAIT_BLOCK = 0,
+		NET_WAIT_SLEEP,
+		NET_WAIT_SPIN, //workers poll with a zero timeout and never sleep, a full core each for the lowest latency
+	};
+
+	enum {
+		NET_DISPATCH_POLL = 0,
+		//session callbacks run on the io worker owning the socket, Poll has nothing to do.
+		//ITcpServer::MallocConnection must be thread safe, a pipe may only be used from its own callbacks
+		//and fast pipes are disabled
+		NET_DISPATCH_WORKER,
+	};
+
+	//which io worker a new connection is placed on
+	enum {
+		NET_PLACE_ROUND_ROBIN = 0,
+		NET_PLACE_LEAST_CONNECTIONS,
+		NET_PLACE_LEAST_BYTES, //lowest recv + send rate, fewest connections among rates within a quarter
+		NET_PLACE_HASH_ADDRESS, //remote ip only, every connection from one host shares a worker
+	};
+
+	enum {
+		NET_BACKEND_EPOLL = 0,
+		//one io_uring per worker with multishot accept and recv into provided buffers.
+		//CreateNetEngine returns nullptr where the kernel or the build lacks it, fast pipes are not supported
+		NET_BACKEND_URING,
+	};
+
+	struct NetEngineConfig {
+		int32_t threadCount = 4;
+		int8_t waitMode = NET_WAIT_BLOCK;
+		int32_t waitTimeout = 100; //ms, upper bound a blocked worker stays in the kernel before checking terminate
+		int8_t dispatchMode = NET_DISPATCH_POLL;
+		int8_t placement = NET_PLACE_ROUND_ROBIN;
+		int8_t backend = NET_BACKEND_EPOLL;
+
+		std::vector<int32_t> workerCpus; //worker i is pinned to workerCpus[i % size], empty leaves workers unpinned
+		int32_t pollCpu = -1; //the thread calling Poll is pinned on its first call, -1 leaves it alone
+		bool numaLocal = false; //connections and their buffers are allocated on the memory node of the owning worker's cpu
+
+		//ISendBuffer payloads from this size go out with MSG_ZEROCOPY, 0 sends every payload with a plain copy into the kernel.
+		//a connection whose zero-copy sends the kernel had to copy anyway (loopback) falls back for good. epoll only
+		int32_t zeroCopyThreshold = 0;
+
+		int32_t drainTimeout = 1000; //ms Release waits for queued sends to reach the kernel before closing connections
+
+		//bytes a connection may queue past a full send buffer in chunks from a per-worker pool, handed back as they are sent.
+		//the send buffer can then be sized for the usual backlog rather than the worst case. 0 fails the connection
+		//once its send buffer is full. not on iocp
+		int32_t sendQueueLimit = 0;
+
+		//recv rings map their pages twice back to back, OnRecv then always gets one contiguous NetBuffer a parser can
+		//scan in place. costs a memfd and two mappings per connection, rings are at least a page. not on iocp
+		bool mirrorRecvBuffer = false;
+
+		//bytes of a per-worker buffer reads land in, OnRecv is called straight from it and connections keep no recv ring
+		//while idle. only a partial message the session leaves behind gets a ring of recvSize, given back once consumed.
+		//epoll needs worker dispatch and ignores it under poll dispatch, uring delivers from its provided buffers in
+		//either mode whatever the size. 0 gives every connection a ring of its own. not on iocp
+		int32_t sharedRecvSize = 0;
+
+		//us the kernel busy polls the device queue of an empty socket before a worker is told it has nothing,
+		//SO_BUSY_POLL and SO_PREFER_BUSY_POLL on every socket and on the epoll instances. above net.core.busy_read
+		//it takes CAP_NET_ADMIN and is skipped without. only devices with napi benefit, loopback has none. not on iocp
+		int32_t busyPoll = 0;
+		//us an empty Poll keeps checking the event queue before it returns, the caller's loop never gives up the core. not on iocp
+		int32_t pollSpin = 0;
 	};
 
 	INetEngine* CreateNetEngine(int32_t threadCount);
+	INetEngine* CreateNetEngine(const NetEngineConfig& config);
 }
 
 #endif //__LIBNET_H__
@@ -2,22 +2,48 @@
 #define __ORINGBUFFER_h__
 #include "libnet.h"
 #include "util.h"
+#include "buffer_pool.h"
+#include <algorithm>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define RING_MIRROR_PAGE 4096 //a mirrored ring spans whole pages
 
 namespace libnet {
+	struct RingSpan {
+		char* data;
+		uint32_t size;
+	};
+
 	class RingBuffer {
 	public:
-		RingBuffer(int32_t size) {
+		//a mirrored ring maps its pages twice back to back, queued data and free space are then always one span.
+		//it falls back to plain storage when the mapping can't be made. a size of 0 starts without storage, Realloc gives it some
+		RingBuffer(int32_t size, BufferPool* pool = nullptr, bool mirrored = false) : _pool(pool), _mirrored(mirrored) {
+			_buffer = nullptr;
+			_size = 0;
+			_in = 0;
+			_out = 0;
+			if (size <= 0)
+				return;
+
 			if (size & (size - 1))
 				size = RoundupPowOfTwo(size);
+			if (_mirrored && size < RING_MIRROR_PAGE)
+				size = RING_MIRROR_PAGE;
 
-			_buffer = (char*)malloc(size);
-			_in = 0;
-			_out = 0;
 			_size = size;
+			_buffer = (char*)Alloc(size);
+			if (!_buffer && _mirrored) {
+				_mirrored = false;
+				_buffer = (char*)Alloc(size);
+			}
 		}
 
 		~RingBuffer() {
-			free(_buffer);
+			Free(_buffer);
 		}
 
 		inline uint32_t Fls(uint32_t size) {
@@ -42,6 +68,13 @@ namespace libnet {
 		}
 
 		inline uint32_t Size() const { return _in - _out; }
+		inline uint32_t Capacity() const { return _size; }
+		inline bool IsMirrored() const { return _mirrored; }
+		inline uint32_t FreeSize() const { return _size - _in + _out; }
+
+		//absolute write position, bytes queued ahead of it are Ahead(tail). Realloc rebases it
+		inline uint32_t Tail() const { return _in; }
+		inline uint32_t Ahead(uint32_t tail) const { return tail - _out; }
 
 		inline void In(const uint32_t size) {
 #ifdef WIN32
@@ -57,22 +90,37 @@ namespace libnet {
 				return nullptr;
 
 			uint32_t realIn = _in & (_size - 1);
-			uint32_t realOut = _out & (_size - 1);
-			if (realIn >= realOut)
-				size = _size - realIn;
-			else
-				size = realOut - realIn;
-
+			size = std::min(freeSize, Contiguous(realIn));
 			return _buffer + realIn;
 		}
 
+		//all free space, the second span is the part wrapped to the front. returns the span count
+		inline int32_t Write(RingSpan (&spans)[2]) {
+			uint32_t freeSize = _size - _in + _out;
+			if (freeSize == 0)
+				return 0;
+
+			uint32_t realIn = _in & (_size - 1);
+			uint32_t tail = Contiguous(realIn);
+			spans[0].data = _buffer + realIn;
+			if (freeSize <= tail) {
+				spans[0].size = freeSize;
+				return 1;
+			}
+
+			spans[0].size = tail;
+			spans[1].data = _buffer;
+			spans[1].size = freeSize - tail;
+			return 2;
+		}
+
 		inline bool WriteBlock(const void* content, const uint32_t size) {
 			uint32_t freeSize = _size - _in + _out;
 			if (freeSize < size)
 				return false;
 
 			uint32_t realIn = _in & (_size - 1);
-			if (size <= _size - realIn)
+			if (size <= Contiguous(realIn))
 				memcpy(_buffer + realIn, content, size);
 			else {
 				memcpy(_buffer + realIn, content, _size - realIn);
@@ -94,7 +142,7 @@ namespace libnet {
 
 			uint32_t realIn = _in & (_size - 1);
 			uint32_t realOut = _out & (_size - 1);
-			if (realIn > realOut) {
+			if (useSize <= Contiguous(realOut)) {
 				*size = useSize;
 				return _buffer + realOut;
 			}
@@ -120,16 +168,31 @@ namespace libnet {
 			if (useSize == 0)
 				return NULL;
 
-			uint32_t realIn = _in & (_size - 1);
 			uint32_t realOut = _out & (_size - 1);
-			if (realIn > realOut)
-				size = useSize;
-			else
-				size = _size - realOut;
-
+			size = std::min(useSize, Contiguous(realOut));
 			return _buffer + realOut;
 		}
 
+		//all queued data, the second span is the part wrapped to the front. returns the span count
+		inline int32_t Read(RingSpan (&spans)[2]) {
+			uint32_t useSize = _in - _out;
+			if (useSize == 0)
+				return 0;
+
+			uint32_t realOut = _out & (_size - 1);
+			uint32_t tail = Contiguous(realOut);
+			spans[0].data = _buffer + realOut;
+			if (useSize <= tail) {
+				spans[0].size = useSize;
+				return 1;
+			}
+
+			spans[0].size = tail;
+			spans[1].data = _buffer;
+			spans[1].size = useSize - tail;
+			return 2;
+		}
+
 		inline void Out(const uint32_t size) {
 			LIBNET_ASSERT(_in - _out >= size, "wtf");
 #ifdef WIN32
@@ -142,44 +205,109 @@ namespace libnet {
 		inline void Realloc(uint32_t size) {
 			if (size & (size - 1))
 				size = RoundupPowOfTwo(size);
+			if (_mirrored && size < RING_MIRROR_PAGE)
+				size = RING_MIRROR_PAGE;
 
 			uint32_t usedSize = _in - _out;
 			if (usedSize > size)
 				return;
 
-			char* buffer = (char*)malloc(size);
+			char* buffer = (char*)Alloc(size);
 			if (!buffer)
 				return;
 
 			if (usedSize > 0) {
-				uint32_t realIn = _in & (_size - 1);
 				uint32_t realOut = _out & (_size - 1);
-
-				if (realIn > realOut)
-					memcpy(buffer, _buffer + realOut, usedSize);
-				else {
-					memcpy(buffer, _buffer + realOut, _size - realOut);
-					memcpy(buffer + _size - realOut, _buffer, realIn);
-				}
+				uint32_t head = std::min(usedSize, Contiguous(realOut));
+				memcpy(buffer, _buffer + realOut, head);
+				memcpy(buffer + head, _buffer, usedSize - head);
 			}
 
-			free(_buffer);
+			Free(_buffer);
 			_buffer = buffer;
 			_out = 0;
 			_in = usedSize;
 			_size = size;
 		}
 
+		//an empty ring gives its storage back until Realloc asks for it again
+		inline void Release() {
+			LIBNET_ASSERT(_in == _out, "wtf");
+			Free(_buffer);
+			_buffer = nullptr;
+			_size = 0;
+			_in = 0;
+			_out = 0;
+		}
+
+		//one span whenever the data doesn't wrap, always on a mirrored ring
 		inline NetBuffer GetReadBuffer() {
-			uint32_t realIn = _in & (_size - 1);
+			uint32_t useSize = _in - _out;
 			uint32_t realOut = _out & (_size - 1);
-			if (realIn > realOut)
-				return NetBuffer(_buffer + realOut, realIn - realOut, nullptr, 0);
+			uint32_t head = std::min(useSize, Contiguous(realOut));
+			if (head == useSize)
+				return NetBuffer(_buffer + realOut, useSize, nullptr, 0);
 			else
-				return NetBuffer(_buffer + realOut, _size - realOut, _buffer, realIn);
+				return NetBuffer(_buffer + realOut, head, _buffer, useSize - head);
 		}
 
 	private:
+		//bytes addressable in one piece from a position, the second mapping continues where the first ends
+		inline uint32_t Contiguous(uint32_t real) const { return _mirrored ? _size : _size - real; }
+
+		//storage of _size bytes goes back to the pool it came from
+		inline void* Alloc(uint32_t size) {
+			if (_mirrored)
+				return MapMirror(size);
+			return _pool ? _pool->Get(size) : malloc(size);
+		}
+
+		inline void Free(void* p) {
+			if (_mirrored)
+				UnmapMirror(p, _size);
+			else if (_pool)
+				_pool->Put(p, _size);
+			else
+				free(p);
+		}
+
+		//a memfd of size bytes mapped at [p, p + size) and again at [p + size, p + 2 * size)
+		static void* MapMirror(uint32_t size) {
+#ifdef WIN32
+			return nullptr;
+#else
+			int32_t fd = memfd_create("libnet_ring", MFD_CLOEXEC);
+			if (fd < 0)
+				return nullptr;
+
+			char* p = nullptr;
+			if (ftruncate(fd, size) == 0) {
+				void* area = mmap(nullptr, (size_t)size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (area != MAP_FAILED) {
+					p = (char*)area;
+					if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+						|| mmap(p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+						munmap(area, (size_t)size * 2);
+						p = nullptr;
+					}
+				}
+			}
+
+			//the mappings keep the pages
+			close(fd);
+			return p;
+#endif
+		}
+
+		static void UnmapMirror(void* p, uint32_t size) {
+#ifndef WIN32
+			if (p)
+				munmap(p, (size_t)size * 2);
+#endif
+		}
+
+		BufferPool* _pool;
+		bool _mirrored;
 		char * _buffer;
 		uint32_t _size;
 		uint32_t _in;
@@ -0,0 +1,114 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+#include "libnet.h"
+#include "node_arena.h"
+#include <atomic>
+#include <algorithm>
+
+#define BUFFER_POOL_MIN_SHIFT 10 //1K, smaller rings share the class
+#define BUFFER_POOL_MAX_SHIFT 20 //1M, larger rings bypass the pool
+#define BUFFER_POOL_CLASS_BYTES (2 << 20) //free bytes a worker keeps per class
+#define BUFFER_POOL_CLASS_MIN 2 //free blocks a worker keeps per class whatever their size
+
+namespace libnet {
+	/**
+	* Power-of-two blocks backing ring buffers of one worker, only touched by the thread dispatching its sessions,
+	* which is where connections are made, resized and freed. Freed blocks are kept per size class for the next
+	* connection, what the classes can't keep and sizes past the largest one go back to the worker's arena or the heap.
+	*/
+	class BufferPool {
+		struct FreeBlock {
+			FreeBlock* next;
+		};
+
+	public:
+		BufferPool() {
+			memset(_free, 0, sizeof(_free));
+			memset(_freeCount, 0, sizeof(_freeCount));
+		}
+
+		~BufferPool() { Clear(); }
+
+		BufferPool(const BufferPool&) = delete;
+		BufferPool& operator=(const BufferPool&) = delete;
+
+		//before any block is taken, blocks then come from the arena's memory node
+		inline void SetArena(NodeArena* arena) { _arena = arena; }
+
+		//the cached blocks, before the arena they came from goes away
+		void Clear() {
+			for (int32_t i = 0; i <= BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT; ++i) {
+				while (_free[i]) {
+					FreeBlock* block = _free[i];
+					_free[i] = block->next;
+					NodeArena::Free(block);
+				}
+				_freeCount[i] = 0;
+			}
+			_cached.store(0, std::memory_order_relaxed);
+		}
+
+		//size is rounded up to its class, Put takes the same size back
+		void* Get(uint32_t size) {
+			int32_t shift = Shift(size);
+			if (shift > BUFFER_POOL_MAX_SHIFT) {
+				_misses.fetch_add(1, std::memory_order_relaxed);
+				return NodeArena::Alloc(_arena, size);
+			}
+
+			int32_t index = shift - BUFFER_POOL_MIN_SHIFT;
+			FreeBlock* block = _free[index];
+			if (!block) {
+				_misses.fetch_add(1, std::memory_order_relaxed);
+				return NodeArena::Alloc(_arena, (size_t)1 << shift);
+			}
+
+			_free[index] = block->next;
+			--_freeCount[index];
+			_cached.fetch_sub((int64_t)1 << shift, std::memory_order_relaxed);
+			_hits.fetch_add(1, std::memory_order_relaxed);
+			return block;
+		}
+
+		void Put(void* p, uint32_t size) {
+			if (!p)
+				return;
+
+			int32_t shift = Shift(size);
+			int32_t index = shift - BUFFER_POOL_MIN_SHIFT;
+			if (shift > BUFFER_POOL_MAX_SHIFT || _freeCount[index] >= std::max(BUFFER_POOL_CLASS_BYTES >> shift, BUFFER_POOL_CLASS_MIN)) {
+				NodeArena::Free(p);
+				return;
+			}
+
+			FreeBlock* block = (FreeBlock*)p;
+			block->next = _free[index];
+			_free[index] = block;
+			++_freeCount[index];
+			_cached.fetch_add((int64_t)1 << shift, std::memory_order_relaxed);
+		}
+
+		//read by GetWorkerStat from any thread
+		inline int64_t GetHits() const { return _hits.load(std::memory_order_relaxed); }
+		inline int64_t GetMisses() const { return _misses.load(std::memory_order_relaxed); }
+		inline int64_t GetCached() const { return _cached.load(std::memory_order_relaxed); }
+
+	private:
+		static inline int32_t Shift(uint32_t size) {
+			int32_t shift = BUFFER_POOL_MIN_SHIFT;
+			while (shift <= BUFFER_POOL_MAX_SHIFT && ((uint32_t)1 << shift) < size)
+				++shift;
+			return shift;
+		}
+
+		NodeArena* _arena = nullptr;
+		FreeBlock* _free[BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1];
+		int32_t _freeCount[BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1];
+
+		std::atomic<int64_t> _hits = { 0 };
+		std::atomic<int64_t> _misses = { 0 };
+		std::atomic<int64_t> _cached = { 0 };
+	};
+}
+
+#endif //__BUFFER_POOL_H__
@@ -16,13 +16,15 @@ namespace libnet {
 
 	int64_t Connection::s_nextId = 0;
 
-	Connection::Connection(int32_t fd, NetEngine* engine, int32_t sendSize, int32_t recvSize, bool fast)
-		: _fd(fd), _engine(engine), _sendSize(sendSize), _recvSize(recvSize), _sendBuffer(fast ? FAST_SEND_SIZE : sendSize), _recvBuffer(fast ? FAST_RECV_SIZE : recvSize), _fast(fast) {
+	Connection::Connection(int32_t fd, NetEngine* engine, int32_t sendSize, int32_t recvSize, bool fast, BufferPool* buffers)
+		: _fd(fd), _engine(engine), _sendSize(sendSize), _recvSize(recvSize), _sendBuffer(fast ? FAST_SEND_SIZE : sendSize, buffers),
+		_recvBuffer(fast ? FAST_RECV_SIZE : (engine->IsSharedRecv() ? 0 : recvSize), buffers, !fast && engine->IsMirrorRecv()), _sharedRecv(!fast && engine->IsSharedRecv()),
+		_readyHook(this), _fast(fast) {
 		memset(&_event, 0, sizeof(_event));
 		_event.context = this;
 		_event.sock = _fd;
 		_event.opt = EPOLL_OPT_IO;
-		_event.epollFd = 0;
+		_event.worker = nullptr;
 
 		++s_nextId;
 		if (s_nextId <= 0)
@@ -40,19 +42,191 @@ namespace libnet {
 				}
 			}
 			else {
-				if (!_sendBuffer.WriteBlock(context, size)) {
+				//once a chunk is filling everything goes there, the ring would get ahead of it
+				if ((_chunk || !_sendBuffer.WriteBlock(context, size)) && !Spill(context, size)) {
 					LIBNET_ASSERT(_recving, "wtf");
 					Shutdown();
 					return;
 				}
 
-				if (!_sending) {
-					if (_sendBuffer.Size() > MIN_SEND_BUFF_SIZE) {
-						UpdateSend();
-					}
-				}
+				if (!_sending && IsSendDue())
+					UpdateSend();
 			}
+
+			CheckReady();
+		}
+	}
+
+	void Connection::Send(ISendBuffer* buffer) {
+		//fast pipes only carry the shared memory ring
+		if (_fast || buffer->Size() <= 0) {
+			IPipe::Send(buffer);
+			return;
+		}
+
+		if (_closing || _closed) {
+			buffer->Release();
+			return;
+		}
+
+		QueuePayload(NewPayload(buffer, -1, 0, buffer->Size(), _sendBuffer.Tail()));
+	}
+
+	void Connection::SendFile(int32_t fd, int64_t offset, int64_t size) {
+		if (_fast) {
+			IPipe::SendFile(fd, offset, size);
+			return;
+		}
+
+		if (_closing || _closed || size <= 0)
+			return;
+
+		int32_t file = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (file < 0) {
+			Shutdown();
+			return;
+		}
+
+		QueuePayload(NewPayload(nullptr, file, offset, size, _sendBuffer.Tail()));
+	}
+
+	//the queued ring bytes [offset, offset + size) as at most two iovecs
+	static int32_t RingIov(const RingSpan (&spans)[2], uint32_t offset, uint32_t size, iovec* iov) {
+		uint32_t head = spans[0].size;
+		if (offset >= head) {
+			iov[0].iov_base = spans[1].data + offset - head;
+			iov[0].iov_len = size;
+			return 1;
+		}
+
+		iov[0].iov_base = spans[0].data + offset;
+		if (offset + size <= head) {
+			iov[0].iov_len = size;
+			return 1;
+		}
+
+		iov[0].iov_len = head - offset;
+		iov[1].iov_base = spans[1].data;
+		iov[1].iov_len = size - (head - offset);
+		return 2;
+	}
+
+	//the queued part of the ring, zeroed so an empty or unwrapped ring leaves the spans it doesn't use untouched
+	static uint32_t ReadQueued(RingBuffer& ring, RingSpan (&spans)[2]) {
+		spans[0] = spans[1] = RingSpan();
+		int32_t count = ring.Read(spans);
+		return count > 1 ? spans[0].size + spans[1].size : (count > 0 ? spans[0].size : 0);
+	}
+
+	int32_t Connection::GatherSend(iovec* iov, SendPayload** pieces, int32_t max) {
+		RingSpan spans[2];
+		uint32_t queued = ReadQueued(_sendBuffer, spans);
+
+		//bytes written and a payload queued behind them after the read, the bytes are published before the payload
+		SendPayload* payload = FrontPayload();
+		if (payload && _sendBuffer.Ahead(payload->tail) > queued)
+			queued = ReadQueued(_sendBuffer, spans);
+
+		int32_t count = 0;
+		uint32_t offset = 0;
+		bool fetched = false;
+		while (true) {
+			//past the last fetched payload only while none is queued, one queued later lands behind every byte read.
+			//never past the bytes read, a payload behind more of them waits for the next call
+			uint32_t end = queued;
+			bool behind = false;
+			if (payload) {
+				end = std::min(_sendBuffer.Ahead(payload->tail), queued);
+				behind = _sendBuffer.Ahead(payload->tail) > queued;
+			}
+			else if (fetched && !_payloads.Empty())
+				end = offset;
+
+			if (end > offset) {
+				if (count + 2 > max)
+					break;
+
+				int32_t n = RingIov(spans, offset, end - offset, iov + count);
+				for (int32_t i = 0; i < n; ++i)
+					pieces[count + i] = nullptr;
+				count += n;
+				offset = end;
+			}
+
+			if (!payload || behind || !payload->buffer || count + 1 > max)
+				break;
+
+			int32_t size = payload->buffer->Size() - (int32_t)payload->offset;
+			if (IsZeroCopy(size))
+				break;
+
+			iov[count].iov_base = (char*)payload->buffer->Data() + payload->offset;
+			iov[count].iov_len = size;
+			pieces[count++] = payload;
+
+			payload = _sendingPayloads.After(payload);
+			fetched = true;
+		}
+		return count;
+	}
+
+	int32_t Connection::OutGathered(const iovec* iov, SendPayload* const* pieces, int32_t count, int32_t len) {
+		for (int32_t i = 0; i < count && len > 0; ++i) {
+			int32_t size = (int32_t)std::min<size_t>(iov[i].iov_len, (size_t)len);
+			if (pieces[i])
+				OutPayload(pieces[i], size);
+			else
+				_sendBuffer.Out(size);
+			len -= size;
+		}
+		return SendLeft();
+	}
+
+	bool Connection::Spill(const char* context, int32_t size) {
+		NetWorker* worker = _event.worker;
+		while (size > 0) {
+			if (!_chunk || _chunk->size == SEND_CHUNK_DATA) {
+				if (_chunk)
+					QueueChunk();
+
+				if (!worker || _chunkBytes + SEND_CHUNK_DATA > _engine->GetSendQueueLimit())
+					return false;
+
+				_chunk = worker->chunks.Get(worker->arena, &_chunkBytes);
+				if (!_chunk)
+					return false;
+			}
+
+			int32_t len = std::min(size, SEND_CHUNK_DATA - _chunk->size);
+			memcpy(_chunk->data + _chunk->size, context, len);
+			_chunk->size += len;
+			context += len;
+			size -= len;
 		}
+		return true;
+	}
+
+	//behind every ring byte written so far, ring bytes after it go out after the chunk
+	void Connection::QueueChunk() {
+		SendChunk* chunk = _chunk;
+		_chunk = nullptr;
+
+		_payloadCount.fetch_add(1, std::memory_order_release);
+		_payloads.InsertHead(NewPayload(chunk, -1, 0, chunk->size, _sendBuffer.Tail()));
+	}
+
+	void Connection::QueuePayload(SendPayload* payload) {
+		if (_chunk)
+			QueueChunk();
+
+		_payloadCount.fetch_add(1, std::memory_order_release);
+		_payloads.InsertHead(payload);
+
+		//a small buffer waits for the round like ring bytes and leaves gathered with them
+		if (!_sending && (!payload->buffer || payload->size > MIN_SEND_BUFF_SIZE || IsSendDue()))
+			UpdateSend();
+
+		CheckReady();
 	}
 
 	void Connection::Close() {
@@ -60,20 +234,24 @@ namespace libnet {
 			return;
 
 		_closing = true;
+		_flush.store(true, std::memory_order_release);
 		if (!_sending) {
-			if (_sendBuffer.Size() > 0) {
+			if (HasQueuedSend()) {
 				UpdateSend();
 			}
 		}
 
 		if (!_sending)
 			Shutdown();
+
+		CheckReady();
 	}
 
 	void Connection::Shutdown() {
+		//keep the fd registered, epoll reports the hangup and OnFail releases the connection
 		if (!_closed) {
 			_closed = true;
-			close(_fd);
+			shutdown(_fd, SHUT_RDWR);
 		}
 	}
 
@@ -82,18 +260,24 @@ namespace libnet {
 			_adjustSend = size;
 
 			if (!_fast) {
-				if (!_sending) {
+				//queued payloads remember ring positions, the ring stays put until they are sent
+				if (!_sending && _payloadCount == 0) {
 					_sendBuffer.Realloc(_adjustSend);
 					_adjustSend = 0;
 				}
 			}
 			else
 				DoAdjustFastSendBuffSize();
+
+			CheckReady();
 		}
 	}
 
 	void Connection::AdjustRecvBuffSize(const int32_t size) {
-		if (size > _recvSize)
+		//the size a partial message gets, a ring holding one is grown on the next read
+		if (_sharedRecv && size > _recvSize && _recvBuffer.Capacity() == 0)
+			_recvSize = size;
+		else if (size > _recvSize)
 			_adjustRecv = size;
 	}
 
@@ -138,8 +322,39 @@ namespace libnet {
 		}
 	}
 
+	void Connection::SetFlushPolicy(const int8_t policy) {
+		//whatever the cork held goes out under the new policy
+		if (_flushPolicy.exchange(policy, std::memory_order_relaxed) == NET_FLUSH_CORK && policy != NET_FLUSH_CORK)
+			Flush();
+	}
+
+	void Connection::Flush() {
+		if (_closing || _closed || (_fast && _fastConnected))
+			return;
+
+		_flush.store(true, std::memory_order_release);
+		if (!_sending) {
+			if (HasQueuedSend())
+				UpdateSend();
+			else
+				EndFlush();
+		}
+
+		CheckReady();
+	}
+
+	void Connection::EndFlush() {
+		if (_corked.exchange(false, std::memory_order_acq_rel))
+			PushCorked(_fd);
+
+		_flush.store(false, std::memory_order_release);
+	}
+
 	void Connection::UpdateSend() {
-		int32_t left = _engine->DoSend(this);
+		if (_chunk)
+			QueueChunk();
+
+		int32_t left = _engine->DoSend(this, _engine->IsRunToCompletion());
 		if (left < 0) {
 			LIBNET_ASSERT(_recving, "wtf");
 			Shutdown();
@@ -151,6 +366,8 @@ namespace libnet {
 				Shutdown();
 			}
 		}
+		else if (_flush.load(std::memory_order_relaxed) && !_closing)
+			EndFlush();
 	}
 
 	void Connection::UpdateFast() {
@@ -178,7 +395,7 @@ namespace libnet {
 		}
 
 		if (!_fast) {
-			if (_adjustSend > 0) {
+			if (_adjustSend > 0 && _payloadCount == 0) {
 				_sendBuffer.Realloc(_adjustSend);
 				_adjustSend = 0;
 			}
@@ -187,15 +404,22 @@ namespace libnet {
 		if (_closing) {
 			LIBNET_ASSERT(_recving, "wtf");
 
-			if (_sendBuffer.Size() > 0) {
+			if (HasQueuedSend()) {
 				UpdateSend();
 			}
 			else
 				Shutdown();
 		}
+		else if (_flush.load(std::memory_order_relaxed) && !HasQueuedSend())
+			EndFlush();
+
+		CheckReady();
 	}
 
 	void Connection::OnRecv() {
+		//cleared before reading so data landing from now on raises a new notification
+		_recvPending.exchange(false, std::memory_order_acq_rel);
+
 		if (_fast) {
 			while (_recvBuffer.Size() > 0) {
 				if (_recvBuffer.Size() >= sizeof(int32_t)) {
@@ -262,23 +486,51 @@ namespace libnet {
 					_recvBuffer.Out(len);
 				else if (len < 0)
 					Shutdown();
+
+				//the partial message is complete, the next read goes to the scratch buffer again.
+				//a size asked for meanwhile is the one the next partial message gets, not a ring to grow
+				if (_sharedRecv && _recvBuffer.Size() == 0) {
+					_recvBuffer.Release();
+					_recvSize = std::max(_recvSize, _adjustRecv);
+					_adjustRecv = 0;
+				}
 			}
 		}
+
+		CheckReady();
+	}
+
+	void Connection::OnRecv(char* data, int32_t size) {
+		LIBNET_ASSERT(_session, "Connection::OnRecv session is empty");
+
+		int32_t len = _session->OnRecv(NetBuffer(data, size, nullptr, 0));
+		if (len < 0)
+			Shutdown();
+		else if (len < size && !_closed) {
+			//only the rest outlives the scratch buffer, a ring too small for it fails like a full one
+			_recvBuffer.Realloc(std::max(_recvSize, size - len));
+			if (!_recvBuffer.WriteBlock(data + len, size - len))
+				Shutdown();
+		}
+
+		CheckReady();
 	}
 
 	void Connection::OnRecvDone() {
 		if (_adjustRecv > 0) {
-			_recvBuffer.Realloc(_adjustRecv);
+			if (!_sharedRecv || _recvBuffer.Capacity() > 0)
+				_recvBuffer.Realloc(_adjustRecv);
+			_recvSize = _adjustRecv;
 			_adjustRecv = 0;
 		}
 
 		int32_t len = 0;
 		while (true) {
-			uint32_t size = 0;
-			char* recvBuf = GetRecvBuffer(size);
+			iovec iov[2];
+			int32_t count = GetRecvBuffer(iov);
 
-			if (recvBuf && size > 0) {
-				len = recv(_fd, recvBuf, size, 0);
+			if (count > 0) {
+				len = (int32_t)readv(_fd, iov, count);
 				if (len < 0 && errno == EAGAIN)
 					break;
 			}
@@ -296,17 +548,80 @@ namespace libnet {
 		OnRecv();
 	}
 
+	bool Connection::EnableZeroCopy(int32_t threshold) {
+		const int32_t flag = 1;
+		if (_fast || setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, (const char*)&flag, sizeof(flag)) != 0)
+			return false;
+
+		_zeroCopySocket = true;
+		_zeroCopyThreshold = threshold;
+		return true;
+	}
+
+	int32_t Connection::OutPayload(SendPayload* payload, int32_t size) {
+		payload->offset += size;
+		if (payload->offset == payload->size) {
+			_sendingPayloads.Fetch();
+			_payloadCount.fetch_sub(1, std::memory_order_release);
+
+			//the kernel copied everything else, a zero-copy send still pins the pages until its completion
+			if (payload->zeroCopy && (int32_t)(payload->seq - _zeroCopyDone) >= 0)
+				_zeroCopyPending.push_back(payload);
+			else if (!_sending)
+				FreePayload(payload); //gathered by the session side itself
+			else
+				_engine->ReleasePayload(_event.worker, payload);
+		}
+		return SendLeft();
+	}
+
+	void Connection::OnZeroCopyDone(uint32_t done, bool copied) {
+		if ((int32_t)(done - _zeroCopyDone) > 0)
+			_zeroCopyDone = done;
+
+		//deferred copies cost more than plain sends, stop asking once the kernel falls back
+		if (copied)
+			_zeroCopyThreshold = 0;
+
+		while (!_zeroCopyPending.empty() && (int32_t)(_zeroCopyPending.front()->seq - _zeroCopyDone) < 0) {
+			_engine->ReleasePayload(_event.worker, _zeroCopyPending.front());
+			_zeroCopyPending.pop_front();
+		}
+	}
+
+	//the socket is closed, pages still pinned by it stay valid whatever the application does with them
+	void Connection::ReleasePayloads() {
+		if (_chunk) {
+			_chunk->Release();
+			_chunk = nullptr;
+		}
+
+		while (!_sendingPayloads.Empty())
+			FreePayload(_sendingPayloads.Fetch());
+
+		_payloads.Sweep(FreePayload);
+
+		for (auto* payload : _zeroCopyPending)
+			FreePayload(payload);
+		_zeroCopyPending.clear();
+
+		_payloadCount = 0;
+	}
+
 	void Connection::OnFail() {
 		_recving = false;
 		_sending = false;
 
 		Shutdown();
+		close(_fd);
+		ReleasePayloads();
 
 		_session->OnDisconnect();
 		_session->SetPipe(nullptr);
 
 		_session->Release();
 		_engine->Remove(this);
+		_readyHook.Unlink();
 		delete this;
 	}
 }
@@ -4,13 +4,27 @@
 #include "net.h"
 #include "RingBuffer.h"
 #include "share_memory.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
 
 namespace libnet {
 	class Connection : public IPipe {
 		friend class NetEngine;
 	public:
-		Connection(int32_t fd, NetEngine* engine, int32_t sendSize, int32_t recvSize, bool fast);
-		virtual ~Connection() {}
+		Connection(int32_t fd, NetEngine* engine, int32_t sendSize, int32_t recvSize, bool fast, BufferPool* buffers);
+		virtual ~Connection() { _readyHook.Unlink(); }
+
+		//connections live in the owning worker's arena when the engine is numa local
+		static void* operator new(size_t size, NodeArena* arena) {
+			void* p = NodeArena::Alloc(arena, size);
+			if (!p)
+				throw std::bad_alloc();
+			return p;
+		}
+
+		static void operator delete(void* p) { NodeArena::Free(p); }
+		static void operator delete(void* p, NodeArena*) { NodeArena::Free(p); }
 
 		inline void Attach(ITcpSession* session) {
 			_session = session;
@@ -18,31 +32,107 @@ namespace libnet {
 		}
 
 		virtual void Send(const char* context, const int32_t size);
+		virtual void Send(ISendBuffer* buffer);
+		virtual void SendFile(int32_t fd, int64_t offset, int64_t size);
 		virtual void Close();
 		virtual void Shutdown();
 
 		virtual void AdjustSendBuffSize(const int32_t size);
 		virtual void AdjustRecvBuffSize(const int32_t size);
 
+		virtual void SetFlushPolicy(const int8_t policy);
+		virtual void Flush();
+
 		void DoAdjustFastSendBuffSize();
 
 		inline bool IsAdjustRecvBuff() const { return !_fast && _adjustRecv > 0; }
+		//io side, nothing left over from the last read, the next one goes into the worker's scratch buffer
+		inline bool IsRecvIdle() const { return _sharedRecv && _recvBuffer.Capacity() == 0; }
 
 		void OnConnected(bool accept);
 
 		inline int32_t GetSocket() const { return _fd; }
 		inline EpollBase& GetEvent() { return _event; }
+		inline IntrusiveListHook<Connection>& GetReadyHook() { return _readyHook; }
 
 		inline void In(int32_t size) { _recvBuffer.In(size); }
-		inline int32_t Out(int32_t size) { _sendBuffer.Out(size); return _sendBuffer.Size(); }
+		inline int32_t Out(int32_t size) { _sendBuffer.Out(size); return SendLeft(); }
+
+		//sender side, a payload counts as one until it is fully sent
+		inline int32_t SendLeft() const { return (int32_t)_sendBuffer.Size() + _payloadCount.load(std::memory_order_acquire); }
 
 		inline char* GetSendBuffer(uint32_t& size) { return _sendBuffer.Read(size); }
+
+		//ring bytes and buffer payloads leaving in one sendmsg, in queue order. pieces[i] is the payload iov[i]
+		//carries, null for ring bytes. it stops at a file or a zero-copy payload, those go out on their own
+		int32_t GatherSend(iovec* iov, SendPayload** pieces, int32_t max);
+		//len bytes of what GatherSend returned went out
+		int32_t OutGathered(const iovec* iov, SendPayload* const* pieces, int32_t count, int32_t len);
 		inline char* GetRecvBuffer(uint32_t& size) { return _recvBuffer.Write(size); }
+		inline int32_t GetRecvBuffer(iovec (&iov)[2]) {
+			RingSpan spans[2];
+			int32_t count = _recvBuffer.Write(spans);
+			for (int32_t i = 0; i < count; ++i) {
+				iov[i].iov_base = spans[i].data;
+				iov[i].iov_len = spans[i].size;
+			}
+			return count;
+		}
+
+		//sender side. the ring is read before fetching, a payload queued ahead of the bytes seen is fetched with them
+		inline SendPayload* FrontPayload() {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (_sendingPayloads.Empty())
+				_sendingPayloads = _payloads.Fetch();
+			return _sendingPayloads.Front();
+		}
+
+		inline bool IsZeroCopy(int32_t size) const { return _zeroCopyThreshold > 0 && size >= _zeroCopyThreshold; }
+		inline bool HasZeroCopy() const { return _zeroCopySocket; }
+		inline void MarkZeroCopy(SendPayload* payload) {
+			payload->zeroCopy = true;
+			payload->seq = _zeroCopySeq++;
+		}
+
+		bool EnableZeroCopy(int32_t threshold);
+		int32_t OutPayload(SendPayload* payload, int32_t size);
+		void OnZeroCopyDone(uint32_t done, bool copied);
+
+		//io side, true when the caller has to publish a NET_RECV
+		inline bool MarkRecvPending() { return !_recvPending.exchange(true, std::memory_order_acq_rel); }
 
 		inline bool IsClosing() const { return _closing; }
-		inline bool NeedUpdateSend() const { return !_closing && !_closed && !_sending && _sendBuffer.Size() > 0; }
+		inline bool IsClosed() const { return _closed; }
+		inline bool HasQueuedSend() const { return _sendBuffer.Size() > 0 || _payloadCount.load(std::memory_order_acquire) > 0 || _chunk; }
+		inline bool HasPendingSend() const { return !_closed && HasQueuedSend(); }
+		inline bool NeedUpdateSend() const { return !_closing && !_closed && !_sending && HasQueuedSend() && !IsHeld(); }
+
+		//a corked ring waits for Flush until it holds a batch worth writing, payloads are never held
+		inline bool IsHeld() const {
+			return _flushPolicy.load(std::memory_order_relaxed) == NET_FLUSH_CORK && !_flush.load(std::memory_order_acquire)
+				&& _payloadCount.load(std::memory_order_acquire) == 0 && _sendBuffer.Size() < std::min<uint32_t>(CORK_SEND_SIZE, _sendBuffer.Capacity() / 2);
+		}
+
+		//whether Send writes right away instead of leaving it to the round
+		inline bool IsSendDue() const {
+			switch (_flushPolicy.load(std::memory_order_relaxed)) {
+			case NET_FLUSH_WRITE_THROUGH: return true;
+			case NET_FLUSH_CORK: return !IsHeld();
+			default: return _sendBuffer.Size() > MIN_SEND_BUFF_SIZE;
+			}
+		}
+
+		//io side, the next write carries MSG_MORE
+		inline bool IsCorked() const { return _flushPolicy.load(std::memory_order_relaxed) == NET_FLUSH_CORK && !_flush.load(std::memory_order_acquire); }
+		inline void SetCorked(bool corked) { _corked.store(corked, std::memory_order_release); }
 		inline bool IsFastConnected() const { return !_closing && !_closed && _fast && _fastConnected; }
 
+		//queues the connection for the next Poll when it has work there
+		inline void CheckReady() {
+			if (!_readyHook.IsLinked() && _event.worker && (NeedUpdateSend() || IsFastConnected()))
+				_engine->AddReady(this);
+		}
+
 		inline void SetRemoteIp(const char * ip) const { SafeSprintf((char*)_remoteIp, sizeof(_remoteIp), "%s", ip); }
 		inline void SetRemotePort(int32_t port) { _remotePort = port; }
 
@@ -50,9 +140,18 @@ namespace libnet {
 		void UpdateFast();
 		void OnSendDone();
 		void OnRecv();
+		//run to completion, data read into the worker's scratch buffer. what the session leaves gets a ring
+		void OnRecv(char* data, int32_t size);
 		void OnRecvDone();
 		void OnFail();
 
+	private:
+		void QueuePayload(SendPayload* payload);
+		void ReleasePayloads();
+		void EndFlush();
+		bool Spill(const char* context, int32_t size);
+		void QueueChunk();
+
 	private:
 		int32_t _fd;
 		NetEngine* _engine;
@@ -62,6 +161,7 @@ namespace libnet {
 
 		RingBuffer _sendBuffer;
 		RingBuffer _recvBuffer;
+		bool _sharedRecv; //reads land in the worker's scratch, the recv ring only holds a partial message
 
 		ShareMemory _shareMemorySendBuffer;
 		ShareMemory _shareMemoryRecvBuffer;
@@ -74,7 +174,30 @@ namespace libnet {
 		bool _recving = true;
 		bool _sending = false;
 
+		std::atomic<bool> _recvPending = { false };
+
+		std::atomic<int8_t> _flushPolicy = { NET_FLUSH_ROUND };
+		std::atomic<bool> _flush = { false }; //set by Flush until everything queued before it is written
+		std::atomic<bool> _corked = { false }; //the last write carried MSG_MORE, the kernel may still hold part of it
+
+		//queued by the session side, sent in order by whichever side sends
+		AtomicIntrusiveLinkedList<SendPayload, &SendPayload::next> _payloads;
+		AtomicIntrusiveLinkedFetchedList<SendPayload, &SendPayload::next> _sendingPayloads;
+		std::atomic<int32_t> _payloadCount = { 0 }; //queued and not fully sent
+
+		//session side, the send queue past a full ring
+		SendChunk* _chunk = nullptr; //still filling, queued once full or sent
+		int32_t _chunkBytes = 0; //held in chunks, up to the engine's sendQueueLimit
+
+		//zero-copy sends, only touched by the worker once the socket has them
+		bool _zeroCopySocket = false;
+		int32_t _zeroCopyThreshold = 0;
+		uint32_t _zeroCopySeq = 0;
+		uint32_t _zeroCopyDone = 0; //every send before it is complete
+		std::deque<SendPayload*> _zeroCopyPending; //sent, the kernel may still read them
+
 		EpollBase _event;
+		IntrusiveListHook<Connection> _readyHook;
 
 		bool _fast;
 		bool _fastConnected = false;
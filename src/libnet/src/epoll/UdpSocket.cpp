@@ -0,0 +1,316 @@
+#include "UdpSocket.h"
+#include "util.h"
+#include <algorithm>
+
+namespace libnet {
+	//size bytes at offset of the queued or free spans of a ring
+	static void SpanCopyOut(const RingSpan (&spans)[2], uint32_t offset, void* dst, uint32_t size) {
+		uint32_t head = spans[0].size;
+		if (offset >= head)
+			memcpy(dst, spans[1].data + offset - head, size);
+		else if (offset + size <= head)
+			memcpy(dst, spans[0].data + offset, size);
+		else {
+			memcpy(dst, spans[0].data + offset, head - offset);
+			memcpy((char*)dst + head - offset, spans[1].data, size - (head - offset));
+		}
+	}
+
+	static void SpanCopyIn(const RingSpan (&spans)[2], uint32_t offset, const void* src, uint32_t size) {
+		uint32_t head = spans[0].size;
+		if (offset >= head)
+			memcpy(spans[1].data + offset - head, src, size);
+		else if (offset + size <= head)
+			memcpy(spans[0].data + offset, src, size);
+		else {
+			memcpy(spans[0].data + offset, src, head - offset);
+			memcpy(spans[1].data, (const char*)src + head - offset, size - (head - offset));
+		}
+	}
+
+	//the same range as iovecs, returns how many it took
+	static int32_t SpanIov(const RingSpan (&spans)[2], uint32_t offset, uint32_t size, iovec* iov) {
+		if (size == 0)
+			return 0;
+
+		uint32_t head = spans[0].size;
+		if (offset >= head) {
+			iov[0].iov_base = spans[1].data + offset - head;
+			iov[0].iov_len = size;
+			return 1;
+		}
+
+		iov[0].iov_base = spans[0].data + offset;
+		if (offset + size <= head) {
+			iov[0].iov_len = size;
+			return 1;
+		}
+
+		iov[0].iov_len = head - offset;
+		iov[1].iov_base = spans[1].data;
+		iov[1].iov_len = size - (head - offset);
+		return 2;
+	}
+
+	//header and datagram are published together, the reader never sees one without the other
+	static bool WriteFrame(RingBuffer& ring, const char* context, int32_t size, const NetAddress& address) {
+		uint32_t total = (uint32_t)(sizeof(UdpFrame) + size);
+		if (ring.FreeSize() < total)
+			return false;
+
+		RingSpan spans[2] = {};
+		ring.Write(spans);
+
+		UdpFrame frame;
+		frame.size = size;
+		frame.address = address;
+		SpanCopyIn(spans, 0, &frame, sizeof(frame));
+		SpanCopyIn(spans, sizeof(frame), context, size);
+
+		ring.In(total);
+		return true;
+	}
+
+	UdpSocket::UdpSocket(int32_t fd, NetEngine* engine, const NetAddress& local, const UdpOptions& options)
+		: _fd(fd), _engine(engine), _local(local), _sendBuffer(options.sendSize), _recvBuffer(engine->IsRunToCompletion() ? 1 : options.recvSize),
+		_gso(options.gso), _gro(options.gro), _readyHook(this) {
+		_recvSlot = _gro ? UDP_GRO_BUFFER : std::max(options.maxDatagram, 1);
+		_recvData.resize((size_t)_recvSlot * UDP_RECV_BATCH);
+
+		memset(&_event, 0, sizeof(_event));
+		_event.context = this;
+		_event.sock = _fd;
+		_event.opt = EPOLL_OPT_UDP;
+		_event.worker = nullptr;
+	}
+
+	bool UdpSocket::SendTo(const char* context, const int32_t size, const NetAddress& to) {
+		if (_closing || _closed || size < 0 || size > UDP_MAX_PAYLOAD)
+			return false;
+
+		if (!WriteFrame(_sendBuffer, context, size, to))
+			return false;
+
+		//everything queued in a round leaves together, only a filling ring goes out early
+		if (!_sending && _sendBuffer.Size() > _sendBuffer.Capacity() / 2)
+			UpdateSend();
+
+		CheckReady();
+		return true;
+	}
+
+	void UdpSocket::Close() {
+		if (_closed)
+			return;
+
+		_closing = true;
+		if (!_sending && _sendBuffer.Size() > 0)
+			UpdateSend();
+
+		if (!_sending)
+			Shutdown();
+	}
+
+	void UdpSocket::Shutdown() {
+		//never connected, shutdown still raises the hangup the worker fails the socket on
+		if (!_closed) {
+			_closed = true;
+			shutdown(_fd, SHUT_RDWR);
+		}
+	}
+
+	int32_t UdpSocket::PrepareSend(mmsghdr* msgs, uint32_t* sizes, int32_t* datagrams) {
+		RingSpan spans[2] = {};
+		int32_t count = _sendBuffer.Read(spans);
+		uint32_t total = count > 1 ? spans[0].size + spans[1].size : (count > 0 ? spans[0].size : 0);
+
+		uint32_t offset = 0;
+		int32_t msgCount = 0;
+		int32_t iovCount = 0;
+		while (offset < total && msgCount < UDP_SEND_BATCH && iovCount + 2 <= UDP_SEND_IOV) {
+			UdpFrame frame;
+			SpanCopyOut(spans, offset, &frame, sizeof(frame));
+
+			sockaddr_in& addr = _sendAddr[msgCount];
+			memset(&addr, 0, sizeof(addr));
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = frame.address.ip;
+			addr.sin_port = frame.address.port;
+
+			mmsghdr& msg = msgs[msgCount];
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_hdr.msg_name = &addr;
+			msg.msg_hdr.msg_namelen = sizeof(addr);
+			msg.msg_hdr.msg_iov = _sendIov + iovCount;
+
+			uint32_t start = offset;
+			int32_t iovStart = iovCount;
+			iovCount += SpanIov(spans, offset + sizeof(frame), frame.size, _sendIov + iovCount);
+			offset += sizeof(frame) + frame.size;
+
+			//the datagrams after it of the same size to the same peer, only the last may be shorter
+			int32_t segments = 1;
+			int32_t bytes = frame.size;
+			while (_gso && frame.size > 0 && offset < total && segments < UDP_GSO_SEGMENTS && iovCount + 2 <= UDP_SEND_IOV) {
+				UdpFrame next;
+				SpanCopyOut(spans, offset, &next, sizeof(next));
+				if (next.address != frame.address || next.size == 0 || next.size > frame.size || bytes + next.size > UDP_MAX_PAYLOAD)
+					break;
+
+				iovCount += SpanIov(spans, offset + sizeof(next), next.size, _sendIov + iovCount);
+				offset += sizeof(next) + next.size;
+				bytes += next.size;
+				++segments;
+
+				if (next.size < frame.size)
+					break;
+			}
+
+			if (segments > 1) {
+				msg.msg_hdr.msg_control = _sendControl[msgCount];
+				msg.msg_hdr.msg_controllen = sizeof(_sendControl[msgCount]);
+
+				cmsghdr* cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				uint16_t segment = (uint16_t)frame.size;
+				memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+			}
+
+			msg.msg_hdr.msg_iovlen = iovCount - iovStart;
+			sizes[msgCount] = offset - start;
+			datagrams[msgCount] = segments;
+			++msgCount;
+		}
+		return msgCount;
+	}
+
+	int32_t UdpSocket::PrepareRecv(mmsghdr* msgs) {
+		for (int32_t i = 0; i < UDP_RECV_BATCH; ++i) {
+			_recvIov[i].iov_base = _recvData.data() + (size_t)i * _recvSlot;
+			_recvIov[i].iov_len = _recvSlot;
+
+			mmsghdr& msg = msgs[i];
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_hdr.msg_name = &_recvAddr[i];
+			msg.msg_hdr.msg_namelen = sizeof(_recvAddr[i]);
+			msg.msg_hdr.msg_iov = &_recvIov[i];
+			msg.msg_hdr.msg_iovlen = 1;
+			if (_gro) {
+				msg.msg_hdr.msg_control = _recvControl[i];
+				msg.msg_hdr.msg_controllen = sizeof(_recvControl[i]);
+			}
+		}
+		return UDP_RECV_BATCH;
+	}
+
+	bool UdpSocket::Deliver(mmsghdr& msg, int32_t index, int64_t& datagrams, int64_t& dropped) {
+		if (msg.msg_hdr.msg_flags & MSG_TRUNC) {
+			++dropped;
+			return true;
+		}
+
+		NetAddress from;
+		from.ip = _recvAddr[index].sin_addr.s_addr;
+		from.port = _recvAddr[index].sin_port;
+
+		//a coalesced buffer carries its segment size, every datagram but the last has that size
+		int32_t size = (int32_t)msg.msg_len;
+		int32_t segment = size;
+		if (_gro) {
+			for (cmsghdr* cm = CMSG_FIRSTHDR(&msg.msg_hdr); cm; cm = CMSG_NXTHDR(&msg.msg_hdr, cm)) {
+				if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+					memcpy(&segment, CMSG_DATA(cm), sizeof(segment));
+			}
+		}
+
+		const char* data = _recvData.data() + (size_t)index * _recvSlot;
+		int32_t offset = 0;
+		do {
+			int32_t len = std::min(segment, size - offset);
+			++datagrams;
+			if (_engine->IsRunToCompletion()) {
+				_session->OnRecv(data + offset, len, from);
+				if (_closing || _closed)
+					return false;
+			}
+			else if (!WriteFrame(_recvBuffer, data + offset, len, from))
+				++dropped;
+
+			offset += len;
+		} while (offset < size && segment > 0);
+		return true;
+	}
+
+	void UdpSocket::UpdateSend() {
+		int32_t left = _engine->DoSendTo(this);
+		if (left < 0)
+			Shutdown();
+		else if (left > 0) {
+			_sending = true;
+			if (!_engine->AddSend(&_event))
+				Shutdown();
+		}
+	}
+
+	void UdpSocket::OnSendDone() {
+		_sending = false;
+		if (_closed)
+			return;
+
+		if (_closing) {
+			if (_sendBuffer.Size() > 0)
+				UpdateSend();
+			else
+				Shutdown();
+		}
+
+		CheckReady();
+	}
+
+	void UdpSocket::OnRecv() {
+		//cleared before reading so datagrams landing from now on raise a new notification
+		_recvPending.exchange(false, std::memory_order_acq_rel);
+
+		while (!_closing && !_closed && _recvBuffer.Size() > 0) {
+			RingSpan spans[2] = {};
+			_recvBuffer.Read(spans);
+
+			UdpFrame frame;
+			SpanCopyOut(spans, 0, &frame, sizeof(frame));
+
+			//a datagram wrapped around the end of the ring is put together first
+			const char* data = nullptr;
+			if (sizeof(frame) + frame.size <= spans[0].size)
+				data = spans[0].data + sizeof(frame);
+			else if (sizeof(frame) >= spans[0].size)
+				data = spans[1].data + sizeof(frame) - spans[0].size;
+			else {
+				_temp.resize(frame.size);
+				SpanCopyOut(spans, sizeof(frame), _temp.data(), frame.size);
+				data = _temp.data();
+			}
+
+			_session->OnRecv(data, frame.size, frame.address);
+			_recvBuffer.Out(sizeof(frame) + frame.size);
+		}
+
+		CheckReady();
+	}
+
+	void UdpSocket::OnFail() {
+		_sending = false;
+
+		Shutdown();
+		close(_fd);
+
+		_session->OnClose();
+		_session->SetPipe(nullptr);
+
+		_session->Release();
+		_engine->RemoveUdp(this);
+		_readyHook.Unlink();
+		delete this;
+	}
+}
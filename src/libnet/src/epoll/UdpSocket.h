@@ -0,0 +1,123 @@
+#ifndef __UDP_SOCKET_H__
+#define __UDP_SOCKET_H__
+#include "libnet.h"
+#include "net.h"
+#include "RingBuffer.h"
+#include <netinet/udp.h>
+#include <atomic>
+#include <vector>
+
+#define UDP_RECV_BATCH 32 //datagrams per recvmmsg
+#define UDP_SEND_BATCH 64 //messages per sendmmsg
+#define UDP_SEND_IOV 256 //payload spans per sendmmsg, a gso message takes one or two per datagram
+#define UDP_GSO_SEGMENTS 64 //datagrams per gso message, the kernel's limit
+#define UDP_MAX_PAYLOAD 65507
+#define UDP_GRO_BUFFER 65536
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace libnet {
+	//ahead of every datagram in the send and recv rings
+	struct UdpFrame {
+		int32_t size;
+		NetAddress address;
+	};
+
+	/**
+	* A datagram socket registered on one worker, the session side queues datagrams in the send ring,
+	* the io side batches them into sendmmsg and receives with recvmmsg. In poll dispatch received datagrams
+	* go through the recv ring, run to completion hands them to the session straight from the receive buffers.
+	*/
+	class UdpSocket : public IUdpPipe {
+		friend class NetEngine;
+	public:
+		UdpSocket(int32_t fd, NetEngine* engine, const NetAddress& local, const UdpOptions& options);
+		virtual ~UdpSocket() { _readyHook.Unlink(); }
+
+		inline void Attach(IUdpSession* session) {
+			_session = session;
+			session->SetPipe(this);
+		}
+
+		virtual bool SendTo(const char* context, const int32_t size, const NetAddress& to);
+		virtual void Close();
+		virtual const NetAddress& GetLocalAddress() const { return _local; }
+
+		inline EpollBase& GetEvent() { return _event; }
+		inline IntrusiveListHook<UdpSocket>& GetReadyHook() { return _readyHook; }
+		inline int32_t GetSocket() const { return _fd; }
+
+		inline bool IsClosed() const { return _closed; }
+		inline bool HasPendingSend() const { return !_closed && _sendBuffer.Size() > 0; }
+		inline bool NeedUpdateSend() const { return !_closed && !_sending && _sendBuffer.Size() > 0; }
+
+		//queues the socket for the next round when it has datagrams to send
+		inline void CheckReady() {
+			if (!_readyHook.IsLinked() && _event.worker && NeedUpdateSend())
+				_engine->AddUdpReady(this);
+		}
+
+		//io side, true when the caller has to publish a NET_UDP_RECV
+		inline bool MarkRecvPending() { return !_recvPending.exchange(true, std::memory_order_acq_rel); }
+
+		//io side, builds up to UDP_SEND_BATCH messages from the queued datagrams,
+		//sizes gets the ring bytes each one covers and datagrams how many it carries
+		int32_t PrepareSend(mmsghdr* msgs, uint32_t* sizes, int32_t* datagrams);
+		inline void Out(uint32_t size) { _sendBuffer.Out(size); }
+		inline uint32_t SendLeft() const { return _sendBuffer.Size(); }
+		inline void DisableGso() { _gso = false; }
+
+		//io side, recvmmsg targets for the whole batch
+		int32_t PrepareRecv(mmsghdr* msgs);
+		//io side, one received buffer split back into datagrams, false when the session closed the pipe meanwhile
+		bool Deliver(mmsghdr& msg, int32_t index, int64_t& datagrams, int64_t& dropped);
+
+		void UpdateSend();
+		void OnSendDone();
+		void OnRecv();
+		void OnFail();
+
+	private:
+		void Shutdown();
+
+	private:
+		int32_t _fd;
+		NetEngine* _engine;
+		IUdpSession* _session = nullptr;
+		NetAddress _local;
+
+		RingBuffer _sendBuffer;
+		RingBuffer _recvBuffer;
+
+		bool _closing = false;
+		bool _closed = false;
+		bool _sending = false;
+		std::atomic<bool> _recvPending = { false };
+
+		//io side
+		bool _gso;
+		bool _gro;
+		int32_t _recvSlot;
+		std::vector<char> _recvData; //UDP_RECV_BATCH slots of _recvSlot bytes
+		iovec _recvIov[UDP_RECV_BATCH];
+		sockaddr_in _recvAddr[UDP_RECV_BATCH];
+		char _recvControl[UDP_RECV_BATCH][CMSG_SPACE(sizeof(int32_t))];
+
+		iovec _sendIov[UDP_SEND_IOV];
+		sockaddr_in _sendAddr[UDP_SEND_BATCH];
+		char _sendControl[UDP_SEND_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+
+		std::vector<char> _temp; //a datagram wrapped around the end of the recv ring, session side
+
+		EpollBase _event;
+		IntrusiveListHook<UdpSocket> _readyHook;
+	};
+}
+
+#endif //__UDP_SOCKET_H__
@@ -2,48 +2,174 @@
 #include "util.h"
 #include <thread>
 #include <atomic>
+#include <algorithm>
 #include "Connection.h"
+#include "UdpSocket.h"
+#ifdef LIBNET_URING
+#include "uring_engine.h"
+#endif
 
 #define NET_INIT_FRAME 1024
 #define MAX_NET_THREAD 4
-#define BACKLOG 128
+#define ACCEPT_BATCH 128
 #define EPOLL_BATCH_SIZE 1024
+#define LOAD_SAMPLE_INTERVAL 1000
 #define LOCAL_IP "127.0.0.1"
 
 namespace libnet {
-	NetEngine::NetEngine(int32_t threadCount) {
-		for (int32_t i = 0; i < threadCount; ++i) {
-			int32_t fd = epoll_create(1);
-			_fds.emplace_back(fd);
+	NetEngine::NetEngine(const NetEngineConfig& config) : _config(config) {
+	}
 
-			std::thread([this, fd]() {
-				ThreadProc(fd);
-			}).detach();
+	NetEngine::~NetEngine() {
+		//stop accepting first so the drain only waits on existing connections
+		for (auto& itr : _servers) {
+			for (auto* acceptor : itr.second)
+				PostToWorker(acceptor->worker, NET_CMD_STOP, acceptor);
 		}
+		_servers.clear();
 
-		_terminate = false;
-	}
+		Drain();
 
-	NetEngine::~NetEngine() {
 		_terminate = true;
-		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		for (auto* worker : _workers)
+			Wakeup(worker);
+
+		for (auto* worker : _workers) {
+			if (worker->thread.joinable())
+				worker->thread.join();
+		}
+
+		//every worker has exited, whatever is still queued belongs to this thread now
+		for (auto* worker : _workers) {
+			worker->commands.Sweep([this](NetCommand* cmd) {
+				DropCommand(cmd);
+				delete cmd;
+			});
+		}
+
+		while (!_pendingEvents.Empty()) {
+			NetEvent* evt = _pendingEvents.Fetch();
+			DropEvent(evt);
+			RecycleEvent(evt);
+		}
+
+		_eventQueue.Sweep([this](NetEvent* evt) {
+			DropEvent(evt);
+			RecycleEvent(evt);
+		});
+
+		for (auto* worker : _workers) {
+			for (auto* connector : worker->connectors) {
+				close(connector->sock);
+				OnConnectFail((ITcpSession*)connector->context);
+				delete connector;
+			}
+			worker->connectors.clear();
+
+			//OnFail removes from the set, iterate a copy
+			std::unordered_set<Connection*> connections;
+			connections.swap(worker->connections);
+			for (auto* conn : connections)
+				conn->OnFail();
+
+			std::unordered_set<UdpSocket*> udpSockets;
+			udpSockets.swap(worker->udpSockets);
+			for (auto* socket : udpSockets)
+				socket->OnFail();
+		}
+
+		//connections live in the arenas, free those last
+		for (auto* worker : _workers) {
+			worker->chunks.Clear();
+			worker->buffers.Clear();
+			close(worker->epollFd);
+			close(worker->wakeupFd);
+
+			delete worker->arena;
+			delete worker;
+		}
+		_workers.clear();
 	}
 
-	bool NetEngine::Listen(ITcpServer* server, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) {
-		int32_t sock = -1;
-		if (-1 == (sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))) {
-			return false;
+	bool NetEngine::Start() {
+		for (int32_t i = 0; i < _config.threadCount; ++i) {
+			NetWorker* worker = new NetWorker;
+			worker->epollFd = epoll_create(1);
+			worker->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (worker->epollFd < 0 || worker->wakeupFd < 0) {
+				if (worker->epollFd >= 0)
+					close(worker->epollFd);
+				if (worker->wakeupFd >= 0)
+					close(worker->wakeupFd);
+
+				delete worker;
+				return false;
+			}
+
+			//epoll_wait busy polls the devices of its sockets itself, kernels before 6.9 don't know it
+			if (_config.busyPoll > 0) {
+				epoll_params params;
+				memset(&params, 0, sizeof(params));
+				params.busy_poll_usecs = _config.busyPoll;
+				params.busy_poll_budget = BUSY_POLL_BUDGET;
+				params.prefer_busy_poll = 1;
+				ioctl(worker->epollFd, EPIOCSPARAMS, &params);
+			}
+
+			memset(&worker->wakeup, 0, sizeof(worker->wakeup));
+			worker->wakeup.opt = EPOLL_OPT_WAKEUP;
+			worker->wakeup.sock = worker->wakeupFd;
+			worker->wakeup.worker = worker;
+
+			epoll_event ev;
+			ev.data.ptr = &worker->wakeup;
+			ev.events = EPOLLIN;
+			if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeupFd, &ev) != 0) {
+				close(worker->epollFd);
+				close(worker->wakeupFd);
+
+				delete worker;
+				return false;
+			}
+
+			worker->index = (int16_t)_workers.size();
+			if (!_config.workerCpus.empty()) {
+				worker->cpu = _config.workerCpus[i % _config.workerCpus.size()];
+				if (_config.numaLocal) {
+					worker->arena = new NodeArena(NodeOfCpu(worker->cpu));
+					worker->buffers.SetArena(worker->arena);
+				}
+			}
+			if (IsSharedRecv())
+				worker->recvScratch.resize(_config.sharedRecvSize);
+			_workers.emplace_back(worker);
+
+			worker->thread = std::thread([this, worker]() {
+				ThreadProc(worker);
+			});
 		}
 
-		if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFD, 0) | O_NONBLOCK) == -1) {
-			close(sock);
-			return false;
+		return true;
+	}
+
+	int32_t NetEngine::OpenListenSocket(const char* ip, const int32_t port, const ListenOptions& options) {
+		if (IsUnixAddress(ip))
+			return OpenUnixListenSocket(ip, SOCK_NONBLOCK | SOCK_CLOEXEC, options.backlog);
+
+		int32_t sock = -1;
+		if (-1 == (sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP))) {
+			return -1;
 		}
 
 		int32_t flag = 1;
 		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&flag, sizeof(flag)) == -1) {
 			close(sock);
-			return false;
+			return -1;
+		}
+
+		if (options.reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&flag, sizeof(flag)) == -1) {
+			close(sock);
+			return -1;
 		}
 
 		sockaddr_in addr;
@@ -51,80 +177,156 @@ namespace libnet {
 		addr.sin_port = htons(port);
 		if ((addr.sin_addr.s_addr = inet_addr(ip)) == INADDR_NONE) {
 			close(sock);
-			return false;
+			return -1;
 		}
 
 		if (-1 == bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in))) {
 			close(sock);
-			return false;
+			return -1;
 		}
 
-		if (listen(sock, 128) == -1) {
+		//accepted sockets inherit it, no setsockopt per connection
+		if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag)) == -1) {
 			close(sock);
-			return false;
+			return -1;
+		}
+
+		if (options.deferAccept > 0 && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char*)&options.deferAccept, sizeof(options.deferAccept)) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		if (options.sendBuffer > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBuffer, sizeof(options.sendBuffer)) == -1) {
+			close(sock);
+			return -1;
 		}
 
-		EpollBase * acceptor = new EpollBase;
-		memset(acceptor, 0, sizeof(EpollBase));
-		acceptor->opt = EPOLL_OPT_ACCEPT;
-		acceptor->sock = sock;
-		acceptor->code = 0;
-		acceptor->context = server;
-		acceptor->sendSize = sendSize;
-		acceptor->recvSize = recvSize;
-		acceptor->fast = fast;
+		SetBusyPoll(sock, _config.busyPoll);
 
-		if (!AddToWorker(acceptor)) {
+		if (listen(sock, options.backlog) == -1) {
 			close(sock);
-			delete acceptor;
+			return -1;
+		}
+
+		return sock;
+	}
+
+	bool NetEngine::Listen(ITcpServer* server, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options) {
+		std::vector<EpollBase*> acceptors;
+		//a unix path binds once
+		bool reusePort = options.reusePort && !IsUnixAddress(ip);
+		int32_t count = reusePort ? (int32_t)_workers.size() : 1;
+		for (int32_t i = 0; i < count; ++i) {
+			int32_t sock = OpenListenSocket(ip, port, options);
+			if (sock < 0)
+				break;
+
+			EpollBase * acceptor = new EpollBase;
+			memset(acceptor, 0, sizeof(EpollBase));
+			acceptor->opt = EPOLL_OPT_ACCEPT;
+			acceptor->sock = sock;
+			acceptor->code = 0;
+			acceptor->context = server;
+			acceptor->sendSize = sendSize;
+			acceptor->recvSize = recvSize;
+			acceptor->fast = fast && !IsRunToCompletion();
+			acceptor->reusePort = reusePort;
+
+			if (!AddToWorker(acceptor, reusePort ? _workers[i] : NextWorker())) {
+				close(sock);
+				delete acceptor;
+				break;
+			}
+
+			acceptors.push_back(acceptor);
+		}
+
+		if ((int32_t)acceptors.size() < count) {
+			//registered acceptors may already be in use, let their workers free them
+			for (auto* acceptor : acceptors)
+				PostToWorker(acceptor->worker, NET_CMD_STOP, acceptor);
 
 			return false;
 		}
 
-		_servers[server] = sock;
+		_servers[server] = std::move(acceptors);
 		return true;
 	}
 
 	void NetEngine::Stop(ITcpServer* server) {
 		auto itr = _servers.find(server);
 		if (itr != _servers.end()) {
-			close(itr->second);
+			for (auto* acceptor : itr->second)
+				PostToWorker(acceptor->worker, NET_CMD_STOP, acceptor);
 			
 			_servers.erase(itr);
 		}
 	}
 
-	bool NetEngine::Connect(ITcpSession* session, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) {
+	int32_t NetEngine::OpenConnectSocket(const char* ip, const int32_t port, uint32_t& remoteAddr) {
 		int32_t sock = -1;
+		if (IsUnixAddress(ip)) {
+			//a unix connect completes or fails right away, EAGAIN is a full backlog
+			sockaddr_un remote;
+			socklen_t len = MakeUnixAddress(ip, remote);
+			if (len == 0 || -1 == (sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+				return -1;
+
+			if (connect(sock, (sockaddr*)&remote, len) < 0) {
+				close(sock);
+				return -1;
+			}
+
+			//no address to hash, the socket spreads them
+			remoteAddr = (uint32_t)sock;
+			return sock;
+		}
+
 		if (-1 == (sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))) {
-			return false;
+			return -1;
 		}
 
 		if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFD, 0) | O_NONBLOCK) == -1) {
 			close(sock);
-			return false;
+			return -1;
 		}
 
-		const int8_t nodelay = 1;
-		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)& nodelay, sizeof(nodelay));
+		//an int, a shorter option is rejected with EINVAL
+		const int32_t nodelay = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+		SetBusyPoll(sock, _config.busyPoll);
 
 		sockaddr_in remote;
 		memset(&remote, 0, sizeof(remote));
 
 		remote.sin_family = AF_INET;
-		if (-1 == bind(sock, (sockaddr*)& remote, sizeof(sockaddr_in)))
-			return false;
+		if (-1 == bind(sock, (sockaddr*)& remote, sizeof(sockaddr_in))) {
+			close(sock);
+			return -1;
+		}
 
 		remote.sin_port = htons(port);
-		if ((remote.sin_addr.s_addr = inet_addr(ip)) == INADDR_NONE)
-			return false;
+		if ((remote.sin_addr.s_addr = inet_addr(ip)) == INADDR_NONE) {
+			close(sock);
+			return -1;
+		}
 
 		int32_t ret = connect(sock, (sockaddr*)& remote, sizeof(remote));
 		if (ret < 0 && errno != EINPROGRESS) {
 			close(sock);
-			return false;
+			return -1;
 		}
 
+		remoteAddr = remote.sin_addr.s_addr;
+		return sock;
+	}
+
+	bool NetEngine::Connect(ITcpSession* session, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) {
+		uint32_t remoteAddr = 0;
+		int32_t sock = OpenConnectSocket(ip, port, remoteAddr);
+		if (sock < 0)
+			return false;
+
 		EpollBase* connector = new EpollBase;
 		memset(connector, 0, sizeof(EpollBase));
 		connector->opt = EPOLL_OPT_CONNECT;
@@ -133,41 +335,152 @@ namespace libnet {
 		connector->context = session;
 		connector->sendSize = sendSize;
 		connector->recvSize = recvSize;
-		connector->fast = fast;
+		connector->fast = fast && !IsRunToCompletion();
 		SafeSprintf(connector->remoteIp, sizeof(connector->remoteIp), "%s", ip);
-		connector->remotePort = port;
+		connector->remotePort = IsUnixAddress(ip) ? 0 : port;
 
-		if (!AddToWorker(connector)) {
+		//the worker registers and tracks its own connectors
+		NetWorker* worker = PlaceWorker(remoteAddr);
+		if (!worker) {
 			close(sock);
 			delete connector;
 
 			return false;
 		}
 
+		connector->worker = worker;
+		PostToWorker(worker, NET_CMD_CONNECT, connector);
 		return true;
 	}
 
-	void NetEngine::Poll(int64_t frame) {
-		_eventQueue.SweepOnce([this](NetEvent* evt) {
-			switch (evt->evtType) {
-			case NET_ACCEPT: OnAccept((ITcpServer*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast); break;
-			case NET_CONNECT_SUCCESS: OnConnect((ITcpSession*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort); break;
-			case NET_CONNECT_FAIL : OnConnectFail((ITcpSession*)evt->context); break;
-			case NET_SEND_DONE: ((Connection*)evt->context)->OnSendDone(); break;
-			case NET_FAIL: ((Connection*)evt->context)->OnFail(); break;
-			case NET_RECV: ((Connection*)evt->context)->OnRecv(); break;
-			case NET_RECV_DONE: ((Connection*)evt->context)->OnRecvDone(); break;
+	bool NetEngine::Bind(IUdpSession* session, const char* ip, const int32_t port, const UdpOptions& options) {
+		NetAddress local;
+		if (!MakeNetAddress(ip, port, local))
+			return false;
+
+		NetWorker* worker = NextWorker();
+		if (!worker)
+			return false;
+
+		int32_t sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+		if (sock < 0)
+			return false;
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = local.ip;
+		addr.sin_port = local.port;
+
+		socklen_t len = sizeof(addr);
+		if (bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(sock, (sockaddr*)&addr, &len) < 0) {
+			close(sock);
+			return false;
+		}
+		local.port = addr.sin_port;
+
+		SetBusyPoll(sock, _config.busyPoll);
+
+		//a kernel without udp gro hands datagrams over one by one
+		UdpOptions udpOptions = options;
+		int32_t gro = 1;
+		if (udpOptions.gro && setsockopt(sock, SOL_UDP, UDP_GRO, &gro, sizeof(gro)) < 0)
+			udpOptions.gro = false;
+
+		UdpSocket* udp = new UdpSocket(sock, this, local, udpOptions);
+		udp->Attach(session);
+
+		//the worker owns everything it dispatches
+		if (IsRunToCompletion()) {
+			PostToWorker(worker, NET_CMD_BIND, udp);
+			return true;
+		}
+
+		if (!AddToWorker(&udp->GetEvent(), worker)) {
+			session->SetPipe(nullptr);
+			close(sock);
+			delete udp;
+			return false;
+		}
+
+		AddUdp(udp);
+		session->OnBind();
+		return true;
+	}
+
+	PollResult NetEngine::Poll(int64_t frame, int32_t maxEvents) {
+		PollResult result;
+
+		if (!_pollPinned) {
+			_pollPinned = true;
+			if (_config.pollCpu >= 0)
+				PinThread(_config.pollCpu);
+		}
+
+		//workers flush their own connections when they run the sessions
+		if (IsRunToCompletion())
+			return result;
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(frame);
+		if (_pendingEvents.Empty())
+			_pendingEvents = _eventQueue.Fetch();
+
+		//sends queued since the last Poll leave before the wait for what they answer
+		if (_pendingEvents.Empty() && _config.pollSpin > 0) {
+			for (auto* worker : _workers)
+				DealReady(worker);
+
+			auto spinEnd = std::chrono::steady_clock::now() + std::chrono::microseconds(_config.pollSpin);
+			while (_eventQueue.Empty() && std::chrono::steady_clock::now() < spinEnd)
+				CpuRelax();
+
+			_pendingEvents = _eventQueue.Fetch();
+		}
+
+		while (!_pendingEvents.Empty()) {
+			if (result.processed > 0) {
+				if (maxEvents > 0 && result.processed >= maxEvents)
+					break;
+
+				if (frame > 0 && std::chrono::steady_clock::now() >= deadline)
+					break;
 			}
 
-			delete evt;
-		});
+			NetEvent* evt = _pendingEvents.Fetch();
+			DealEvent(evt);
+			RecycleEvent(evt);
 
-		for (auto* conn : _connections) {
-			if (conn->NeedUpdateSend())
-				conn->UpdateSend();
+			++result.processed;
+		}
 
-			if (conn->IsFastConnected())
-				conn->UpdateFast();
+		for (auto* worker : _workers)
+			DealReady(worker);
+
+		result.remain = !_pendingEvents.Empty() || !_eventQueue.Empty();
+		return result;
+	}
+
+	void NetEngine::DealEvent(NetEvent* evt) {
+		switch (evt->evtType) {
+		case NET_ACCEPT: {
+				NetSocketEvent* accept = static_cast<NetSocketEvent*>(evt);
+				OnAccept((ITcpServer*)accept->context, accept->sock, accept->sendSize, accept->recvSize, accept->fast, accept->remoteIp, accept->remotePort, _workers[accept->target]);
+			}
+			break;
+		case NET_CONNECT_SUCCESS: {
+				NetSocketEvent* connect = static_cast<NetSocketEvent*>(evt);
+				OnConnect((ITcpSession*)connect->context, connect->sock, connect->sendSize, connect->recvSize, connect->fast, connect->remoteIp, connect->remotePort, _workers[connect->target]);
+			}
+			break;
+		case NET_CONNECT_FAIL : OnConnectFail((ITcpSession*)evt->context); break;
+		case NET_SEND_DONE: ((Connection*)evt->context)->OnSendDone(); break;
+		case NET_FAIL: ((Connection*)evt->context)->OnFail(); break;
+		case NET_RECV: ((Connection*)evt->context)->OnRecv(); break;
+		case NET_RECV_DONE: ((Connection*)evt->context)->OnRecvDone(); break;
+		case NET_SEND_RELEASE: FreePayload((SendPayload*)evt->context); break;
+		case NET_UDP_RECV: ((UdpSocket*)evt->context)->OnRecv(); break;
+		case NET_UDP_SEND_DONE: ((UdpSocket*)evt->context)->OnSendDone(); break;
+		case NET_UDP_FAIL: ((UdpSocket*)evt->context)->OnFail(); break;
 		}
 	}
 
@@ -175,26 +488,261 @@ namespace libnet {
 		delete this;
 	}
 
-	void NetEngine::ThreadProc(int32_t fd) {
+	bool NetEngine::GetWorkerStat(int32_t index, NetWorkerStat& stat) const {
+		if (index < 0 || index >= (int32_t)_workers.size())
+			return false;
+
+		NetWorker* worker = _workers[index];
+		stat.connections = worker->connectionCount.load(std::memory_order_relaxed);
+		stat.recvBytes = worker->recvBytes.load(std::memory_order_relaxed);
+		stat.sendBytes = worker->sendBytes.load(std::memory_order_relaxed);
+		stat.bytesPerSecond = worker->bytesPerSecond.load(std::memory_order_relaxed);
+		stat.recvCalls = worker->recvCalls.load(std::memory_order_relaxed);
+		stat.sendCalls = worker->sendCalls.load(std::memory_order_relaxed);
+		stat.acceptCalls = worker->acceptCalls.load(std::memory_order_relaxed);
+		stat.recvDatagrams = worker->recvDatagrams.load(std::memory_order_relaxed);
+		stat.sendDatagrams = worker->sendDatagrams.load(std::memory_order_relaxed);
+		stat.dropDatagrams = worker->dropDatagrams.load(std::memory_order_relaxed);
+		stat.sendChunks = worker->chunks.GetUsed();
+		stat.ringHits = worker->buffers.GetHits();
+		stat.ringMisses = worker->buffers.GetMisses();
+		stat.ringCached = worker->buffers.GetCached();
+		return true;
+	}
+
+	NetWorker* NetEngine::PlaceWorker(uint32_t remoteAddr) {
+		NetWorker* worker = PickWorker(_workers, _config.placement, _nextIdx, remoteAddr);
+		if (worker)
+			worker->pending.fetch_add(1, std::memory_order_relaxed);
+		return worker;
+	}
+
+	void NetEngine::ThreadProc(NetWorker* worker) {
+		BlockSigPipe();
+		if (worker->cpu >= 0)
+			PinThread(worker->cpu);
+
+		int32_t timeout = _config.waitMode == NET_WAIT_BLOCK ? _config.waitTimeout : 0;
+		epoll_event events[EPOLL_BATCH_SIZE];
+
 		while (!_terminate) {
-			epoll_event events[EPOLL_BATCH_SIZE];
-			int32_t count = epoll_wait(fd, events, EPOLL_BATCH_SIZE, 0);
+			int32_t count = epoll_wait(worker->epollFd, events, EPOLL_BATCH_SIZE, timeout);
+			SampleLoad(worker);
 			if (count < 1) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				if (_config.waitMode == NET_WAIT_SLEEP)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
 				continue;
 			}
 
+			bool wakeup = false;
 			for (int32_t i = 0; i < count; ++i) {
 				EpollBase * evt = (EpollBase * )events[i].data.ptr;
-				if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
-					evt->code = -1;
+				//a peer fin is left to recv, the data ahead of it is still delivered.
+				//zero-copy completions raise EPOLLERR on a healthy socket
+				if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+					bool completions = !(events[i].events & EPOLLHUP) && evt->opt == EPOLL_OPT_IO && ((Connection*)evt->context)->HasZeroCopy();
+					if (!completions || !DealZeroCopy((Connection*)evt->context))
+						evt->code = -1;
+				}
 
 				switch (evt->opt) {
 				case EPOLL_OPT_ACCEPT: DealAccept((EpollBase*)evt); break;
 				case EPOLL_OPT_CONNECT: DealConnect((EpollBase*)evt); break;
 				case EPOLL_OPT_IO: DealIO(evt, events[i].events); break;
+				case EPOLL_OPT_UDP: DealUdp(evt, events[i].events); break;
+				case EPOLL_OPT_WAKEUP: wakeup = true; break;
+				}
+			}
+
+			//commands may free an EpollBase that is still referenced later in this batch
+			if (wakeup)
+				DealWakeup(worker);
+
+			if (IsRunToCompletion()) {
+				DealReady(worker);
+
+				if (_draining)
+					worker->drained = !HasPendingSend(worker);
+			}
+		}
+	}
+
+	void NetEngine::Drain() {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_config.drainTimeout);
+		if (IsRunToCompletion()) {
+			//workers own their connections, they report once nothing is left to send
+			_draining = true;
+			for (auto* worker : _workers)
+				Wakeup(worker);
+
+			while (std::chrono::steady_clock::now() < deadline) {
+				bool drained = true;
+				for (auto* worker : _workers)
+					drained = drained && worker->drained;
+
+				if (drained)
+					break;
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		else {
+			while (std::chrono::steady_clock::now() < deadline) {
+				Poll(0, 0);
+
+				bool drained = true;
+				for (auto* worker : _workers)
+					drained = drained && !HasPendingSend(worker);
+
+				if (drained)
+					break;
+
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+		}
+	}
+
+	bool NetEngine::HasPendingSend(NetWorker* worker) {
+		for (auto* conn : worker->connections) {
+			if (conn->HasPendingSend())
+				return true;
+		}
+
+		for (auto* socket : worker->udpSockets) {
+			if (socket->HasPendingSend())
+				return true;
+		}
+		return false;
+	}
+
+	void NetEngine::DropCommand(NetCommand* cmd) {
+		switch (cmd->cmdType) {
+		case NET_CMD_STOP: {
+				EpollBase* acceptor = (EpollBase*)cmd->context;
+				if (acceptor->sock >= 0)
+					close(acceptor->sock);
+
+				delete acceptor;
+			}
+			break;
+		case NET_CMD_ACCEPT: {
+				NetSocketEvent* evt = (NetSocketEvent*)cmd->context;
+				close(evt->sock);
+				RecycleEvent(evt);
+			}
+			break;
+		case NET_CMD_CONNECT: {
+				EpollBase* connector = (EpollBase*)cmd->context;
+				close(connector->sock);
+				OnConnectFail((ITcpSession*)connector->context);
+				delete connector;
+			}
+			break;
+		case NET_CMD_BIND: ((UdpSocket*)cmd->context)->OnFail(); break;
+		}
+	}
+
+	//connection events are dropped as is, the connections themselves are released afterwards
+	void NetEngine::DropEvent(NetEvent* evt) {
+		switch (evt->evtType) {
+		case NET_ACCEPT: close(static_cast<NetSocketEvent*>(evt)->sock); break;
+		case NET_CONNECT_SUCCESS: {
+				close(static_cast<NetSocketEvent*>(evt)->sock);
+				OnConnectFail((ITcpSession*)evt->context);
+			}
+			break;
+		case NET_CONNECT_FAIL: OnConnectFail((ITcpSession*)evt->context); break;
+		case NET_SEND_RELEASE: DealEvent(evt); break;
+		}
+	}
+
+	void NetEngine::SampleLoad(NetWorker* worker) {
+		int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		if (now - worker->sampleTime < LOAD_SAMPLE_INTERVAL)
+			return;
+
+		//a blocked worker still wakes every waitTimeout, so the rate of an idle worker decays
+		int64_t bytes = worker->recvBytes.load(std::memory_order_relaxed) + worker->sendBytes.load(std::memory_order_relaxed);
+		if (worker->sampleTime > 0)
+			worker->bytesPerSecond.store((bytes - worker->sampleBytes) * 1000 / (now - worker->sampleTime), std::memory_order_relaxed);
+
+		worker->sampleBytes = bytes;
+		worker->sampleTime = now;
+	}
+
+	void NetEngine::DealWakeup(NetWorker* worker) {
+		uint64_t value = 0;
+		read(worker->wakeupFd, &value, sizeof(value));
+
+		worker->commands.SweepOnce([this, worker](NetCommand* cmd) {
+			DealCommand(worker, cmd);
+			delete cmd;
+		});
+	}
+
+	void NetEngine::DealCommand(NetWorker* worker, NetCommand* cmd) {
+		switch (cmd->cmdType) {
+		case NET_CMD_STOP: {
+				EpollBase* acceptor = (EpollBase*)cmd->context;
+				if (acceptor->sock >= 0) {
+					DelFromWorker(acceptor);
+					close(acceptor->sock);
 				}
+
+				delete acceptor;
+			}
+			break;
+		case NET_CMD_ACCEPT: {
+				NetSocketEvent* evt = (NetSocketEvent*)cmd->context;
+				OnAccept((ITcpServer*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort, worker);
+				RecycleEvent(evt);
 			}
+			break;
+		case NET_CMD_CONNECT: {
+				EpollBase* connector = (EpollBase*)cmd->context;
+				if (!AddToWorker(connector, worker)) {
+					close(connector->sock);
+					worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+					if (IsRunToCompletion())
+						OnConnectFail((ITcpSession*)connector->context);
+					else
+						PushConnectFail(worker, (ITcpSession*)connector->context);
+
+					delete connector;
+				}
+				else
+					worker->connectors.insert(connector);
+			}
+			break;
+		case NET_CMD_BIND: OnBind((UdpSocket*)cmd->context, worker); break;
+		}
+	}
+
+	void NetEngine::DealReady(NetWorker* worker) {
+		//callbacks may mark connections ready again, they wait for the next round
+		IntrusiveList<Connection> ready;
+		worker->ready.MoveTo(ready);
+
+		while (Connection* conn = ready.PopFront()) {
+			if (conn->NeedUpdateSend())
+				conn->UpdateSend();
+
+			if (conn->IsFastConnected())
+				conn->UpdateFast();
+
+			conn->CheckReady();
+		}
+
+		//every datagram queued this round leaves in one sendmmsg
+		IntrusiveList<UdpSocket> udpReady;
+		worker->udpReady.MoveTo(udpReady);
+
+		while (UdpSocket* socket = udpReady.PopFront()) {
+			if (socket->NeedUpdateSend())
+				socket->UpdateSend();
+
+			socket->CheckReady();
 		}
 	}
 
@@ -202,153 +750,476 @@ namespace libnet {
 		if (evt->code == 0) {
 			int32_t sock = -1;
 			int32_t count = 0;
-			sockaddr_in addr;
+			sockaddr_storage addr;
 			socklen_t len = sizeof(addr);
 
-			while (count++ < BACKLOG && (sock = accept(evt->sock, (sockaddr*)& addr, &len)) > 0) {
-				if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFD, 0) | O_NONBLOCK) == -1) {
-					close(sock);
-					continue;
+			//level triggered, a listener with more than ACCEPT_BATCH pending is reported again
+			while (count++ < ACCEPT_BATCH) {
+				//flags and the peer come with the socket, TCP_NODELAY is inherited from the listener
+				len = sizeof(addr);
+				sock = accept4(evt->sock, (sockaddr*)& addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				evt->worker->acceptCalls.fetch_add(1, std::memory_order_relaxed);
+				if (sock < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						return;
+
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+
+					break;
 				}
 
-				const int8_t nodelay = 1;
-				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)& nodelay, sizeof(nodelay));
+				//a unix peer is rarely bound to a name, it is reported by its family and spread by its socket
+				char remoteIp[LIBNET_IP_SIZE];
+				int32_t remotePort = 0;
+				uint32_t remoteAddr = (uint32_t)sock;
+				if (addr.ss_family == AF_INET) {
+					const sockaddr_in& peer = (const sockaddr_in&)addr;
+					inet_ntop(AF_INET, &peer.sin_addr, remoteIp, sizeof(remoteIp));
+					remotePort = ntohs(peer.sin_port);
+					remoteAddr = peer.sin_addr.s_addr;
+				}
+				else
+					SafeSprintf(remoteIp, sizeof(remoteIp), "%s", LIBNET_UNIX_PREFIX);
+
+				//a reuseport acceptor keeps its connections, the kernel already spread them
+				NetWorker* worker = nullptr;
+				if (evt->reusePort) {
+					worker = evt->worker;
+					worker->pending.fetch_add(1, std::memory_order_relaxed);
+				}
+				else
+					worker = PlaceWorker(remoteAddr);
 
-				PushAccept(sock, (ITcpServer*)evt->context, evt->sendSize, evt->recvSize, evt->fast);
+				if (IsRunToCompletion()) {
+					if (worker == evt->worker)
+						OnAccept((ITcpServer*)evt->context, sock, evt->sendSize, evt->recvSize, evt->fast, remoteIp, remotePort, worker);
+					else
+						PostToWorker(worker, NET_CMD_ACCEPT, AllocAccept(evt->worker, sock, (ITcpServer*)evt->context, evt->sendSize, evt->recvSize, evt->fast, remoteIp, remotePort, worker));
+				}
+				else
+					PushAccept(evt->worker, sock, (ITcpServer*)evt->context, evt->sendSize, evt->recvSize, evt->fast, remoteIp, remotePort, worker);
 			}
 
-			if (errno == EAGAIN)
+			if (count > ACCEPT_BATCH)
 				return;
 		}
 
-		close(evt->sock);
+		//acceptor is still owned by _servers and freed by Stop
 		DelFromWorker(evt);
-
-		delete evt;
+		close(evt->sock);
+		evt->sock = -1;
 	}
 
 	void NetEngine::DealConnect(EpollBase* evt) {
+		//unregister first, the connection reuses the socket and may land on the same worker
+		DelFromWorker(evt);
+		evt->worker->connectors.erase(evt);
+
 		if (evt->code == 0) {
-			const int8_t nodelay = 1;
+			const int32_t nodelay = 1;
 			setsockopt(evt->sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
 
-			PushConnectSuccess(evt->sock, (ITcpSession*)evt->context, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort);
+			if (IsRunToCompletion())
+				OnConnect((ITcpSession*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort, evt->worker);
+			else
+				PushConnectSuccess(evt->worker, evt->sock, (ITcpSession*)evt->context, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort);
 		}
 		else {
 			close(evt->sock);
+			evt->worker->pending.fetch_sub(1, std::memory_order_relaxed);
 			
-			PushConnectFail((ITcpSession*)evt->context);
+			if (IsRunToCompletion())
+				OnConnectFail((ITcpSession*)evt->context);
+			else
+				PushConnectFail(evt->worker, (ITcpSession*)evt->context);
 		}
 
-		DelFromWorker(evt);
 		delete evt;
 	}
 
 	void NetEngine::DealIO(EpollBase* evt, int32_t flag) {
 		Connection* connection = (Connection*)evt->context;
 		if (evt->code != 0) {
-			DelFromWorker(evt);
+			DealFail(evt);
+			return;
+		}
 
-			PushFail(connection);
+		if (flag & EPOLLIN) {
+			if (connection->IsAdjustRecvBuff()) {
+				if (IsRunToCompletion())
+					connection->OnRecvDone();
+				else
+					PushRecvDone(evt->worker, connection);
+			}
+			else if (!DealRecv(evt, flag))
+				return;
+
+			//session closed the socket in its callback
+			if (IsRunToCompletion() && connection->IsClosed())
+				return;
 		}
-		else {
-			if (flag & EPOLLIN) {
-				if (connection->IsAdjustRecvBuff()) {
-					PushRecvDone(connection);
-				}
-				else {
-					int32_t len = 0;
-
-					while (true) {
-						uint32_t size = 0;
-						char* recvBuf = connection->GetRecvBuffer(size);
-
-						if (recvBuf && size > 0) {
-							len = recv(evt->sock, recvBuf, size, 0);
-							if (len < 0 && errno == EAGAIN)
-								break;
-						}
-						else
-							len = -1;
-
-						if (len <= 0) {
-							DelFromWorker(evt);
-							PushFail(connection);
-							return;
-						}
-
-						connection->In(len);
-						PushRecv(connection);
-					}
-				}
+
+		if (flag & EPOLLOUT) {
+			int32_t left = DoSend(connection, true);
+			if (left < 0)
+				DealFail(evt);
+			else if (left == 0) {
+				if (!RemoveSend(evt))
+					DealFail(evt);
+				else if (IsRunToCompletion())
+					connection->OnSendDone();
+				else
+					PushSendDone(evt->worker, connection);
 			}
+		}
+	}
 
-			if (flag & EPOLLOUT) {
-				int32_t left = DoSend(connection);
-				if (left < 0) {
-					DelFromWorker(evt);
-					PushFail(connection);
-				}
-				else if (left == 0) {
-					if (!RemoveSend(evt)) {
-						DelFromWorker(evt);
-						PushFail(connection);
-					}
-					else
-						PushSendDone(connection);
-				}
+	bool NetEngine::DealRecv(EpollBase* evt, int32_t flag) {
+		Connection* connection = (Connection*)evt->context;
+		while (true) {
+			//both free segments of the ring in one call, a wrapped ring needs no second recv.
+			//a connection with nothing left over reads into the worker's scratch buffer instead
+			iovec iov[2];
+			bool scratch = connection->IsRecvIdle();
+			int32_t count = 1;
+			if (scratch) {
+				iov[0].iov_base = evt->worker->recvScratch.data();
+				iov[0].iov_len = evt->worker->recvScratch.size();
+			}
+			else
+				count = connection->GetRecvBuffer(iov);
+			size_t size = count > 1 ? iov[0].iov_len + iov[1].iov_len : (count > 0 ? iov[0].iov_len : 0);
+
+			int32_t len = -1;
+			if (count > 0) {
+				len = (int32_t)readv(evt->sock, iov, count);
+				evt->worker->recvCalls.fetch_add(1, std::memory_order_relaxed);
+				if (len < 0 && errno == EAGAIN)
+					return true;
+			}
+
+			if (len <= 0) {
+				DealFail(evt);
+				return false;
+			}
+
+			evt->worker->recvBytes.fetch_add(len, std::memory_order_relaxed);
+			if (scratch) {
+				connection->OnRecv((char*)iov[0].iov_base, len);
+				if (connection->IsClosed())
+					return false;
+			}
+			else if (IsRunToCompletion()) {
+				connection->In(len);
+				connection->OnRecv();
+				if (connection->IsClosed())
+					return false;
+			}
+			else {
+				connection->In(len);
+				if (connection->MarkRecvPending())
+					PushRecv(evt->worker, connection);
+			}
+
+			//a short read left the socket empty, edge triggering reports whatever arrives next.
+			//a fin already queued raises no new edge, keep reading until recv returns 0
+			if ((size_t)len < size && !(flag & EPOLLRDHUP))
+				return true;
+		}
+	}
+
+	void NetEngine::DealFail(EpollBase* evt) {
+		DelFromWorker(evt);
+
+		if (IsRunToCompletion())
+			((Connection*)evt->context)->OnFail();
+		else
+			PushFail(evt->worker, (Connection*)evt->context);
+	}
+
+	void NetEngine::DealUdp(EpollBase* evt, int32_t flag) {
+		UdpSocket* socket = (UdpSocket*)evt->context;
+		if (evt->code != 0) {
+			DealUdpFail(evt);
+			return;
+		}
+
+		if ((flag & EPOLLIN) && !DealUdpRecv(evt))
+			return;
+
+		if (flag & EPOLLOUT) {
+			int32_t left = DoSendTo(socket);
+			if (left < 0)
+				DealUdpFail(evt);
+			else if (left == 0) {
+				if (!RemoveSend(evt))
+					DealUdpFail(evt);
+				else if (IsRunToCompletion())
+					socket->OnSendDone();
+				else
+					PushEvent(evt->worker, NET_UDP_SEND_DONE, socket);
 			}
 		}
 	}
 
-	int32_t NetEngine::DoSend(Connection* connection) {
+	bool NetEngine::DealUdpRecv(EpollBase* evt) {
+		UdpSocket* socket = (UdpSocket*)evt->context;
+		NetWorker* worker = evt->worker;
+
+		mmsghdr msgs[UDP_RECV_BATCH];
+		while (true) {
+			int32_t count = socket->PrepareRecv(msgs);
+			int32_t n = recvmmsg(evt->sock, msgs, count, 0, nullptr);
+			worker->recvCalls.fetch_add(1, std::memory_order_relaxed);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return true;
+
+				if (errno == EINTR)
+					continue;
+
+				DealUdpFail(evt);
+				return false;
+			}
+
+			int64_t bytes = 0;
+			int64_t datagrams = 0;
+			int64_t dropped = 0;
+			bool open = true;
+			for (int32_t i = 0; i < n && open; ++i) {
+				bytes += msgs[i].msg_len;
+				open = socket->Deliver(msgs[i], i, datagrams, dropped);
+			}
+
+			worker->recvBytes.fetch_add(bytes, std::memory_order_relaxed);
+			worker->recvDatagrams.fetch_add(datagrams, std::memory_order_relaxed);
+			worker->dropDatagrams.fetch_add(dropped, std::memory_order_relaxed);
+
+			//session closed the socket in its callback
+			if (!open)
+				return false;
+
+			if (!IsRunToCompletion() && datagrams > dropped && socket->MarkRecvPending())
+				PushEvent(worker, NET_UDP_RECV, socket);
+
+			//a short batch left the socket empty, edge triggering reports whatever arrives next
+			if (n < count)
+				return true;
+		}
+	}
+
+	void NetEngine::DealUdpFail(EpollBase* evt) {
+		DelFromWorker(evt);
+
+		if (IsRunToCompletion())
+			((UdpSocket*)evt->context)->OnFail();
+		else
+			PushEvent(evt->worker, NET_UDP_FAIL, evt->context);
+	}
+
+	int32_t NetEngine::DoSend(Connection* connection, bool payloads) {
+		NetWorker* worker = connection->GetEvent().worker;
 		int32_t left = 0;
 		do {
-			uint32_t size = 0;
-			char* sendBuf = connection->GetSendBuffer(size);
+			//a corked pipe tells the kernel more follows, it holds the partial segment until a flush pushes it
+			int32_t more = connection->IsCorked() ? MSG_MORE : 0;
+
+			//the ring, both segments when it wraps, and the buffer payloads queued between its bytes in one call
+			iovec iov[SEND_IOV_MAX];
+			SendPayload* pieces[SEND_IOV_MAX];
+			int32_t count = connection->GatherSend(iov, pieces, SEND_IOV_MAX);
+			if (count == 0) {
+				SendPayload* payload = connection->FrontPayload();
+				if (!payload)
+					return 0;
+
+				if (!payloads)
+					return connection->SendLeft();
+
+				if (!payload->buffer) {
+					//straight from the page cache, capped so a huge range can't stall the other connections
+					off_t position = (off_t)(payload->position + payload->offset);
+					int64_t size = std::min<int64_t>(payload->size - payload->offset, MAX_SEND_FILE_SIZE);
+					int32_t len = (int32_t)sendfile(connection->GetSocket(), payload->fd, &position, (size_t)size);
+					worker->sendCalls.fetch_add(1, std::memory_order_relaxed);
+					if (len < 0) {
+						if (errno != EAGAIN)
+							return -1;
+
+						return connection->SendLeft();
+					}
+
+					//the file got shorter than the range
+					if (len == 0)
+						return -1;
+
+					worker->sendBytes.fetch_add(len, std::memory_order_relaxed);
+					connection->SetCorked(false);
+					left = connection->OutPayload(payload, len);
+					if (len < size)
+						break;
+
+					continue;
+				}
+
+				int32_t size = payload->buffer->Size() - payload->offset;
+				bool zeroCopy = connection->IsZeroCopy(size);
+				int32_t len = (int32_t)send(connection->GetSocket(), payload->buffer->Data() + payload->offset, size, (zeroCopy ? MSG_ZEROCOPY : 0) | MSG_NOSIGNAL | more);
+				worker->sendCalls.fetch_add(1, std::memory_order_relaxed);
+				if (len < 0 && zeroCopy && errno == ENOBUFS) {
+					//out of locked memory for pinned pages, this one is copied
+					zeroCopy = false;
+					len = (int32_t)send(connection->GetSocket(), payload->buffer->Data() + payload->offset, size, MSG_NOSIGNAL | more);
+					worker->sendCalls.fetch_add(1, std::memory_order_relaxed);
+				}
 
-			if (sendBuf && size > 0) {
-				int32_t len = send(connection->GetSocket(), sendBuf, size, 0);
 				if (len < 0) {
 					if (errno != EAGAIN)
 						return -1;
+
+					return connection->SendLeft();
 				}
 
-				left = connection->Out(len);
+				if (zeroCopy)
+					connection->MarkZeroCopy(payload);
+
+				worker->sendBytes.fetch_add(len, std::memory_order_relaxed);
+				connection->SetCorked(more != 0);
+				left = connection->OutPayload(payload, len);
+				if (len < size)
+					break;
+
+				continue;
 			}
-			else
-				left = 0;
 
+			size_t size = 0;
+			for (int32_t i = 0; i < count; ++i)
+				size += iov[i].iov_len;
+
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			int32_t len = (int32_t)sendmsg(connection->GetSocket(), &msg, MSG_NOSIGNAL | more);
+			worker->sendCalls.fetch_add(1, std::memory_order_relaxed);
+			if (len < 0) {
+				if (errno != EAGAIN)
+					return -1;
+
+				//wait for EPOLLOUT, the unsent data stays queued
+				return connection->Out(0);
+			}
+
+			worker->sendBytes.fetch_add(len, std::memory_order_relaxed);
+			connection->SetCorked(more != 0);
+			left = connection->OutGathered(iov, pieces, count, len);
+
+			//a short write filled the socket buffer, EPOLLOUT reports when it drains
+			if ((size_t)len < size)
+				break;
 		} while (left > 0);
 		return left;
 	}
 
-	void NetEngine::OnAccept(ITcpServer* server, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast) {
-		ITcpSession* session = server->MallocConnection();
-		if (!session) {
-			close(sock);
-			return;
+	//drains the error queue, false when the socket has a real error besides
+	bool NetEngine::DealZeroCopy(Connection* connection) {
+		char control[CMSG_SPACE(sizeof(sock_extended_err)) * 8];
+		while (true) {
+			msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(connection->GetSocket(), &msg, MSG_ERRQUEUE) < 0)
+				break;
+
+			for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+					continue;
+
+				//ee_info to ee_data is the range of sends completed
+				sock_extended_err* err = (sock_extended_err*)CMSG_DATA(cm);
+				if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY && err->ee_errno == 0)
+					connection->OnZeroCopyDone(err->ee_data + 1, (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+			}
 		}
 
-		sockaddr_in remote;
-		socklen_t size = sizeof(sockaddr_in);
-		if (0 != getpeername(sock, (sockaddr*)&remote, &size)) {
-			session->Release();
+		int32_t error = 0;
+		socklen_t len = sizeof(error);
+		return getsockopt(connection->GetSocket(), SOL_SOCKET, SO_ERROR, (char*)&error, &len) == 0 && error == 0;
+	}
 
+	void NetEngine::ReleasePayload(NetWorker* worker, SendPayload* payload) {
+		//a file is the pipe's own duplicate, only buffers go back to the application's thread
+		if (IsRunToCompletion() || !payload->buffer)
+			FreePayload(payload);
+		else
+			PushEvent(worker, NET_SEND_RELEASE, payload);
+	}
+
+	int32_t NetEngine::DoSendTo(UdpSocket* socket) {
+		NetWorker* worker = socket->GetEvent().worker;
+
+		mmsghdr msgs[UDP_SEND_BATCH];
+		uint32_t sizes[UDP_SEND_BATCH];
+		int32_t datagrams[UDP_SEND_BATCH];
+		while (socket->SendLeft() > 0) {
+			int32_t count = socket->PrepareSend(msgs, sizes, datagrams);
+			int32_t n = sendmmsg(socket->GetSocket(), msgs, count, MSG_NOSIGNAL);
+			worker->sendCalls.fetch_add(1, std::memory_order_relaxed);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return (int32_t)socket->SendLeft();
+
+				if (errno == EINTR)
+					continue;
+
+				//the route's device can't segment, datagrams go out one by one from now on
+				if (errno == EIO && msgs[0].msg_hdr.msg_controllen > 0) {
+					socket->DisableGso();
+					continue;
+				}
+
+				//the first one can't go out, too large for the route or unreachable, it is lost like on the wire
+				socket->Out(sizes[0]);
+				continue;
+			}
+
+			int64_t bytes = 0;
+			int64_t sent = 0;
+			for (int32_t i = 0; i < n; ++i) {
+				bytes += msgs[i].msg_len;
+				sent += datagrams[i];
+				socket->Out(sizes[i]);
+			}
+
+			worker->sendBytes.fetch_add(bytes, std::memory_order_relaxed);
+			worker->sendDatagrams.fetch_add(sent, std::memory_order_relaxed);
+		}
+		return 0;
+	}
+
+	void NetEngine::OnAccept(ITcpServer* server, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port, NetWorker* worker) {
+		worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+		ITcpSession* session = server->MallocConnection();
+		if (!session) {
 			close(sock);
 			return;
 		}
 
-		char remoteIp[LIBNET_IP_SIZE];
-		inet_ntop(AF_INET, &remote.sin_addr, remoteIp, sizeof(remoteIp));
-
-		Connection * connection = new Connection(sock, this, sendSize, recvSize, fast ? strcmp(remoteIp, LOCAL_IP) == 0 : false);
+		Connection * connection = new (worker->arena) Connection(sock, this, sendSize, recvSize, fast ? strcmp(ip, LOCAL_IP) == 0 : false, &worker->buffers);
 		connection->Attach(session);
 
-		connection->SetRemoteIp(remoteIp);
-		connection->SetRemotePort(ntohs(remote.sin_port));
+		connection->SetRemoteIp(ip);
+		connection->SetRemotePort(port);
+		if (_config.zeroCopyThreshold > 0) {
+			connection->EnableZeroCopy(_config.zeroCopyThreshold);
+			worker->acceptCalls.fetch_add(1, std::memory_order_relaxed);
+		}
 
-		if (!AddToWorker(&connection->GetEvent())) {
+		worker->acceptCalls.fetch_add(1, std::memory_order_relaxed);
+		if (!AddToWorker(&connection->GetEvent(), worker)) {
 			session->Release();
 
 			close(sock);
@@ -360,14 +1231,18 @@ namespace libnet {
 		Add(connection);
 	}
 
-	void NetEngine::OnConnect(ITcpSession* session, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port) {
-		Connection* connection = new Connection(sock, this, sendSize, recvSize, fast ? strcmp(ip, LOCAL_IP) == 0 : false);
+	void NetEngine::OnConnect(ITcpSession* session, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port, NetWorker* worker) {
+		worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+		Connection* connection = new (worker->arena) Connection(sock, this, sendSize, recvSize, fast ? strcmp(ip, LOCAL_IP) == 0 : false, &worker->buffers);
 		connection->Attach(session);
 
 		connection->SetRemoteIp(ip);
 		connection->SetRemotePort(port);
+		if (_config.zeroCopyThreshold > 0)
+			connection->EnableZeroCopy(_config.zeroCopyThreshold);
 
-		if (!AddToWorker(&connection->GetEvent())) {
+		if (!AddToWorker(&connection->GetEvent(), worker)) {
 			session->SetPipe(nullptr);
 			session->OnConnectFailed();
 
@@ -384,9 +1259,30 @@ namespace libnet {
 		session->OnConnectFailed();
 	}
 
-	bool NetEngine::AddToWorker(EpollBase* evt) {
-		evt->epollFd = SelectWorker();
-		if (evt->epollFd <= 0)
+	void NetEngine::OnBind(UdpSocket* socket, NetWorker* worker) {
+		if (!AddToWorker(&socket->GetEvent(), worker)) {
+			socket->OnFail();
+			return;
+		}
+
+		AddUdp(socket);
+		socket->_session->OnBind();
+	}
+
+	void NetEngine::PostToWorker(NetWorker* worker, int8_t cmdType, void* context) {
+		NetCommand* cmd = new NetCommand{ cmdType, context };
+		if (worker->commands.InsertHead(cmd))
+			Wakeup(worker);
+	}
+
+	void NetEngine::Wakeup(NetWorker* worker) {
+		uint64_t value = 1;
+		write(worker->wakeupFd, &value, sizeof(value));
+	}
+
+	bool NetEngine::AddToWorker(EpollBase* evt, NetWorker* worker) {
+		evt->worker = worker;
+		if (!evt->worker)
 			return false;
 
 		epoll_event ev;
@@ -394,38 +1290,91 @@ namespace libnet {
 		switch (evt->opt) {
 		case EPOLL_OPT_ACCEPT: ev.events = EPOLLIN; break;
 		case EPOLL_OPT_CONNECT: ev.events = EPOLLOUT | EPOLLET; break;
-		case EPOLL_OPT_IO: ev.events = EPOLLOUT | EPOLLET; break;
+		//writes are armed by AddSend, an initial EPOLLOUT would run the worker's send alongside the session's first one
+		case EPOLL_OPT_IO: ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP; break;
+		case EPOLL_OPT_UDP: ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP; break;
 		}
 		ev.events |= EPOLLERR | EPOLLHUP;
 
-		return epoll_ctl(evt->epollFd, EPOLL_CTL_ADD, evt->sock, &ev) == 0;
+		return epoll_ctl(evt->worker->epollFd, EPOLL_CTL_ADD, evt->sock, &ev) == 0;
+	}
+
+	void NetEngine::Add(Connection* conn) {
+		NetWorker* worker = conn->GetEvent().worker;
+		worker->connections.insert(conn);
+		worker->connectionCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void NetEngine::Remove(Connection* conn) {
+		NetWorker* worker = conn->GetEvent().worker;
+		if (worker->connections.erase(conn) > 0)
+			worker->connectionCount.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void NetEngine::AddReady(Connection* conn) {
+		conn->GetEvent().worker->ready.PushBack(conn->GetReadyHook());
+	}
+
+	void NetEngine::AddUdp(UdpSocket* socket) {
+		socket->GetEvent().worker->udpSockets.insert(socket);
+	}
+
+	void NetEngine::RemoveUdp(UdpSocket* socket) {
+		//a socket dropped before its worker registered it is in no set
+		NetWorker* worker = socket->GetEvent().worker;
+		if (worker)
+			worker->udpSockets.erase(socket);
+	}
+
+	void NetEngine::AddUdpReady(UdpSocket* socket) {
+		socket->GetEvent().worker->udpReady.PushBack(socket->GetReadyHook());
 	}
 
 	bool NetEngine::DelFromWorker(EpollBase* evt) {
-		return epoll_ctl(evt->epollFd, EPOLL_CTL_DEL, evt->sock, nullptr) == 0;
+		return epoll_ctl(evt->worker->epollFd, EPOLL_CTL_DEL, evt->sock, nullptr) == 0;
 	}
 
 	bool NetEngine::AddSend(EpollBase* evt) {
-		LIBNET_ASSERT(evt->opt == EPOLL_OPT_IO, "wtf");
+		LIBNET_ASSERT(evt->opt == EPOLL_OPT_IO || evt->opt == EPOLL_OPT_UDP, "wtf");
 
 		epoll_event ev;
 		ev.data.ptr = evt;
-		ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLERR | EPOLLHUP;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
 
-		return epoll_ctl(evt->epollFd, EPOLL_CTL_MOD, evt->sock, &ev) == 0;
+		return epoll_ctl(evt->worker->epollFd, EPOLL_CTL_MOD, evt->sock, &ev) == 0;
 	}
 
 	bool NetEngine::RemoveSend(EpollBase* evt) {
-		LIBNET_ASSERT(evt->opt == EPOLL_OPT_IO, "wtf");
+		LIBNET_ASSERT(evt->opt == EPOLL_OPT_IO || evt->opt == EPOLL_OPT_UDP, "wtf");
 
 		epoll_event ev;
 		ev.data.ptr = evt;
-		ev.events = EPOLLIN | EPOLLET | EPOLLERR | EPOLLHUP;
+		ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
 
-		return epoll_ctl(evt->epollFd, EPOLL_CTL_MOD, evt->sock, &ev) == 0;
+		return epoll_ctl(evt->worker->epollFd, EPOLL_CTL_MOD, evt->sock, &ev) == 0;
 	}
 
 	INetEngine * CreateNetEngine(int32_t threadCount) {
-		return new NetEngine(threadCount);
+		NetEngineConfig config;
+		config.threadCount = threadCount;
+		return CreateNetEngine(config);
+	}
+
+	INetEngine * CreateNetEngine(const NetEngineConfig& config) {
+		if (config.backend == NET_BACKEND_URING) {
+#ifdef LIBNET_URING
+			return CreateUringEngine(config);
+#else
+			return nullptr;
+#endif
+		}
+
+		NetEngine* engine = new NetEngine(config);
+		if (!engine->Start()) {
+			delete engine;
+			return nullptr;
+		}
+
+		return engine;
 	}
 }
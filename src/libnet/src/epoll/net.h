@@ -2,36 +2,134 @@
 #define __NET_H__
 #include "libnet.h"
 #include "lock_free_list.h"
+#include "intrusive_list.h"
+#include "node_arena.h"
+#include "send_chunk.h"
+#include "buffer_pool.h"
+#include "placement.h"
 #include <unordered_set>
 #include <unordered_map>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <stddef.h>
+#include <linux/errqueue.h>
 #include <vector>
+#include <atomic>
+#include <thread>
 #include "util.h"
 
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
 #define MIN_SEND_BUFF_SIZE 1024
+#define CORK_SEND_SIZE (64 << 10) //a corked pipe writes once this much is queued, or half its ring
+#define BUSY_POLL_BUDGET 8 //packets per device poll, the kernel's default
+#define MAX_SEND_FILE_SIZE (1 << 20) //per sendfile call
+#define SEND_IOV_MAX 64 //ring segments and payloads gathered into one sendmsg
 
 namespace libnet {
 	enum {
 		EPOLL_OPT_CONNECT = 0,
 		EPOLL_OPT_ACCEPT,
 		EPOLL_OPT_IO,
+		EPOLL_OPT_WAKEUP,
+		EPOLL_OPT_UDP,
 	};
 
+	//best effort, accepted sockets inherit it from their listener
+	inline void SetBusyPoll(int32_t sock, int32_t usec) {
+		if (usec <= 0)
+			return;
+
+		const int32_t prefer = 1;
+		setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, (const char*)&usec, sizeof(usec));
+		setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, (const char*)&prefer, sizeof(prefer));
+	}
+
+	//sends the partial segment held back by MSG_MORE, setting TCP_NODELAY pushes pending frames even when it is already on
+	inline void PushCorked(int32_t sock) {
+		const int32_t nodelay = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+	}
+
+	inline bool IsUnixAddress(const char* ip) {
+		return strncmp(ip, LIBNET_UNIX_PREFIX, sizeof(LIBNET_UNIX_PREFIX) - 1) == 0;
+	}
+
+	//the address length, 0 when the path is empty or doesn't fit
+	inline socklen_t MakeUnixAddress(const char* ip, sockaddr_un& addr) {
+		const char* path = ip + sizeof(LIBNET_UNIX_PREFIX) - 1;
+		size_t len = strlen(path);
+		if (len == 0 || len >= sizeof(addr.sun_path))
+			return 0;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		memcpy(addr.sun_path, path, len);
+
+		//an abstract name starts with a nul and has no terminating one
+		if (path[0] == '@') {
+			addr.sun_path[0] = 0;
+			return (socklen_t)(offsetof(sockaddr_un, sun_path) + len);
+		}
+		return (socklen_t)(offsetof(sockaddr_un, sun_path) + len + 1);
+	}
+
+	//no nodelay, reuseport or defer accept on a unix socket. a socket file left by a previous run is replaced
+	inline int32_t OpenUnixListenSocket(const char* ip, int32_t flags, int32_t backlog) {
+		sockaddr_un addr;
+		socklen_t len = MakeUnixAddress(ip, addr);
+		if (len == 0)
+			return -1;
+
+		int32_t sock = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+		if (sock < 0)
+			return -1;
+
+		struct stat st;
+		if (addr.sun_path[0] && stat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(addr.sun_path);
+
+		if (bind(sock, (sockaddr*)&addr, len) == -1 || listen(sock, backlog) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		return sock;
+	}
+
+	struct NetWorker;
 	struct EpollBase {
 		int8_t opt;
-		int32_t epollFd;
+		NetWorker* worker;
 		int32_t code;
 		int32_t sock;
 		void* context;
 		int32_t sendSize;
 		int32_t recvSize;
 		bool fast;
+		bool reusePort; //acceptor keeps its connections on its own worker
 		char remoteIp[LIBNET_IP_SIZE];
 		int32_t remotePort;
 	};
@@ -44,108 +142,320 @@ namespace libnet {
 		NET_FAIL,
 		NET_RECV,
 		NET_RECV_DONE,
+		NET_SEND_RELEASE, //a sent payload goes back to the application
+		NET_UDP_RECV,
+		NET_UDP_SEND_DONE,
+		NET_UDP_FAIL,
 	};
 
 	struct NetEvent {
 		int8_t evtType;
+		int16_t owner;
 		void * context;
+
+		AtomicIntrusiveLinkedListHook<NetEvent> next;
+	};
+
+	//only accept and connect carry a socket and its address
+	struct NetSocketEvent : public NetEvent {
 		int32_t sock;
 		int32_t sendSize;
 		int32_t recvSize;
 		bool fast;
+		int16_t target; //worker the new connection is placed on
 		char remoteIp[LIBNET_IP_SIZE];
 		int32_t remotePort;
+	};
 
-		AtomicIntrusiveLinkedListHook<NetEvent> next;
+	//records are taken by the owning worker and given back from any thread,
+	//the pool only grows to the number of events in flight
+	template <typename T>
+	class NetEventPool {
+	public:
+		NetEventPool() {}
+		~NetEventPool() {
+			_recycled.Sweep([](NetEvent* evt) { delete static_cast<T*>(evt); });
+			while (!_free.Empty())
+				delete static_cast<T*>(_free.Fetch());
+		}
+
+		NetEventPool(const NetEventPool&) = delete;
+		NetEventPool& operator=(const NetEventPool&) = delete;
+
+		inline T* Alloc() {
+			if (_free.Empty())
+				_free = _recycled.Fetch();
+
+			if (_free.Empty())
+				return new T;
+
+			return static_cast<T*>(_free.Fetch());
+		}
+
+		inline void Recycle(T* evt) {
+			_recycled.InsertHead(evt);
+		}
+
+	private:
+		AtomicIntrusiveLinkedFetchedList<NetEvent, &NetEvent::next> _free;
+		AtomicIntrusiveLinkedList<NetEvent, &NetEvent::next> _recycled;
 	};
 
+	enum NetCommandType {
+		NET_CMD_STOP,
+		NET_CMD_ACCEPT,
+		NET_CMD_CONNECT,
+		NET_CMD_BIND,
+	};
+
+	struct NetCommand {
+		int8_t cmdType;
+		void * context;
+
+		AtomicIntrusiveLinkedListHook<NetCommand> next;
+	};
+
+	//an ISendBuffer or a file range queued behind the send ring bytes written ahead of it
+	struct SendPayload {
+		ISendBuffer* buffer; //null for a file
+		int32_t fd; //the pipe's own duplicate of the file
+		int64_t position; //file offset the range starts at
+		int64_t size;
+		uint32_t tail; //send ring position when it was queued
+		int64_t offset; //sent so far
+		bool zeroCopy; //some of it went out with MSG_ZEROCOPY
+		uint32_t seq; //zero-copy send carrying its last such bytes
+
+		AtomicIntrusiveLinkedListHook<SendPayload> next;
+	};
+
+	inline SendPayload* NewPayload(ISendBuffer* buffer, int32_t fd, int64_t position, int64_t size, uint32_t tail) {
+		SendPayload* payload = new SendPayload;
+		payload->buffer = buffer;
+		payload->fd = fd;
+		payload->position = position;
+		payload->size = size;
+		payload->tail = tail;
+		payload->offset = 0;
+		payload->zeroCopy = false;
+		payload->seq = 0;
+		return payload;
+	}
+
+	inline void FreePayload(SendPayload* payload) {
+		if (payload->buffer)
+			payload->buffer->Release();
+		else
+			close(payload->fd);
+		delete payload;
+	}
+
 	class Connection;
+	class UdpSocket;
+	struct NetWorker {
+		int16_t index = 0;
+		std::thread thread;
+		int32_t epollFd = -1;
+		int32_t wakeupFd = -1;
+		EpollBase wakeup;
+
+		int32_t cpu = -1;
+		NodeArena* arena = nullptr; //numa local allocations, only touched by the thread dispatching this worker's sessions
+		SendChunkPool chunks; //send queues past full rings, same thread as the arena
+		BufferPool buffers; //ring storage of the worker's connections, same thread as the arena
+		std::vector<char> recvScratch; //reads of connections with nothing left over, run to completion only
+
+		AtomicIntrusiveLinkedList<NetCommand, &NetCommand::next> commands;
+
+		NetEventPool<NetEvent> events;
+		NetEventPool<NetSocketEvent> socketEvents;
+
+		//only touched by the thread dispatching this worker's sessions
+		std::unordered_set<Connection*> connections;
+		IntrusiveList<Connection> ready; //pending sends or active fast pipes
+		std::unordered_set<UdpSocket*> udpSockets;
+		IntrusiveList<UdpSocket> udpReady; //datagrams queued this round
+
+		//connects in progress, only touched by the worker thread
+		std::unordered_set<EpollBase*> connectors;
+		std::atomic<bool> drained = { false }; //nothing left to send, reported while the engine drains
+
+		//load counters, read by placement and GetWorkerStat from any thread
+		std::atomic<int32_t> connectionCount = { 0 };
+		std::atomic<int32_t> pending = { 0 }; //placed here but not registered yet
+		std::atomic<int64_t> recvBytes = { 0 };
+		std::atomic<int64_t> sendBytes = { 0 };
+		std::atomic<int64_t> recvCalls = { 0 };
+		std::atomic<int64_t> sendCalls = { 0 };
+		std::atomic<int64_t> acceptCalls = { 0 };
+		std::atomic<int64_t> recvDatagrams = { 0 };
+		std::atomic<int64_t> sendDatagrams = { 0 };
+		std::atomic<int64_t> dropDatagrams = { 0 };
+		std::atomic<int64_t> bytesPerSecond = { 0 };
+
+		//only touched by the worker thread
+		int64_t sampleBytes = 0;
+		int64_t sampleTime = 0;
+	};
+
 	class NetEngine : public INetEngine {
 	public:
-		NetEngine(int32_t threadCount);
+		NetEngine(const NetEngineConfig& config);
 		~NetEngine();
 
-		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast);
+		bool Start();
+
+		using INetEngine::Listen;
+		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options);
 		virtual void Stop(ITcpServer* server);
 		virtual bool Connect(ITcpSession* session, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast);
+		using INetEngine::Bind;
+		virtual bool Bind(IUdpSession* session, const char* ip, const int32_t port, const UdpOptions& options);
 
-		virtual void Poll(int64_t frame);
+		virtual PollResult Poll(int64_t frame, int32_t maxEvents);
 		virtual void Release();
 
-		void ThreadProc(int32_t fd);
+		virtual int32_t GetWorkerCount() const { return (int32_t)_workers.size(); }
+		virtual bool GetWorkerStat(int32_t index, NetWorkerStat& stat) const;
+
+		void ThreadProc(NetWorker* worker);
+		void SampleLoad(NetWorker* worker);
 
+		void Drain();
+		bool HasPendingSend(NetWorker* worker);
+		void DropCommand(NetCommand* cmd);
+		void DropEvent(NetEvent* evt);
+
+		int32_t OpenListenSocket(const char* ip, const int32_t port, const ListenOptions& options);
+		//connected or connecting, remoteAddr gets what placement hashes
+		int32_t OpenConnectSocket(const char* ip, const int32_t port, uint32_t& remoteAddr);
+
+		void DealEvent(NetEvent* evt);
+		void DealWakeup(NetWorker* worker);
+		void DealCommand(NetWorker* worker, NetCommand* cmd);
 		void DealAccept(EpollBase* evt);
 		void DealConnect(EpollBase* evt);
 		void DealIO(EpollBase* evt, int32_t flag);
+		bool DealRecv(EpollBase* evt, int32_t flag);
+		void DealFail(EpollBase* evt);
+		void DealReady(NetWorker* worker);
+		void DealUdp(EpollBase* evt, int32_t flag);
+		bool DealUdpRecv(EpollBase* evt);
+		void DealUdpFail(EpollBase* evt);
 
-		int32_t DoSend(Connection* connection);
+		//files and zero-copy payloads are only sent by the worker, a poll mode caller stops at the first one
+		int32_t DoSend(Connection* connection, bool payloads);
+		bool DealZeroCopy(Connection* connection);
+		//queued datagrams left, -1 when the socket failed
+		int32_t DoSendTo(UdpSocket* socket);
+		void OnBind(UdpSocket* socket, NetWorker* worker);
+		void ReleasePayload(NetWorker* worker, SendPayload* payload);
 
-		void OnAccept(ITcpServer* server, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast);
-		void OnConnect(ITcpSession* session, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port);
+		void OnAccept(ITcpServer* server, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port, NetWorker* worker);
+		void OnConnect(ITcpSession* session, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port, NetWorker* worker);
 		void OnConnectFail(ITcpSession* session);
 
-		inline int32_t SelectWorker() {
-			if (_fds.empty())
-				return 0;
+		inline bool IsRunToCompletion() const { return _config.dispatchMode == NET_DISPATCH_WORKER; }
+		inline int32_t GetSendQueueLimit() const { return _config.sendQueueLimit; }
+		inline bool IsMirrorRecv() const { return _config.mirrorRecvBuffer; }
+		//sessions have to run on the worker to read straight from its scratch buffer
+		inline bool IsSharedRecv() const { return IsRunToCompletion() && _config.sharedRecvSize > 0; }
+
+		inline NetWorker* NextWorker() {
+			if (_workers.empty())
+				return nullptr;
 
-			_nextIdx = (_nextIdx + 1) % _fds.size();
-			return _fds[_nextIdx];
+			return _workers[_nextIdx.fetch_add(1, std::memory_order_relaxed) % _workers.size()];
 		}
-		bool AddToWorker(EpollBase* evt);
+
+		//picks a worker for a new connection by the placement policy and counts it as pending there,
+		//OnAccept and OnConnect take it back once the connection is registered or dropped
+		NetWorker* PlaceWorker(uint32_t remoteAddr);
+
+		void PostToWorker(NetWorker* worker, int8_t cmdType, void* context);
+		void Wakeup(NetWorker* worker);
+		bool AddToWorker(EpollBase* evt, NetWorker* worker);
 		bool DelFromWorker(EpollBase* evt);
 		bool AddSend(EpollBase* evt);
 		bool RemoveSend(EpollBase* evt);
 
-		inline void PushAccept(int32_t sock, ITcpServer* server, int32_t sendSize, int32_t recvSize, bool fast) {
-			NetEvent* evt = new NetEvent{ NET_ACCEPT, server, sock, sendSize, recvSize, fast };
-			_eventQueue.InsertHead(evt);
+		inline NetSocketEvent* AllocSocketEvent(NetWorker* worker, int8_t evtType, void* context, int32_t sock, int32_t sendSize, int32_t recvSize, bool fast) {
+			NetSocketEvent* evt = worker->socketEvents.Alloc();
+			evt->evtType = evtType;
+			evt->owner = worker->index;
+			evt->context = context;
+			evt->sock = sock;
+			evt->sendSize = sendSize;
+			evt->recvSize = recvSize;
+			evt->fast = fast;
+			evt->target = worker->index;
+			evt->remoteIp[0] = 0;
+			evt->remotePort = 0;
+			return evt;
 		}
 
-		inline void PushConnectSuccess(int32_t sock, ITcpSession* session, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port) {
-			NetEvent* evt = new NetEvent{ NET_CONNECT_SUCCESS, session, sock, sendSize, recvSize, fast };
-			SafeSprintf(evt->remoteIp, sizeof(evt->remoteIp), "%s", ip);
-			evt->remotePort = port;
+		inline void PushEvent(NetWorker* worker, int8_t evtType, void* context) {
+			NetEvent* evt = worker->events.Alloc();
+			evt->evtType = evtType;
+			evt->owner = worker->index;
+			evt->context = context;
 
 			_eventQueue.InsertHead(evt);
 		}
 
-		inline void PushConnectFail(ITcpSession* session) {
-			NetEvent* evt = new NetEvent{ NET_CONNECT_FAIL, session };
-			_eventQueue.InsertHead(evt);
+		inline void RecycleEvent(NetEvent* evt) {
+			NetWorker* worker = _workers[evt->owner];
+			if (evt->evtType == NET_ACCEPT || evt->evtType == NET_CONNECT_SUCCESS)
+				worker->socketEvents.Recycle(static_cast<NetSocketEvent*>(evt));
+			else
+				worker->events.Recycle(evt);
 		}
 
-		inline void PushSendDone(Connection * connection) {
-			NetEvent* evt = new NetEvent{ NET_SEND_DONE, connection };
-			_eventQueue.InsertHead(evt);
+		inline NetSocketEvent* AllocAccept(NetWorker* worker, int32_t sock, ITcpServer* server, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port, NetWorker* target) {
+			NetSocketEvent* evt = AllocSocketEvent(worker, NET_ACCEPT, server, sock, sendSize, recvSize, fast);
+			evt->target = target->index;
+			SafeSprintf(evt->remoteIp, sizeof(evt->remoteIp), "%s", ip);
+			evt->remotePort = port;
+			return evt;
 		}
 
-		inline void PushFail(Connection * connection) {
-			NetEvent* evt = new NetEvent{ NET_FAIL, connection };
-			_eventQueue.InsertHead(evt);
+		inline void PushAccept(NetWorker* worker, int32_t sock, ITcpServer* server, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port, NetWorker* target) {
+			_eventQueue.InsertHead(AllocAccept(worker, sock, server, sendSize, recvSize, fast, ip, port, target));
 		}
 
-		inline void PushRecv(Connection* connection) {
-			NetEvent* evt = new NetEvent{ NET_RECV, connection };
-			_eventQueue.InsertHead(evt);
-		}
+		inline void PushConnectSuccess(NetWorker* worker, int32_t sock, ITcpSession* session, int32_t sendSize, int32_t recvSize, bool fast, const char* ip, int32_t port) {
+			NetSocketEvent* evt = AllocSocketEvent(worker, NET_CONNECT_SUCCESS, session, sock, sendSize, recvSize, fast);
+			SafeSprintf(evt->remoteIp, sizeof(evt->remoteIp), "%s", ip);
+			evt->remotePort = port;
 
-		inline void PushRecvDone(Connection* connection) {
-			NetEvent* evt = new NetEvent{ NET_RECV_DONE, connection };
 			_eventQueue.InsertHead(evt);
 		}
 
-		inline void Add(Connection* conn) { _connections.insert(conn); }
-		inline void Remove(Connection* conn) { _connections.erase(conn); }
+		inline void PushConnectFail(NetWorker* worker, ITcpSession* session) { PushEvent(worker, NET_CONNECT_FAIL, session); }
+		inline void PushSendDone(NetWorker* worker, Connection * connection) { PushEvent(worker, NET_SEND_DONE, connection); }
+		inline void PushFail(NetWorker* worker, Connection * connection) { PushEvent(worker, NET_FAIL, connection); }
+		inline void PushRecv(NetWorker* worker, Connection* connection) { PushEvent(worker, NET_RECV, connection); }
+		inline void PushRecvDone(NetWorker* worker, Connection* connection) { PushEvent(worker, NET_RECV_DONE, connection); }
+
+		void Add(Connection* conn);
+		void Remove(Connection* conn);
+		void AddReady(Connection* conn);
+		void AddUdp(UdpSocket* socket);
+		void RemoveUdp(UdpSocket* socket);
+		void AddUdpReady(UdpSocket* socket);
 
 	private:
-		bool _terminate;
+		std::atomic<bool> _terminate = { false };
+		std::atomic<bool> _draining = { false };
+		NetEngineConfig _config;
+		bool _pollPinned = false;
 
-		int32_t _nextIdx = 0;
-		std::vector<int32_t> _fds;
+		std::atomic<uint32_t> _nextIdx = { 0 };
+		std::vector<NetWorker*> _workers;
 		AtomicIntrusiveLinkedList<NetEvent, &NetEvent::next> _eventQueue;
+		AtomicIntrusiveLinkedFetchedList<NetEvent, &NetEvent::next> _pendingEvents; //fetched but out of Poll budget
 
-		std::unordered_set<Connection*> _connections;
-		std::unordered_map<ITcpServer*, int32_t> _servers;
+		std::unordered_map<ITcpServer*, std::vector<EpollBase*>> _servers;
 	};
 }
 
@@ -0,0 +1,100 @@
+#ifndef __INTRUSIVE_LIST__
+#define __INTRUSIVE_LIST__
+
+namespace libnet {
+	template <class T>
+	struct IntrusiveListHook {
+		IntrusiveListHook() {}
+		IntrusiveListHook(T* t) : owner(t) {}
+
+		T* owner = nullptr;
+		IntrusiveListHook* prev = nullptr;
+		IntrusiveListHook* next = nullptr;
+
+		inline bool IsLinked() const {
+			return next != nullptr;
+		}
+
+		/**
+		* Removes the element from whatever list holds it, no-op when unlinked.
+		*/
+		inline void Unlink() {
+			if (next) {
+				prev->next = next;
+				next->prev = prev;
+				prev = nullptr;
+				next = nullptr;
+			}
+		}
+	};
+
+	/**
+	* Circular doubly linked list around a sentinel, not thread safe.
+	* An element can be unlinked in O(1) without knowing its list.
+	* Hooks carry their owner so T may stay incomplete where the list is declared.
+	*/
+	template <class T>
+	class IntrusiveList {
+	public:
+		IntrusiveList() {
+			_head.prev = &_head;
+			_head.next = &_head;
+		}
+
+		~IntrusiveList() {
+			Clear();
+		}
+
+		IntrusiveList(const IntrusiveList&) = delete;
+		IntrusiveList& operator=(const IntrusiveList&) = delete;
+
+		inline bool Empty() const {
+			return _head.next == &_head;
+		}
+
+		inline void PushBack(IntrusiveListHook<T>& hook) {
+			hook.prev = _head.prev;
+			hook.next = &_head;
+			_head.prev->next = &hook;
+			_head.prev = &hook;
+		}
+
+		inline T* PopFront() {
+			if (Empty())
+				return nullptr;
+
+			IntrusiveListHook<T>* hook = _head.next;
+			hook->Unlink();
+			return hook->owner;
+		}
+
+		/**
+		* Moves every element to the back of other, this list is empty afterwards.
+		*/
+		inline void MoveTo(IntrusiveList& other) {
+			if (Empty())
+				return;
+
+			IntrusiveListHook<T>* first = _head.next;
+			IntrusiveListHook<T>* last = _head.prev;
+
+			first->prev = other._head.prev;
+			other._head.prev->next = first;
+			last->next = &other._head;
+			other._head.prev = last;
+
+			_head.prev = &_head;
+			_head.next = &_head;
+		}
+
+		inline void Clear() {
+			while (!Empty())
+				_head.next->Unlink();
+		}
+
+	private:
+		IntrusiveListHook<T> _head;
+	};
+}
+
+#endif //__INTRUSIVE_LIST__
@@ -347,4 +347,17 @@ namespace libnet {
 			delete this;
 		}
 	}
+
+	void Connection::OnFail() {
+		_recving = false;
+		_sending = false;
+		Shutdown();
+
+		_session->OnDisconnect();
+		_session->SetPipe(nullptr);
+
+		_session->Release();
+		_engine->Remove(this);
+		delete this;
+	}
 }
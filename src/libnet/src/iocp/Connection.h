@@ -54,6 +54,8 @@ namespace libnet {
 		void OnRecv();
 		void OnRecvDone();
 		void OnRecvFail();
+		//the engine is going away, its threads are joined and no completion is left for this connection
+		void OnFail();
 
 	private:
 		SOCKET _fd;
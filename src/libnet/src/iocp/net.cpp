@@ -56,25 +56,74 @@ LPFN_ACCEPTEX g_accept = nullptr;
 LPFN_CONNECTEX g_connect = nullptr;
 
 namespace libnet {
-	NetEngine::NetEngine(HANDLE completionPort, int32_t threadCount) : _completionPort(completionPort) {
-		for (int32_t i = 0; i < threadCount; ++i) {
-			std::thread([this]() {
+	NetEngine::NetEngine(HANDLE completionPort, const NetEngineConfig& config) : _completionPort(completionPort), _config(config) {
+		//numaLocal is not supported here, buffers come from the process heap
+		for (int32_t i = 0; i < _config.threadCount; ++i) {
+			int32_t cpu = _config.workerCpus.empty() ? -1 : _config.workerCpus[i % _config.workerCpus.size()];
+			_threads.emplace_back([this, cpu]() {
+				if (cpu >= 0 && cpu < 64)
+					SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+
 				ThreadProc();
-			}).detach();
+			});
 		}
-
-		_terminate = false;
 	}
 
 	NetEngine::~NetEngine() {
+		//an empty completion wakes one blocked thread to see _terminate
+		_terminate = true;
+		for (size_t i = 0; i < _threads.size(); ++i)
+			PostQueuedCompletionStatus(_completionPort, 0, 0, nullptr);
+
+		for (auto& thread : _threads)
+			thread.join();
+
+		//closing the sockets cancels their pending io, the port still gets a completion for each
+		for (auto& itr : _servers)
+			closesocket(itr.second);
+		_servers.clear();
+
+		for (auto* conn : _connections)
+			conn->Shutdown();
+
+		while (true) {
+			DWORD bytes = 0;
+			ULONG_PTR key = 0;
+			IocpEvent* evt = nullptr;
+			BOOL ret = GetQueuedCompletionStatus(_completionPort, &bytes, &key, (LPOVERLAPPED*)&evt, SHUTDOWN_CANCEL_WAIT);
+			if (!ret && !evt)
+				break;
+
+			//wakeups left over from the join carry no event
+			if (evt)
+				DropCompletion(evt);
+		}
+
 		CloseHandle(_completionPort);
-		WSACleanup();
 
-		_terminate = true;
-		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		//every thread has exited, whatever is still queued belongs to this thread now
+		while (!_pendingEvents.Empty()) {
+			NetEvent* evt = _pendingEvents.Fetch();
+			DropEvent(evt);
+			delete evt;
+		}
+
+		_eventQueue.Sweep([this](NetEvent* evt) {
+			DropEvent(evt);
+			delete evt;
+		});
+
+		//OnFail removes from the set, iterate a copy
+		std::unordered_set<Connection*> connections;
+		connections.swap(_connections);
+		for (auto* conn : connections)
+			conn->OnFail();
+
+		WSACleanup();
 	}
 
-	bool NetEngine::Listen(ITcpServer* server, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) {
+	bool NetEngine::Listen(ITcpServer* server, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options) {
+		//reusePort has no windows counterpart, AcceptEx completions already spread over every worker thread
 		SOCKET sock = INVALID_SOCKET;
 		if (INVALID_SOCKET == (sock = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED))) {
 			return false;
@@ -99,7 +148,13 @@ namespace libnet {
 			return false;
 		}
 
-		if (listen(sock, 128) == SOCKET_ERROR) {
+		//AcceptEx sockets take it over with SO_UPDATE_ACCEPT_CONTEXT
+		if (options.sendBuffer > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBuffer, sizeof(options.sendBuffer)) == SOCKET_ERROR) {
+			closesocket(sock);
+			return false;
+		}
+
+		if (listen(sock, options.backlog) == SOCKET_ERROR) {
 			closesocket(sock);
 			return false;
 		}
@@ -199,21 +254,34 @@ namespace libnet {
 		return true;
 	}
 
-	void NetEngine::Poll(int64_t frame) {
-		_eventQueue.SweepOnce([this](NetEvent* evt) {
-			switch (evt->evtType) {
-			case NET_ACCEPT: OnAccept((ITcpServer*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast); break;
-			case NET_CONNECT_SUCCESS: OnConnect((ITcpSession*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort); break;
-			case NET_CONNECT_FAIL : OnConnectFail((ITcpSession*)evt->context); break;
-			case NET_SEND_DONE: ((Connection*)evt->context)->OnSendDone(); break;
-			case NET_SEND_FAIL: ((Connection*)evt->context)->OnSendFail(); break;
-			case NET_RECV: ((Connection*)evt->context)->OnRecv(); break;
-			case NET_RECV_DONE: ((Connection*)evt->context)->OnRecvDone(); break;
-			case NET_RECV_FAIL: ((Connection*)evt->context)->OnRecvFail(); break;
+	PollResult NetEngine::Poll(int64_t frame, int32_t maxEvents) {
+		PollResult result;
+
+		if (!_pollPinned) {
+			_pollPinned = true;
+			if (_config.pollCpu >= 0 && _config.pollCpu < 64)
+				SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << _config.pollCpu);
+		}
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(frame);
+		if (_pendingEvents.Empty())
+			_pendingEvents = _eventQueue.Fetch();
+
+		while (!_pendingEvents.Empty()) {
+			if (result.processed > 0) {
+				if (maxEvents > 0 && result.processed >= maxEvents)
+					break;
+
+				if (frame > 0 && std::chrono::steady_clock::now() >= deadline)
+					break;
 			}
 
+			NetEvent* evt = _pendingEvents.Fetch();
+			DealEvent(evt);
 			delete evt;
-		});
+
+			++result.processed;
+		}
 
 		for (auto* conn : _connections) {
 			if (conn->NeedUpdateSend())
@@ -222,12 +290,59 @@ namespace libnet {
 			if (conn->IsFastConnected())
 				conn->UpdateFast();
 		}
+
+		result.remain = !_pendingEvents.Empty() || !_eventQueue.Empty();
+		return result;
+	}
+
+	void NetEngine::DealEvent(NetEvent* evt) {
+		switch (evt->evtType) {
+		case NET_ACCEPT: OnAccept((ITcpServer*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast); break;
+		case NET_CONNECT_SUCCESS: OnConnect((ITcpSession*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->fast, evt->remoteIp, evt->remotePort); break;
+		case NET_CONNECT_FAIL : OnConnectFail((ITcpSession*)evt->context); break;
+		case NET_SEND_DONE: ((Connection*)evt->context)->OnSendDone(); break;
+		case NET_SEND_FAIL: ((Connection*)evt->context)->OnSendFail(); break;
+		case NET_RECV: ((Connection*)evt->context)->OnRecv(); break;
+		case NET_RECV_DONE: ((Connection*)evt->context)->OnRecvDone(); break;
+		case NET_RECV_FAIL: ((Connection*)evt->context)->OnRecvFail(); break;
+		}
 	}
 
 	void NetEngine::Release() {
 		delete this;
 	}
 
+	void NetEngine::DropEvent(NetEvent* evt) {
+		switch (evt->evtType) {
+		case NET_ACCEPT: closesocket(evt->sock); break;
+		case NET_CONNECT_SUCCESS: {
+				closesocket(evt->sock);
+				OnConnectFail((ITcpSession*)evt->context);
+			}
+			break;
+		case NET_CONNECT_FAIL: OnConnectFail((ITcpSession*)evt->context); break;
+		}
+	}
+
+	void NetEngine::DropCompletion(IocpEvent* evt) {
+		//send and recv events live in their connections, released with them
+		switch (evt->opt) {
+		case IOCP_OPT_ACCEPT: {
+				IocpAcceptor* acceptor = (IocpAcceptor*)evt;
+				closesocket(acceptor->sock);
+				delete acceptor;
+			}
+			break;
+		case IOCP_OPT_CONNECT: {
+				IocpConnector* connector = (IocpConnector*)evt;
+				closesocket(connector->connect.sock);
+				OnConnectFail((ITcpSession*)connector->connect.context);
+				delete connector;
+			}
+			break;
+		}
+	}
+
 	void NetEngine::ThreadProc() {
 		while (!_terminate) {
 			IocpEvent * evt = GetQueueState(_completionPort);
@@ -239,7 +354,7 @@ namespace libnet {
 				case IOCP_OPT_SEND: DealSend(evt); break;
 				}
 			}
-			else {
+			else if (_config.waitMode == NET_WAIT_SLEEP) {
 				std::this_thread::sleep_for(std::chrono::milliseconds(1));
 			}
 		}
@@ -433,7 +548,7 @@ namespace libnet {
 		IocpEvent * evt = nullptr;
 
 		SetLastError(0);
-		BOOL ret = GetQueuedCompletionStatus(completionPort, &bytes, (PULONG_PTR)&socket, (LPOVERLAPPED *)&evt, 10);
+		BOOL ret = GetQueuedCompletionStatus(completionPort, &bytes, (PULONG_PTR)&socket, (LPOVERLAPPED *)&evt, _config.waitMode == NET_WAIT_BLOCK ? _config.waitTimeout : 0);
 
 		if (nullptr == evt)
 			return nullptr;
@@ -511,6 +626,12 @@ namespace libnet {
 	}
 
 	INetEngine * CreateNetEngine(int32_t threadCount) {
+		NetEngineConfig config;
+		config.threadCount = threadCount;
+		return CreateNetEngine(config);
+	}
+
+	INetEngine * CreateNetEngine(const NetEngineConfig& config) {
 		WSADATA wsaData;
 		if (0 != WSAStartup(MAKEWORD(2, 2), &wsaData))
 			return nullptr;
@@ -525,6 +646,6 @@ namespace libnet {
 		if (nullptr == (completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0)))
 			return nullptr;
 
-		return new NetEngine(completionPort, threadCount);
+		return new NetEngine(completionPort, config);
 	}
 }
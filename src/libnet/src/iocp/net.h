@@ -5,8 +5,12 @@
 #include "lock_free_list.h"
 #include <unordered_set>
 #include <unordered_map>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 #define MIN_SEND_BUFF_SIZE 1024
+#define SHUTDOWN_CANCEL_WAIT 100 //ms to wait for the completions of io cancelled on shutdown
 
 namespace libnet {
 	enum {
@@ -71,18 +75,26 @@ namespace libnet {
 	class Connection;
 	class NetEngine : public INetEngine {
 	public:
-		NetEngine(HANDLE completionPort, int32_t threadCount);
+		NetEngine(HANDLE completionPort, const NetEngineConfig& config);
 		~NetEngine();
 
-		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast);
+		using INetEngine::Listen;
+		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options);
 		virtual void Stop(ITcpServer* server);
 		virtual bool Connect(ITcpSession* session, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast);
 
-		virtual void Poll(int64_t frame);
+		virtual PollResult Poll(int64_t frame, int32_t maxEvents);
 		virtual void Release();
 
+		//one completion port serves every thread, there is no per-worker placement to report
+		virtual int32_t GetWorkerCount() const { return 0; }
+		virtual bool GetWorkerStat(int32_t index, NetWorkerStat& stat) const { return false; }
+
 		void ThreadProc();
 
+		void DealEvent(NetEvent* evt);
+		void DropEvent(NetEvent* evt);
+		void DropCompletion(IocpEvent* evt);
 		bool DoSend(Connection* connection);
 		bool DoRecv(Connection* connection);
 		bool DoAccept(IocpAcceptor * evt);
@@ -144,10 +156,14 @@ namespace libnet {
 		inline void Remove(Connection* conn) { _connections.erase(conn); }
 
 	private:
-		bool _terminate = false;
+		std::atomic<bool> _terminate = { false };
+		std::vector<std::thread> _threads;
 
 		HANDLE _completionPort;
+		NetEngineConfig _config;
+		bool _pollPinned = false;
 		AtomicIntrusiveLinkedList<NetEvent, &NetEvent::next> _eventQueue;
+		AtomicIntrusiveLinkedFetchedList<NetEvent, &NetEvent::next> _pendingEvents; //fetched but out of Poll budget
 
 		std::unordered_set<Connection*> _connections;
 		std::unordered_map<ITcpServer*, SOCKET> _servers;
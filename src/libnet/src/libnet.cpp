@@ -1,6 +1,12 @@
 #include "libnet.h"
 #include "util.h"
 #include <assert.h>
+#include <new>
+#ifdef WIN32
+#include <WS2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,3 +24,41 @@ extern "C" {
 #ifdef __cplusplus
 }
 #endif
+
+namespace libnet {
+	SharedBuffer* SharedBuffer::Create(const char* data, const int32_t size) {
+		//the bytes run on past _data
+		void* p = malloc(sizeof(SharedBuffer) + (size > 0 ? size : 0));
+		if (!p)
+			return nullptr;
+
+		SharedBuffer* buffer = new (p) SharedBuffer(size);
+		if (size > 0)
+			memcpy(buffer->_data, data, size);
+		return buffer;
+	}
+
+	void SharedBuffer::Release() {
+		if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			this->~SharedBuffer();
+			free(this);
+		}
+	}
+
+	bool MakeNetAddress(const char* ip, const int32_t port, NetAddress& address) {
+		in_addr addr;
+		if (inet_pton(AF_INET, ip, &addr) != 1 || port < 0 || port > 65535)
+			return false;
+
+		address.ip = addr.s_addr;
+		address.port = htons((uint16_t)port);
+		return true;
+	}
+
+	void FormatNetAddress(const NetAddress& address, char* ip, int32_t size, int32_t& port) {
+		in_addr addr;
+		addr.s_addr = address.ip;
+		inet_ntop(AF_INET, &addr, ip, size);
+		port = ntohs(address.port);
+	}
+}
@@ -38,6 +38,14 @@ namespace libnet {
 			return _head == nullptr;
 		}
 
+		inline T* Front() const {
+			return _head;
+		}
+
+		inline T* After(T* t) const {
+			return Next(t);
+		}
+
 		inline T * Fetch() {
 			auto t = _head;
 			_head = Next(t);
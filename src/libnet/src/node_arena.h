@@ -0,0 +1,160 @@
+#ifndef __NODE_ARENA_H__
+#define __NODE_ARENA_H__
+#include "libnet.h"
+#include <vector>
+#include <new>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define NODE_ARENA_MIN_SHIFT 6
+#define NODE_ARENA_MAX_SHIFT 16
+#define NODE_ARENA_CHUNK_SIZE (1 << 20)
+#define NODE_ARENA_PAGE_SIZE 4096
+#define NODE_ARENA_MPOL_PREFERRED 1
+
+namespace libnet {
+	/**
+	* Size-class allocator whose pages are bound to one memory node, not thread safe.
+	* Blocks carry a small header so Free needs neither the size nor the arena,
+	* blocks from Alloc(nullptr, size) come from malloc and free the same way.
+	*/
+	class NodeArena {
+		struct Header {
+			NodeArena* arena;
+			uint32_t shift; //size class, 0 for a mapping of its own
+			uint32_t size; //mapped size of a large block
+		};
+
+		struct FreeBlock {
+			FreeBlock* next;
+		};
+
+	public:
+		NodeArena(int32_t node) : _node(node) {
+			memset(_free, 0, sizeof(_free));
+		}
+
+		~NodeArena() {
+			for (char* chunk : _chunks)
+				Unmap(chunk, NODE_ARENA_CHUNK_SIZE);
+		}
+
+		NodeArena(const NodeArena&) = delete;
+		NodeArena& operator=(const NodeArena&) = delete;
+
+		inline int32_t GetNode() const { return _node; }
+
+		void* Alloc(size_t size) {
+			size_t total = size + sizeof(Header);
+			uint32_t shift = NODE_ARENA_MIN_SHIFT;
+			while (shift <= NODE_ARENA_MAX_SHIFT && ((size_t)1 << shift) < total)
+				++shift;
+
+			Header* header = nullptr;
+			if (shift > NODE_ARENA_MAX_SHIFT) {
+				size_t mapped = (total + NODE_ARENA_PAGE_SIZE - 1) & ~((size_t)NODE_ARENA_PAGE_SIZE - 1);
+				header = (Header*)Map(mapped);
+				if (!header)
+					return nullptr;
+
+				header->shift = 0;
+				header->size = (uint32_t)mapped;
+			}
+			else {
+				FreeBlock*& head = _free[shift - NODE_ARENA_MIN_SHIFT];
+				if (head) {
+					header = (Header*)head;
+					head = head->next;
+				}
+				else {
+					size_t block = (size_t)1 << shift;
+					if (_cursor + block > _end) {
+						char* chunk = (char*)Map(NODE_ARENA_CHUNK_SIZE);
+						if (!chunk)
+							return nullptr;
+
+						_chunks.push_back(chunk);
+						_cursor = chunk;
+						_end = chunk + NODE_ARENA_CHUNK_SIZE;
+					}
+
+					header = (Header*)_cursor;
+					_cursor += block;
+				}
+
+				header->shift = shift;
+				header->size = 0;
+			}
+
+			header->arena = this;
+			return header + 1;
+		}
+
+		static void* Alloc(NodeArena* arena, size_t size) {
+			if (arena)
+				return arena->Alloc(size);
+
+			Header* header = (Header*)malloc(size + sizeof(Header));
+			if (!header)
+				return nullptr;
+
+			header->arena = nullptr;
+			header->shift = 0;
+			header->size = 0;
+			return header + 1;
+		}
+
+		static void Free(void* p) {
+			if (!p)
+				return;
+
+			Header* header = (Header*)p - 1;
+			if (!header->arena)
+				free(header);
+			else if (header->shift == 0)
+				Unmap(header, header->size);
+			else {
+				FreeBlock* block = (FreeBlock*)header;
+				FreeBlock*& head = header->arena->_free[header->shift - NODE_ARENA_MIN_SHIFT];
+				block->next = head;
+				head = block;
+			}
+		}
+
+	private:
+		//pages are placed on the node when first touched, a node without free memory falls back to others
+		void* Map(size_t size) {
+#ifdef WIN32
+			return malloc(size);
+#else
+			void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				return nullptr;
+
+			if (_node >= 0 && _node < (int32_t)sizeof(unsigned long) * 8) {
+				unsigned long mask = 1ul << _node;
+				syscall(SYS_mbind, p, size, NODE_ARENA_MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+			}
+			return p;
+#endif
+		}
+
+		static void Unmap(void* p, size_t size) {
+#ifdef WIN32
+			free(p);
+#else
+			munmap(p, size);
+#endif
+		}
+
+		int32_t _node;
+		FreeBlock* _free[NODE_ARENA_MAX_SHIFT - NODE_ARENA_MIN_SHIFT + 1];
+		std::vector<char*> _chunks;
+		char* _cursor = nullptr;
+		char* _end = nullptr;
+	};
+}
+
+#endif //__NODE_ARENA_H__
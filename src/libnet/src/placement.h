@@ -0,0 +1,54 @@
+#ifndef __PLACEMENT_H__
+#define __PLACEMENT_H__
+#include "libnet.h"
+#include <vector>
+#include <atomic>
+#include <arpa/inet.h>
+
+namespace libnet {
+	/**
+	* Picks the worker a new connection is placed on by the placement policy, nullptr without workers.
+	* Worker exposes the atomic load counters connectionCount, pending and bytesPerSecond.
+	*/
+	template <typename Worker>
+	Worker* PickWorker(const std::vector<Worker*>& workers, int8_t placement, std::atomic<uint32_t>& nextIdx, uint32_t remoteAddr) {
+		if (workers.empty())
+			return nullptr;
+
+		int32_t count = (int32_t)workers.size();
+		Worker* worker = nullptr;
+		switch (placement) {
+		case NET_PLACE_LEAST_CONNECTIONS:
+		case NET_PLACE_LEAST_BYTES: {
+				//scan from a rotating start so equally loaded workers still take turns
+				int32_t start = (int32_t)(nextIdx.fetch_add(1, std::memory_order_relaxed) % count);
+				int64_t bestBytes = 0;
+				int32_t bestConnections = 0;
+				for (int32_t i = 0; i < count; ++i) {
+					Worker* check = workers[(start + i) % count];
+					int64_t bytes = placement == NET_PLACE_LEAST_BYTES ? check->bytesPerSecond.load(std::memory_order_relaxed) : 0;
+					int32_t connections = check->connectionCount.load(std::memory_order_relaxed) + check->pending.load(std::memory_order_relaxed);
+					//rates are sampled once a second, close ones count as equal so a burst still spreads by connections
+					bool lighter = bytes * 4 < bestBytes * 3;
+					bool similar = !lighter && bytes * 3 <= bestBytes * 4;
+					if (!worker || lighter || (similar && connections < bestConnections)) {
+						worker = check;
+						bestBytes = bytes;
+						bestConnections = connections;
+					}
+				}
+			}
+			break;
+		case NET_PLACE_HASH_ADDRESS: {
+				uint32_t hash = ntohl(remoteAddr) * 2654435761u;
+				worker = workers[(hash >> 16) % count];
+			}
+			break;
+		default: worker = workers[nextIdx.fetch_add(1, std::memory_order_relaxed) % count]; break;
+		}
+
+		return worker;
+	}
+}
+
+#endif //__PLACEMENT_H__
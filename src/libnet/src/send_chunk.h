@@ -0,0 +1,103 @@
+#ifndef __SEND_CHUNK_H__
+#define __SEND_CHUNK_H__
+#include "libnet.h"
+#include "node_arena.h"
+#include <atomic>
+#include <new>
+
+#define SEND_CHUNK_SIZE (16 << 10) //one arena size class
+#define SEND_CHUNK_DATA (SEND_CHUNK_SIZE - 128) //the rest holds the chunk's and the arena's headers
+#define SEND_CHUNK_CACHE 256 //free chunks a worker keeps, the rest go back to the arena
+
+namespace libnet {
+	class SendChunkPool;
+
+	//a piece of a connection's send queue past its ring, queued behind the ring bytes as a payload
+	struct SendChunk : public ISendBuffer {
+		SendChunkPool* pool;
+		int32_t* queued; //the owner's chunk bytes, the owner releases every chunk before it goes away
+		int32_t size;
+		SendChunk* nextFree;
+		char data[SEND_CHUNK_DATA];
+
+		virtual const char* Data() const { return data; }
+		virtual int32_t Size() const { return size; }
+		virtual void Release();
+	};
+
+	/**
+	* Free chunks of one worker, only touched by the thread dispatching its sessions, which is where
+	* sent payloads are released. Chunks come from the worker's arena and a few are kept for reuse.
+	*/
+	class SendChunkPool {
+	public:
+		SendChunkPool() {}
+		~SendChunkPool() { Clear(); }
+
+		SendChunkPool(const SendChunkPool&) = delete;
+		SendChunkPool& operator=(const SendChunkPool&) = delete;
+
+		//the cached chunks, before the arena they came from goes away
+		void Clear() {
+			while (_free) {
+				SendChunk* chunk = _free;
+				_free = chunk->nextFree;
+				chunk->~SendChunk();
+				NodeArena::Free(chunk);
+			}
+			_freeCount = 0;
+		}
+
+		SendChunk* Get(NodeArena* arena, int32_t* queued) {
+			SendChunk* chunk = _free;
+			if (chunk) {
+				_free = chunk->nextFree;
+				--_freeCount;
+			}
+			else {
+				void* p = NodeArena::Alloc(arena, sizeof(SendChunk));
+				if (!p)
+					return nullptr;
+
+				chunk = new (p) SendChunk();
+				chunk->pool = this;
+			}
+
+			chunk->queued = queued;
+			chunk->size = 0;
+			chunk->nextFree = nullptr;
+			*queued += SEND_CHUNK_DATA;
+			_used.fetch_add(1, std::memory_order_relaxed);
+			return chunk;
+		}
+
+		void Put(SendChunk* chunk) {
+			*chunk->queued -= SEND_CHUNK_DATA;
+			_used.fetch_sub(1, std::memory_order_relaxed);
+
+			if (_freeCount >= SEND_CHUNK_CACHE) {
+				chunk->~SendChunk();
+				NodeArena::Free(chunk);
+				return;
+			}
+
+			chunk->nextFree = _free;
+			_free = chunk;
+			++_freeCount;
+		}
+
+		//held by connections, read by GetWorkerStat from any thread
+		inline int32_t GetUsed() const { return _used.load(std::memory_order_relaxed); }
+
+	private:
+		SendChunk* _free = nullptr;
+		int32_t _freeCount = 0;
+		std::atomic<int32_t> _used = { 0 };
+	};
+
+	inline void SendChunk::Release() {
+		pool->Put(this);
+	}
+}
+
+#endif //__SEND_CHUNK_H__
@@ -0,0 +1,244 @@
+#ifndef __URING_H__
+#define __URING_H__
+#include "libnet.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <atomic>
+
+namespace libnet {
+	/**
+	* Minimal io_uring submission and completion rings, driven by raw syscalls.
+	* Single issuer: every call but Fd must come from the thread that owns the ring.
+	*/
+	class Uring {
+	public:
+		Uring() {}
+		~Uring() { Close(); }
+
+		Uring(const Uring&) = delete;
+		Uring& operator=(const Uring&) = delete;
+
+		bool Init(uint32_t entries) {
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			//completions are only reaped by the owning thread, let the kernel defer its work until then
+			params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+			_fd = (int32_t)syscall(__NR_io_uring_setup, entries, &params);
+			if (_fd < 0) {
+				params.flags = 0;
+				_fd = (int32_t)syscall(__NR_io_uring_setup, entries, &params);
+			}
+
+			if (_fd < 0)
+				return false;
+
+			if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+				Close();
+				return false;
+			}
+
+			_deferTaskRun = (params.flags & IORING_SETUP_DEFER_TASKRUN) != 0;
+
+			_ringSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+			if (_ringSize < params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe))
+				_ringSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+			_ring = (char*)mmap(nullptr, _ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+			if (_ring == MAP_FAILED) {
+				_ring = nullptr;
+				Close();
+				return false;
+			}
+
+			_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+			_sqes = (io_uring_sqe*)mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+			if (_sqes == MAP_FAILED) {
+				_sqes = nullptr;
+				Close();
+				return false;
+			}
+
+			_sqHead = (uint32_t*)(_ring + params.sq_off.head);
+			_sqTail = (uint32_t*)(_ring + params.sq_off.tail);
+			_sqMask = *(uint32_t*)(_ring + params.sq_off.ring_mask);
+			_sqEntries = params.sq_entries;
+			uint32_t* array = (uint32_t*)(_ring + params.sq_off.array);
+			for (uint32_t i = 0; i < _sqEntries; ++i)
+				array[i] = i;
+
+			_cqHead = (uint32_t*)(_ring + params.cq_off.head);
+			_cqTail = (uint32_t*)(_ring + params.cq_off.tail);
+			_cqMask = *(uint32_t*)(_ring + params.cq_off.ring_mask);
+			_cqes = (io_uring_cqe*)(_ring + params.cq_off.cqes);
+
+			_localTail = *_sqTail;
+			return true;
+		}
+
+		void Close() {
+			if (_bufferRing) {
+				munmap(_bufferRing, _bufferRingSize);
+				_bufferRing = nullptr;
+			}
+
+			if (_buffers) {
+				munmap(_buffers, (size_t)_bufferCount * _bufferSize);
+				_buffers = nullptr;
+			}
+
+			if (_sqes) {
+				munmap(_sqes, _sqesSize);
+				_sqes = nullptr;
+			}
+
+			if (_ring) {
+				munmap(_ring, _ringSize);
+				_ring = nullptr;
+			}
+
+			if (_fd >= 0) {
+				close(_fd);
+				_fd = -1;
+			}
+		}
+
+		inline int32_t Fd() const { return _fd; }
+
+		//nullptr when the submission queue is full even after flushing it to the kernel
+		io_uring_sqe* GetSqe() {
+			if (_localTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries) {
+				Enter(0, 0);
+				if (_localTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+					return nullptr;
+			}
+
+			io_uring_sqe* sqe = &_sqes[_localTail & _sqMask];
+			memset(sqe, 0, sizeof(io_uring_sqe));
+			++_localTail;
+			return sqe;
+		}
+
+		//submits everything prepared so far and waits for up to waitNr completions, timeout in ms (<0 waits without limit)
+		int32_t Enter(uint32_t waitNr, int32_t timeout) {
+			uint32_t submit = _localTail - *_sqTail;
+			__atomic_store_n(_sqTail, _localTail, __ATOMIC_RELEASE);
+
+			uint32_t flags = 0;
+			if (waitNr > 0 || _deferTaskRun)
+				flags |= IORING_ENTER_GETEVENTS;
+
+			if (waitNr == 0) {
+				if (submit == 0 && !_deferTaskRun)
+					return 0;
+
+				return (int32_t)syscall(__NR_io_uring_enter, _fd, submit, 0, flags, nullptr, 0);
+			}
+
+			__kernel_timespec ts;
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000ll;
+
+			io_uring_getevents_arg arg;
+			memset(&arg, 0, sizeof(arg));
+			arg.sigmask_sz = _NSIG / 8;
+			arg.ts = timeout >= 0 ? (uint64_t)(uintptr_t)&ts : 0;
+			return (int32_t)syscall(__NR_io_uring_enter, _fd, submit, waitNr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		}
+
+		//calls f on every completion ready, returns how many there were
+		template <typename F>
+		uint32_t ForEachCqe(F&& f) {
+			uint32_t head = *_cqHead;
+			uint32_t tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+			uint32_t count = tail - head;
+			for (; head != tail; ++head)
+				f(_cqes[head & _cqMask]);
+
+			__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+			return count;
+		}
+
+		//count buffers of size bytes the kernel picks from for IOSQE_BUFFER_SELECT reads of group, count a power of two
+		bool RegisterBuffers(uint16_t group, uint32_t count, uint32_t size) {
+			_bufferRingSize = (count * sizeof(io_uring_buf) + 4095) & ~(size_t)4095;
+			void* ring = mmap(nullptr, _bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ring == MAP_FAILED)
+				return false;
+
+			void* buffers = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (buffers == MAP_FAILED) {
+				munmap(ring, _bufferRingSize);
+				return false;
+			}
+
+			io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr = (uint64_t)(uintptr_t)ring;
+			reg.ring_entries = count;
+			reg.bgid = group;
+			if (syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+				munmap(ring, _bufferRingSize);
+				munmap(buffers, (size_t)count * size);
+				return false;
+			}
+
+			_bufferRing = (io_uring_buf_ring*)ring;
+			_buffers = (char*)buffers;
+			_bufferCount = count;
+			_bufferSize = size;
+			_bufferTail = 0;
+			for (uint32_t i = 0; i < count; ++i)
+				ReturnBuffer((uint16_t)i);
+			CommitBuffers();
+			return true;
+		}
+
+		inline char* GetBuffer(uint16_t bid) const { return _buffers + (size_t)bid * _bufferSize; }
+		inline uint32_t GetBufferSize() const { return _bufferSize; }
+
+		//returned buffers are handed to the kernel on the next CommitBuffers
+		inline void ReturnBuffer(uint16_t bid) {
+			//not bufs[], the empty member the header declares it behind takes room in c++ and shifts it by 8
+			io_uring_buf* buf = (io_uring_buf*)_bufferRing + (_bufferTail & (_bufferCount - 1));
+			buf->addr = (uint64_t)(uintptr_t)GetBuffer(bid);
+			buf->len = _bufferSize;
+			buf->bid = bid;
+			++_bufferTail;
+		}
+
+		inline void CommitBuffers() {
+			__atomic_store_n(&_bufferRing->tail, _bufferTail, __ATOMIC_RELEASE);
+		}
+
+	private:
+		int32_t _fd = -1;
+		bool _deferTaskRun = false;
+
+		char* _ring = nullptr;
+		size_t _ringSize = 0;
+		io_uring_sqe* _sqes = nullptr;
+		size_t _sqesSize = 0;
+
+		uint32_t* _sqHead = nullptr;
+		uint32_t* _sqTail = nullptr;
+		uint32_t _sqMask = 0;
+		uint32_t _sqEntries = 0;
+		uint32_t _localTail = 0;
+
+		uint32_t* _cqHead = nullptr;
+		uint32_t* _cqTail = nullptr;
+		uint32_t _cqMask = 0;
+		io_uring_cqe* _cqes = nullptr;
+
+		io_uring_buf_ring* _bufferRing = nullptr;
+		size_t _bufferRingSize = 0;
+		char* _buffers = nullptr;
+		uint32_t _bufferCount = 0;
+		uint32_t _bufferSize = 0;
+		uint16_t _bufferTail = 0;
+	};
+}
+
+#endif //__URING_H__
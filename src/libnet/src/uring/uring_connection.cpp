@@ -0,0 +1,346 @@
+#include "uring_connection.h"
+#include "util.h"
+#include <algorithm>
+
+namespace libnet {
+	UringConnection::UringConnection(int32_t fd, UringEngine* engine, UringWorker* worker, int32_t sendSize, int32_t recvSize, BufferPool* buffers)
+		: _fd(fd), _engine(engine), _worker(worker), _sendSize(sendSize), _recvSize(recvSize), _sendBuffer(sendSize, buffers), _recvBuffer(engine->IsSharedRecv() ? 0 : recvSize, buffers, engine->IsMirrorRecv()), _sharedRecv(engine->IsSharedRecv()), _readyHook(this) {
+		_addCmd = NetCommand{ URING_CMD_ADD, this };
+		_sendCmd = NetCommand{ URING_CMD_SEND, this };
+		_resumeCmd = NetCommand{ URING_CMD_RESUME, this };
+		_releaseCmd = NetCommand{ URING_CMD_RELEASE, this };
+	}
+
+	UringConnection::~UringConnection() {
+		_readyHook.Unlink();
+		close(_fd);
+	}
+
+	void UringConnection::Send(const char* context, const int32_t size) {
+		if (!_closing && !_closed) {
+			//once a chunk is filling everything goes there, the ring would get ahead of it
+			if ((_chunk || !_sendBuffer.WriteBlock(context, size)) && !Spill(context, size)) {
+				Shutdown();
+				return;
+			}
+
+			if (!_sending && IsSendDue())
+				UpdateSend();
+
+			CheckReady();
+		}
+	}
+
+	void UringConnection::Send(ISendBuffer* buffer) {
+		if (_closing || _closed || buffer->Size() <= 0) {
+			buffer->Release();
+			return;
+		}
+
+		QueuePayload(NewPayload(buffer, -1, 0, buffer->Size(), _sendBuffer.Tail()));
+	}
+
+	void UringConnection::SendFile(int32_t fd, int64_t offset, int64_t size) {
+		if (_closing || _closed || size <= 0)
+			return;
+
+		int32_t file = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (file < 0) {
+			Shutdown();
+			return;
+		}
+
+		QueuePayload(NewPayload(nullptr, file, offset, size, _sendBuffer.Tail()));
+	}
+
+	bool UringConnection::Spill(const char* context, int32_t size) {
+		while (size > 0) {
+			if (!_chunk || _chunk->size == SEND_CHUNK_DATA) {
+				if (_chunk)
+					QueueChunk();
+
+				if (_chunkBytes + SEND_CHUNK_DATA > _engine->GetSendQueueLimit())
+					return false;
+
+				_chunk = _worker->chunks.Get(_worker->arena, &_chunkBytes);
+				if (!_chunk)
+					return false;
+			}
+
+			int32_t len = std::min(size, SEND_CHUNK_DATA - _chunk->size);
+			memcpy(_chunk->data + _chunk->size, context, len);
+			_chunk->size += len;
+			context += len;
+			size -= len;
+		}
+		return true;
+	}
+
+	//behind every ring byte written so far, ring bytes after it go out after the chunk
+	void UringConnection::QueueChunk() {
+		SendChunk* chunk = _chunk;
+		_chunk = nullptr;
+
+		_payloadCount.fetch_add(1, std::memory_order_release);
+		_payloads.InsertHead(NewPayload(chunk, -1, 0, chunk->size, _sendBuffer.Tail()));
+	}
+
+	void UringConnection::QueuePayload(SendPayload* payload) {
+		if (_chunk)
+			QueueChunk();
+
+		_payloadCount.fetch_add(1, std::memory_order_release);
+		_payloads.InsertHead(payload);
+
+		if (!_sending)
+			UpdateSend();
+
+		CheckReady();
+	}
+
+	void UringConnection::Close() {
+		if (_closed)
+			return;
+
+		_closing = true;
+		_flush.store(true, std::memory_order_release);
+		if (!_sending && HasQueuedSend())
+			UpdateSend();
+
+		if (!_sending)
+			Shutdown();
+	}
+
+	void UringConnection::Shutdown() {
+		//the pending recv completes with 0 and the worker reports the failure, a stopped one is resumed for it
+		if (!_closed) {
+			_closed = true;
+			shutdown(_fd, SHUT_RDWR);
+			_recvDone.store(true, std::memory_order_relaxed);
+			CheckRecv();
+		}
+	}
+
+	void UringConnection::AdjustSendBuffSize(const int32_t size) {
+		if (size > _sendSize) {
+			_adjustSend = size;
+			//queued payloads remember ring positions, the ring stays put until they are sent
+			if (!_sending && _payloadCount == 0) {
+				_sendBuffer.Realloc(_adjustSend);
+				_adjustSend = 0;
+			}
+		}
+	}
+
+	void UringConnection::AdjustRecvBuffSize(const int32_t size) {
+		if (size > _recvSize)
+			_adjustRecv = size;
+	}
+
+	void UringConnection::SetFlushPolicy(const int8_t policy) {
+		//whatever the cork held goes out under the new policy
+		if (_flushPolicy.exchange(policy, std::memory_order_relaxed) == NET_FLUSH_CORK && policy != NET_FLUSH_CORK)
+			Flush();
+	}
+
+	void UringConnection::Flush() {
+		if (_closing || _closed)
+			return;
+
+		_flush.store(true, std::memory_order_release);
+		if (!_sending) {
+			if (HasQueuedSend())
+				UpdateSend();
+			else
+				EndFlush();
+		}
+
+		CheckReady();
+	}
+
+	void UringConnection::EndFlush() {
+		if (_corked.exchange(false, std::memory_order_acq_rel))
+			PushCorked(_fd);
+
+		_flush.store(false, std::memory_order_release);
+	}
+
+	void UringConnection::UpdateSend() {
+		if (_chunk)
+			QueueChunk();
+
+		_sending = true;
+		_engine->StartSend(this);
+	}
+
+	void UringConnection::OnConnected() {
+		_session->OnConnected();
+	}
+
+	void UringConnection::OnSendDone() {
+		_sending = false;
+		if (_closed)
+			return;
+
+		if (_adjustSend > 0 && _payloadCount == 0) {
+			_sendBuffer.Realloc(_adjustSend);
+			_adjustSend = 0;
+		}
+
+		if (_closing) {
+			if (HasQueuedSend())
+				UpdateSend();
+			else
+				Shutdown();
+		}
+		else if (_flush.load(std::memory_order_relaxed) && !HasQueuedSend())
+			EndFlush();
+
+		DealHeld();
+		CheckReady();
+	}
+
+	bool UringConnection::OnRecv(NetRecvEvent* evt) {
+		if (!_closed) {
+			if (!_held.empty() || !Feed(evt)) {
+				_held.push_back(evt);
+				_recvHolding.store(true, std::memory_order_relaxed);
+				return false;
+			}
+
+			CheckReady();
+		}
+
+		GiveBack();
+		return true;
+	}
+
+	bool UringConnection::Feed(NetRecvEvent* evt) {
+		while (evt->offset < evt->size && !_closed) {
+			//sends only leave on the worker's next round, stop feeding the session while they pile up
+			if (_sending && _sendBuffer.Size() > _sendBuffer.Capacity() / 2)
+				return false;
+
+			//the previous view handed to the session is gone, the ring may move now
+			if (_adjustRecv > 0) {
+				if (!_sharedRecv || _recvBuffer.Capacity() > 0)
+					_recvBuffer.Realloc(_adjustRecv);
+				_recvSize = _adjustRecv;
+				_adjustRecv = 0;
+			}
+
+			//nothing left over, the session reads the provided buffer itself and only its remainder is kept
+			if (_sharedRecv && _recvBuffer.Capacity() == 0) {
+				int32_t size = evt->size - evt->offset;
+				const char* data = _engine->GetRecvData(evt);
+				int32_t len = _session->OnRecv(NetBuffer((char*)data, size, nullptr, 0));
+				if (len < 0) {
+					Shutdown();
+					break;
+				}
+
+				evt->offset += len;
+				if (evt->offset < evt->size && !_closed) {
+					int32_t rest = evt->size - evt->offset;
+					_recvBuffer.Realloc(std::max(_recvSize, rest));
+					if (!_recvBuffer.WriteBlock(_engine->GetRecvData(evt), rest))
+						Shutdown();
+					evt->offset = evt->size;
+				}
+				continue;
+			}
+
+			//a full ring waits for the session like the epoll backend stops reading
+			uint32_t size = std::min((uint32_t)(evt->size - evt->offset), _recvBuffer.FreeSize());
+			if (size == 0)
+				return false;
+
+			_recvBuffer.WriteBlock(_engine->GetRecvData(evt), size);
+			evt->offset += size;
+
+			auto buffer = _recvBuffer.GetReadBuffer();
+			int32_t len = _session->OnRecv(buffer);
+			if (len > 0) {
+				_recvBuffer.Out(len);
+				if (_sharedRecv && _recvBuffer.Size() == 0)
+					_recvBuffer.Release();
+			}
+			else if (len < 0)
+				Shutdown();
+		}
+
+		return true;
+	}
+
+	void UringConnection::DealHeld() {
+		while (!_held.empty()) {
+			if (!_closed && !Feed(_held.front()))
+				break;
+
+			_engine->ReleaseRecv(_held.front());
+			_held.pop_front();
+			GiveBack();
+		}
+
+		if (_held.empty())
+			_recvHolding.store(false, std::memory_order_relaxed);
+		CheckRecv();
+	}
+
+	//the caller hands the buffer back to the worker
+	void UringConnection::GiveBack() {
+		_recvReturned.store(_recvReturned.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		CheckRecv();
+	}
+
+	//resumes a recv the worker stopped once the session is back below the backlog, the worker checks again after pausing.
+	//one posted from OnFail is handled ahead of the release and ignored
+	void UringConnection::CheckRecv() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!_recvPaused.load(std::memory_order_relaxed) || IsRecvBacklogged())
+			return;
+
+		if (!_resumeQueued.exchange(true, std::memory_order_acq_rel))
+			_engine->ResumeRecv(this);
+	}
+
+	int32_t UringConnection::OutPayload(int32_t size) {
+		SendPayload* payload = _sendPayload;
+		payload->offset += size;
+		if (payload->offset == payload->size) {
+			_sendingPayloads.Fetch();
+			_payloadCount.fetch_sub(1, std::memory_order_release);
+			_engine->ReleasePayload(_worker, payload);
+		}
+
+		_sendPayload = nullptr;
+		return SendLeft();
+	}
+
+	void UringConnection::ReleasePayloads() {
+		if (_chunk) {
+			_chunk->Release();
+			_chunk = nullptr;
+		}
+
+		while (!_sendingPayloads.Empty())
+			FreePayload(_sendingPayloads.Fetch());
+
+		_payloads.Sweep(FreePayload);
+		_payloadCount = 0;
+	}
+
+	void UringConnection::OnFail() {
+		_closed = true;
+		DealHeld();
+		ReleasePayloads();
+
+		_session->OnDisconnect();
+		_session->SetPipe(nullptr);
+
+		_session->Release();
+		_engine->Remove(this);
+		_readyHook.Unlink();
+		_engine->ReleaseConnection(this);
+	}
+}
@@ -0,0 +1,236 @@
+#ifndef __URING_CONNECTION_H__
+#define __URING_CONNECTION_H__
+#include "libnet.h"
+#include "uring_engine.h"
+#include "RingBuffer.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+
+namespace libnet {
+	/**
+	* The session side (recv ring, Send, Close) belongs to the thread dispatching the worker's sessions,
+	* the io side (operations in flight, failure) to the worker. Both are the worker when sessions run there.
+	*/
+	class UringConnection : public IPipe {
+		friend class UringEngine;
+	public:
+		UringConnection(int32_t fd, UringEngine* engine, UringWorker* worker, int32_t sendSize, int32_t recvSize, BufferPool* buffers);
+		virtual ~UringConnection();
+
+		//connections live in the owning worker's arena when the engine is numa local
+		static void* operator new(size_t size, NodeArena* arena) {
+			void* p = NodeArena::Alloc(arena, size);
+			if (!p)
+				throw std::bad_alloc();
+			return p;
+		}
+
+		static void operator delete(void* p) { NodeArena::Free(p); }
+		static void operator delete(void* p, NodeArena*) { NodeArena::Free(p); }
+
+		inline void Attach(ITcpSession* session) {
+			_session = session;
+			session->SetPipe(this);
+		}
+
+		virtual void Send(const char* context, const int32_t size);
+		virtual void Send(ISendBuffer* buffer);
+		virtual void SendFile(int32_t fd, int64_t offset, int64_t size);
+		virtual void Close();
+		virtual void Shutdown();
+
+		virtual void AdjustSendBuffSize(const int32_t size);
+		virtual void AdjustRecvBuffSize(const int32_t size);
+
+		virtual void SetFlushPolicy(const int8_t policy);
+		virtual void Flush();
+
+		inline int32_t GetSocket() const { return _fd; }
+		inline UringWorker* GetWorker() const { return _worker; }
+		inline IntrusiveListHook<UringConnection>& GetReadyHook() { return _readyHook; }
+
+		//a payload counts as one until it is fully sent
+		inline int32_t SendLeft() const { return (int32_t)_sendBuffer.Size() + _payloadCount.load(std::memory_order_acquire); }
+		inline int32_t Out(int32_t size) {
+			if (_sendPayload)
+				return OutPayload(size);
+
+			_sendBuffer.Out(size);
+			return SendLeft();
+		}
+
+		//the ring is read before fetching, a payload queued ahead of the bytes seen is fetched with them
+		inline SendPayload* FrontPayload() {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (_sendingPayloads.Empty())
+				_sendingPayloads = _payloads.Fetch();
+			return _sendingPayloads.Front();
+		}
+
+		//the queued part of the send ring up to the first payload, or that payload, the msghdr stays put while the send is in flight
+		inline msghdr* PrepareSend() {
+			RingSpan spans[2];
+			int32_t count = _sendBuffer.Read(spans);
+
+			//bytes written and a payload queued behind them after the read, the bytes are published before the payload
+			SendPayload* payload = FrontPayload();
+			if (payload && _sendBuffer.Ahead(payload->tail) > (count > 1 ? spans[0].size + spans[1].size : (count > 0 ? spans[0].size : 0)))
+				count = _sendBuffer.Read(spans);
+
+			//never past the bytes read
+			if (payload && count > 0) {
+				uint32_t ahead = std::min(_sendBuffer.Ahead(payload->tail), count > 1 ? spans[0].size + spans[1].size : spans[0].size);
+				if (ahead <= spans[0].size) {
+					spans[0].size = ahead;
+					count = ahead > 0 ? 1 : 0;
+				}
+				else
+					spans[1].size = ahead - spans[0].size;
+			}
+
+			//a file goes out with sendfile once the socket is writable, the msghdr is not used
+			_sendPayload = count == 0 ? payload : nullptr;
+			if (_sendPayload && !payload->buffer)
+				return nullptr;
+
+			if (_sendPayload) {
+				spans[0].data = (char*)payload->buffer->Data() + payload->offset;
+				spans[0].size = payload->buffer->Size() - payload->offset;
+				count = 1;
+			}
+
+			for (int32_t i = 0; i < count; ++i) {
+				_sendIov[i].iov_base = spans[i].data;
+				_sendIov[i].iov_len = spans[i].size;
+			}
+
+			memset(&_sendMsg, 0, sizeof(_sendMsg));
+			_sendMsg.msg_iov = _sendIov;
+			_sendMsg.msg_iovlen = count;
+			return &_sendMsg;
+		}
+
+		inline bool IsClosed() const { return _closed; }
+		inline bool HasQueuedSend() const { return _sendBuffer.Size() > 0 || _payloadCount.load(std::memory_order_acquire) > 0 || _chunk; }
+		inline bool HasPendingSend() const { return !_closed && HasQueuedSend(); }
+		inline bool NeedUpdateSend() const { return !_closing && !_closed && !_sending && HasQueuedSend() && !IsHeld(); }
+
+		//a corked ring waits for Flush until it holds a batch worth writing, payloads are never held
+		inline bool IsHeld() const {
+			return _flushPolicy.load(std::memory_order_relaxed) == NET_FLUSH_CORK && !_flush.load(std::memory_order_acquire)
+				&& _payloadCount.load(std::memory_order_acquire) == 0 && _sendBuffer.Size() < std::min<uint32_t>(CORK_SEND_SIZE, _sendBuffer.Capacity() / 2);
+		}
+
+		//whether Send starts a send right away instead of leaving it to the round
+		inline bool IsSendDue() const {
+			switch (_flushPolicy.load(std::memory_order_relaxed)) {
+			case NET_FLUSH_WRITE_THROUGH: return true;
+			case NET_FLUSH_CORK: return !IsHeld();
+			default: return _sendBuffer.Size() > MIN_SEND_BUFF_SIZE;
+			}
+		}
+
+		//io side, the next send carries MSG_MORE
+		inline bool IsCorked() const { return _flushPolicy.load(std::memory_order_relaxed) == NET_FLUSH_CORK && !_flush.load(std::memory_order_acquire); }
+		inline void SetCorked(bool corked) { _corked.store(corked, std::memory_order_release); }
+
+		//queues the connection for the next round when it has a send to start
+		inline void CheckReady() {
+			if (!_readyHook.IsLinked() && NeedUpdateSend())
+				_engine->AddReady(this);
+		}
+
+		//the session can't keep up with the recv, the worker stops it until buffers are given back. never once the session closed,
+		//the recv has to run for the worker to see the connection go
+		inline bool IsRecvBacklogged() const {
+			return !_recvDone.load(std::memory_order_relaxed) && (_recvHolding.load(std::memory_order_relaxed)
+				|| _recvDelivered.load(std::memory_order_relaxed) - _recvReturned.load(std::memory_order_relaxed) >= URING_RECV_HELD);
+		}
+
+		inline void SetRemoteIp(const char * ip) const { SafeSprintf((char*)_remoteIp, sizeof(_remoteIp), "%s", ip); }
+		inline void SetRemotePort(int32_t port) { _remotePort = port; }
+
+		void UpdateSend();
+		void OnConnected();
+		void OnSendDone();
+		//false when the session can't take all of it yet, the connection holds the buffer until it can
+		bool OnRecv(NetRecvEvent* evt);
+		void OnFail();
+
+		bool Feed(NetRecvEvent* evt);
+		void DealHeld();
+		void GiveBack();
+		void CheckRecv();
+
+		inline bool IsSendingFile() const { return _sendPayload && !_sendPayload->buffer; }
+
+	private:
+		void QueuePayload(SendPayload* payload);
+		int32_t OutPayload(int32_t size);
+		void ReleasePayloads();
+		void EndFlush();
+		bool Spill(const char* context, int32_t size);
+		void QueueChunk();
+
+	private:
+		int32_t _fd;
+		UringEngine* _engine;
+		UringWorker* _worker;
+		ITcpSession * _session = nullptr;
+		int32_t _sendSize;
+		int32_t _recvSize;
+
+		RingBuffer _sendBuffer;
+		RingBuffer _recvBuffer;
+		bool _sharedRecv; //the recv ring only holds what the session left unread
+
+		int32_t _adjustSend = 0;
+		int32_t _adjustRecv = 0;
+
+		//session side
+		bool _closing = false;
+		bool _closed = false;
+		bool _sending = false;
+		std::atomic<int8_t> _flushPolicy = { NET_FLUSH_ROUND };
+		std::atomic<bool> _flush = { false }; //set by Flush until everything queued before it is sent
+		std::atomic<bool> _corked = { false }; //the last send carried MSG_MORE, the kernel may still hold part of it
+		std::deque<NetRecvEvent*> _held; //received ahead of the session, keeps the worker buffers out of the kernel's reach
+		std::atomic<bool> _recvHolding = { false }; //_held is not empty
+		std::atomic<bool> _recvDone = { false }; //set by Shutdown, nothing received holds the recv back anymore
+		std::atomic<uint32_t> _recvReturned = { 0 }; //recv buffers the session is done with
+		std::atomic<bool> _resumeQueued = { false }; //_resumeCmd is on its way to the worker
+
+		//queued by the session side, sent in order by the worker
+		AtomicIntrusiveLinkedList<SendPayload, &SendPayload::next> _payloads;
+		AtomicIntrusiveLinkedFetchedList<SendPayload, &SendPayload::next> _sendingPayloads;
+		std::atomic<int32_t> _payloadCount = { 0 }; //queued and not fully sent
+		SendPayload* _sendPayload = nullptr; //what the send in flight carries, the ring when null
+
+		//session side, the send queue past a full ring
+		SendChunk* _chunk = nullptr; //still filling, queued once full or sent
+		int32_t _chunkBytes = 0; //held in chunks, up to the engine's sendQueueLimit
+
+		//io side
+		std::atomic<uint32_t> _recvDelivered = { 0 }; //recv buffers handed to the session
+		std::atomic<bool> _recvPaused = { false }; //the recv stays down until the session is back below the backlog
+		bool _recvCancelling = false; //the multishot recv is being cancelled for a pause
+		bool _recvArmed = false;
+		bool _sendInflight = false;
+		bool _starved = false; //recv waits for buffers to come back
+		bool _failed = false;
+		bool _failReported = false;
+		bool _nonBlocking = false; //set for the first file sent, sendfile must not wait on the worker
+
+		iovec _sendIov[2];
+		msghdr _sendMsg;
+
+		NetCommand _addCmd;
+		NetCommand _sendCmd;
+		NetCommand _resumeCmd;
+		NetCommand _releaseCmd;
+		IntrusiveListHook<UringConnection> _readyHook;
+	};
+}
+
+#endif //__URING_CONNECTION_H__
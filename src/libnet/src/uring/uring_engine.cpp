@@ -0,0 +1,1192 @@
+#include "uring_engine.h"
+#include "uring_connection.h"
+#include "util.h"
+#include <future>
+#include <algorithm>
+#include <poll.h>
+
+#define LOAD_SAMPLE_INTERVAL 1000
+#define QUIESCE_TIMEOUT 1000
+
+namespace libnet {
+	UringEngine::UringEngine(const NetEngineConfig& config) : _config(config) {
+	}
+
+	UringEngine::~UringEngine() {
+		//stop accepting first so the drain only waits on existing connections
+		for (auto& itr : _servers) {
+			for (auto* acceptor : itr.second)
+				PostToWorker(acceptor->worker, NET_CMD_STOP, acceptor);
+		}
+		_servers.clear();
+
+		Drain();
+
+		_terminate = true;
+		for (auto* worker : _workers)
+			Wakeup(worker);
+
+		for (auto* worker : _workers) {
+			if (worker->thread.joinable())
+				worker->thread.join();
+		}
+
+		//every worker has exited with nothing left in flight, whatever is still queued belongs to this thread now
+		for (auto* worker : _workers) {
+			worker->commands.Sweep([this](NetCommand* cmd) {
+				bool embedded = cmd->cmdType >= URING_CMD_ADD;
+				DropCommand(cmd);
+				if (!embedded)
+					delete cmd;
+			});
+		}
+
+		while (!_pendingEvents.Empty()) {
+			NetEvent* evt = _pendingEvents.Fetch();
+			DropEvent(evt);
+			RecycleEvent(evt);
+		}
+
+		_eventQueue.Sweep([this](NetEvent* evt) {
+			DropEvent(evt);
+			RecycleEvent(evt);
+		});
+
+		for (auto* worker : _workers) {
+			for (auto* acceptor : worker->acceptors) {
+				if (acceptor->sock >= 0)
+					close(acceptor->sock);
+				delete acceptor;
+			}
+			worker->acceptors.clear();
+
+			for (auto* connector : worker->connectors) {
+				close(connector->sock);
+				OnConnectFail((ITcpSession*)connector->context);
+				delete connector;
+			}
+			worker->connectors.clear();
+
+			//OnFail removes from the set, iterate a copy
+			std::unordered_set<UringConnection*> connections;
+			connections.swap(worker->connections);
+			for (auto* conn : connections)
+				conn->OnFail();
+
+			//including what the connections held
+			worker->returned.Sweep([worker](NetEvent* evt) {
+				worker->recvEvents.Recycle(static_cast<NetRecvEvent*>(evt));
+			});
+		}
+
+		//connections live in the arenas, free those last
+		for (auto* worker : _workers) {
+			worker->chunks.Clear();
+			worker->buffers.Clear();
+			worker->ring.Close();
+			close(worker->wakeupFd);
+
+			delete worker->arena;
+			delete worker;
+		}
+		_workers.clear();
+	}
+
+	bool UringEngine::Start() {
+		for (int32_t i = 0; i < _config.threadCount; ++i) {
+			UringWorker* worker = new UringWorker;
+			worker->wakeupFd = eventfd(0, EFD_CLOEXEC);
+			if (worker->wakeupFd < 0) {
+				delete worker;
+				return false;
+			}
+
+			worker->index = (int16_t)_workers.size();
+			if (!_config.workerCpus.empty()) {
+				worker->cpu = _config.workerCpus[i % _config.workerCpus.size()];
+				if (_config.numaLocal && IsRunToCompletion()) {
+					worker->arena = new NodeArena(NodeOfCpu(worker->cpu));
+					worker->buffers.SetArena(worker->arena);
+				}
+			}
+
+			//a single issuer ring belongs to the thread creating it
+			std::promise<bool> started;
+			std::future<bool> ready = started.get_future();
+			worker->thread = std::thread([this, worker, &started]() {
+				bool ok = worker->ring.Init(URING_ENTRIES) && worker->ring.RegisterBuffers(URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE) && ArmWakeup(worker);
+				started.set_value(ok);
+				if (ok)
+					ThreadProc(worker);
+			});
+
+			if (!ready.get()) {
+				worker->thread.join();
+				worker->ring.Close();
+				close(worker->wakeupFd);
+
+				delete worker->arena;
+				delete worker;
+				return false;
+			}
+
+			_workers.emplace_back(worker);
+		}
+
+		return true;
+	}
+
+	int32_t UringEngine::OpenListenSocket(const char* ip, const int32_t port, const ListenOptions& options) {
+		if (IsUnixAddress(ip))
+			return OpenUnixListenSocket(ip, SOCK_CLOEXEC, options.backlog);
+
+		int32_t sock = -1;
+		if (-1 == (sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP))) {
+			return -1;
+		}
+
+		int32_t flag = 1;
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&flag, sizeof(flag)) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		if (options.reusePort && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&flag, sizeof(flag)) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if ((addr.sin_addr.s_addr = inet_addr(ip)) == INADDR_NONE) {
+			close(sock);
+			return -1;
+		}
+
+		if (-1 == bind(sock, (sockaddr*)&addr, sizeof(sockaddr_in))) {
+			close(sock);
+			return -1;
+		}
+
+		//accepted sockets inherit it, no setsockopt per connection
+		if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag)) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		if (options.deferAccept > 0 && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, (const char*)&options.deferAccept, sizeof(options.deferAccept)) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		if (options.sendBuffer > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char*)&options.sendBuffer, sizeof(options.sendBuffer)) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		SetBusyPoll(sock, _config.busyPoll);
+
+		if (listen(sock, options.backlog) == -1) {
+			close(sock);
+			return -1;
+		}
+
+		return sock;
+	}
+
+	bool UringEngine::Listen(ITcpServer* server, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options) {
+		std::vector<UringSocket*> acceptors;
+		//a unix path binds once
+		bool reusePort = options.reusePort && !IsUnixAddress(ip);
+		int32_t count = reusePort ? (int32_t)_workers.size() : 1;
+		for (int32_t i = 0; i < count; ++i) {
+			int32_t sock = OpenListenSocket(ip, port, options);
+			if (sock < 0)
+				break;
+
+			UringSocket* acceptor = new UringSocket;
+			memset(acceptor, 0, sizeof(UringSocket));
+			acceptor->worker = reusePort ? _workers[i] : NextWorker();
+			acceptor->sock = sock;
+			acceptor->context = server;
+			acceptor->sendSize = sendSize;
+			acceptor->recvSize = recvSize;
+			acceptor->reusePort = reusePort;
+
+			//the worker arms the accept on its own ring
+			PostToWorker(acceptor->worker, URING_CMD_LISTEN, acceptor);
+			acceptors.push_back(acceptor);
+		}
+
+		if ((int32_t)acceptors.size() < count) {
+			for (auto* acceptor : acceptors)
+				PostToWorker(acceptor->worker, NET_CMD_STOP, acceptor);
+
+			return false;
+		}
+
+		_servers[server] = std::move(acceptors);
+		return true;
+	}
+
+	void UringEngine::Stop(ITcpServer* server) {
+		auto itr = _servers.find(server);
+		if (itr != _servers.end()) {
+			for (auto* acceptor : itr->second)
+				PostToWorker(acceptor->worker, NET_CMD_STOP, acceptor);
+
+			_servers.erase(itr);
+		}
+	}
+
+	bool UringEngine::Connect(ITcpSession* session, const char * ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast) {
+		sockaddr_storage remote;
+		socklen_t remoteLen = 0;
+		uint32_t remoteAddr = 0;
+		memset(&remote, 0, sizeof(remote));
+
+		bool local = IsUnixAddress(ip);
+		if (local) {
+			if ((remoteLen = MakeUnixAddress(ip, (sockaddr_un&)remote)) == 0)
+				return false;
+		}
+		else {
+			sockaddr_in& addr = (sockaddr_in&)remote;
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(port);
+			if ((addr.sin_addr.s_addr = inet_addr(ip)) == INADDR_NONE)
+				return false;
+
+			remoteLen = sizeof(addr);
+			remoteAddr = addr.sin_addr.s_addr;
+		}
+
+		int32_t sock = -1;
+		if (-1 == (sock = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, local ? 0 : IPPROTO_TCP))) {
+			return false;
+		}
+
+		//no address to hash, the socket spreads them
+		if (local)
+			remoteAddr = (uint32_t)sock;
+		else
+			SetBusyPoll(sock, _config.busyPoll);
+
+		UringSocket* connector = new UringSocket;
+		memset(connector, 0, sizeof(UringSocket));
+		connector->sock = sock;
+		connector->context = session;
+		connector->sendSize = sendSize;
+		connector->recvSize = recvSize;
+		connector->remote = remote;
+		connector->remoteLen = remoteLen;
+		SafeSprintf(connector->remoteIp, sizeof(connector->remoteIp), "%s", ip);
+		connector->remotePort = local ? 0 : port;
+
+		connector->worker = PlaceWorker(remoteAddr);
+		if (!connector->worker) {
+			close(sock);
+			delete connector;
+
+			return false;
+		}
+
+		PostToWorker(connector->worker, NET_CMD_CONNECT, connector);
+		return true;
+	}
+
+	PollResult UringEngine::Poll(int64_t frame, int32_t maxEvents) {
+		PollResult result;
+
+		if (!_pollPinned) {
+			_pollPinned = true;
+			if (_config.pollCpu >= 0)
+				PinThread(_config.pollCpu);
+		}
+
+		//workers flush their own connections when they run the sessions
+		if (IsRunToCompletion())
+			return result;
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(frame);
+		if (_pendingEvents.Empty())
+			_pendingEvents = _eventQueue.Fetch();
+
+		//sends queued since the last Poll leave before the wait for what they answer
+		if (_pendingEvents.Empty() && _config.pollSpin > 0) {
+			for (auto* worker : _workers)
+				DealReady(worker);
+
+			auto spinEnd = std::chrono::steady_clock::now() + std::chrono::microseconds(_config.pollSpin);
+			while (_eventQueue.Empty() && std::chrono::steady_clock::now() < spinEnd)
+				CpuRelax();
+
+			_pendingEvents = _eventQueue.Fetch();
+		}
+
+		while (!_pendingEvents.Empty()) {
+			if (result.processed > 0) {
+				if (maxEvents > 0 && result.processed >= maxEvents)
+					break;
+
+				if (frame > 0 && std::chrono::steady_clock::now() >= deadline)
+					break;
+			}
+
+			NetEvent* evt = _pendingEvents.Fetch();
+			if (DealEvent(evt))
+				RecycleEvent(evt);
+
+			++result.processed;
+		}
+
+		//sends started here reach each worker as one batch
+		for (auto* worker : _workers)
+			DealReady(worker);
+
+		result.remain = !_pendingEvents.Empty() || !_eventQueue.Empty();
+		return result;
+	}
+
+	//false when the connection holds on to a recv event, it releases it later
+	bool UringEngine::DealEvent(NetEvent* evt) {
+		switch (evt->evtType) {
+		case NET_ACCEPT: {
+				NetSocketEvent* accept = static_cast<NetSocketEvent*>(evt);
+				OnAccept((ITcpServer*)accept->context, accept->sock, accept->sendSize, accept->recvSize, accept->remoteIp, accept->remotePort, _workers[accept->target]);
+			}
+			break;
+		case NET_CONNECT_SUCCESS: {
+				NetSocketEvent* connect = static_cast<NetSocketEvent*>(evt);
+				OnConnect((ITcpSession*)connect->context, connect->sock, connect->sendSize, connect->recvSize, connect->remoteIp, connect->remotePort, _workers[connect->target]);
+			}
+			break;
+		case NET_CONNECT_FAIL: OnConnectFail((ITcpSession*)evt->context); break;
+		case NET_SEND_DONE: ((UringConnection*)evt->context)->OnSendDone(); break;
+		case NET_FAIL: ((UringConnection*)evt->context)->OnFail(); break;
+		case NET_RECV: return ((UringConnection*)evt->context)->OnRecv(static_cast<NetRecvEvent*>(evt));
+		case NET_SEND_RELEASE: FreePayload((SendPayload*)evt->context); break;
+		}
+		return true;
+	}
+
+	void UringEngine::Release() {
+		delete this;
+	}
+
+	bool UringEngine::GetWorkerStat(int32_t index, NetWorkerStat& stat) const {
+		if (index < 0 || index >= (int32_t)_workers.size())
+			return false;
+
+		UringWorker* worker = _workers[index];
+		stat.connections = worker->connectionCount.load(std::memory_order_relaxed);
+		stat.recvBytes = worker->recvBytes.load(std::memory_order_relaxed);
+		stat.sendBytes = worker->sendBytes.load(std::memory_order_relaxed);
+		stat.bytesPerSecond = worker->bytesPerSecond.load(std::memory_order_relaxed);
+		stat.recvCalls = worker->enterCalls.load(std::memory_order_relaxed);
+		stat.sendCalls = 0;
+		stat.acceptCalls = worker->acceptCalls.load(std::memory_order_relaxed);
+		stat.sendChunks = worker->chunks.GetUsed();
+		stat.ringHits = worker->buffers.GetHits();
+		stat.ringMisses = worker->buffers.GetMisses();
+		stat.ringCached = worker->buffers.GetCached();
+		return true;
+	}
+
+	UringWorker* UringEngine::PlaceWorker(uint32_t remoteAddr) {
+		UringWorker* worker = PickWorker(_workers, _config.placement, _nextIdx, remoteAddr);
+		if (worker)
+			worker->pending.fetch_add(1, std::memory_order_relaxed);
+		return worker;
+	}
+
+	void UringEngine::ThreadProc(UringWorker* worker) {
+		BlockSigPipe();
+		if (worker->cpu >= 0)
+			PinThread(worker->cpu);
+
+		uint32_t waitNr = _config.waitMode == NET_WAIT_BLOCK ? 1 : 0;
+		while (!_terminate) {
+			//submits whatever the last round prepared and reaps in the same call
+			worker->ring.Enter(waitNr, _config.waitTimeout);
+			worker->enterCalls.fetch_add(1, std::memory_order_relaxed);
+			SampleLoad(worker);
+
+			bool wakeup = false;
+			uint32_t count = worker->ring.ForEachCqe([this, worker, &wakeup](const io_uring_cqe& cqe) {
+				DealCompletion(worker, cqe, wakeup);
+			});
+
+			if (wakeup)
+				DealCommands(worker);
+
+			DealReturned(worker);
+
+			if (IsRunToCompletion()) {
+				DealReady(worker);
+
+				if (_draining)
+					worker->drained = !HasPendingSend(worker);
+			}
+
+			//a spinning worker only enters the kernel when it has something to submit
+			if (count == 0 && _config.waitMode == NET_WAIT_SLEEP)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			else if (count == 0 && _config.waitMode == NET_WAIT_SPIN)
+				CpuRelax();
+		}
+
+		Quiesce(worker);
+	}
+
+	void UringEngine::SampleLoad(UringWorker* worker) {
+		int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		if (now - worker->sampleTime < LOAD_SAMPLE_INTERVAL)
+			return;
+
+		//a blocked worker still wakes every waitTimeout, so the rate of an idle worker decays
+		int64_t bytes = worker->recvBytes.load(std::memory_order_relaxed) + worker->sendBytes.load(std::memory_order_relaxed);
+		if (worker->sampleTime > 0)
+			worker->bytesPerSecond.store((bytes - worker->sampleBytes) * 1000 / (now - worker->sampleTime), std::memory_order_relaxed);
+
+		worker->sampleBytes = bytes;
+		worker->sampleTime = now;
+	}
+
+	//cancels everything in flight and waits until the kernel is done with the buffers and connections
+	void UringEngine::Quiesce(UringWorker* worker) {
+		io_uring_sqe* sqe = GetSqe(worker, nullptr, URING_OP_NONE);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		}
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(QUIESCE_TIMEOUT);
+		while (worker->inflight > 0 && std::chrono::steady_clock::now() < deadline) {
+			worker->ring.Enter(1, 10);
+			worker->ring.ForEachCqe([worker](const io_uring_cqe& cqe) {
+				if (!(cqe.flags & IORING_CQE_F_MORE))
+					--worker->inflight;
+			});
+		}
+	}
+
+	void UringEngine::Drain() {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_config.drainTimeout);
+		if (IsRunToCompletion()) {
+			//workers own their connections, they report once nothing is left to send
+			_draining = true;
+			for (auto* worker : _workers)
+				Wakeup(worker);
+
+			while (std::chrono::steady_clock::now() < deadline) {
+				bool drained = true;
+				for (auto* worker : _workers)
+					drained = drained && worker->drained;
+
+				if (drained)
+					break;
+
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		else {
+			while (std::chrono::steady_clock::now() < deadline) {
+				Poll(0, 0);
+
+				bool drained = true;
+				for (auto* worker : _workers)
+					drained = drained && !HasPendingSend(worker);
+
+				if (drained)
+					break;
+
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+		}
+	}
+
+	bool UringEngine::HasPendingSend(UringWorker* worker) {
+		for (auto* conn : worker->connections) {
+			if (conn->HasPendingSend())
+				return true;
+		}
+		return false;
+	}
+
+	void UringEngine::DropCommand(NetCommand* cmd) {
+		switch (cmd->cmdType) {
+		case NET_CMD_STOP: {
+				//a listen still queued ahead of it was dropped with the acceptor unarmed
+				UringSocket* acceptor = (UringSocket*)cmd->context;
+				if (acceptor->worker->acceptors.erase(acceptor) > 0 || !acceptor->armed) {
+					if (acceptor->sock >= 0)
+						close(acceptor->sock);
+
+					delete acceptor;
+				}
+			}
+			break;
+		case NET_CMD_ACCEPT: {
+				NetSocketEvent* evt = (NetSocketEvent*)cmd->context;
+				close(evt->sock);
+				RecycleEvent(evt);
+			}
+			break;
+		case NET_CMD_CONNECT: {
+				UringSocket* connector = (UringSocket*)cmd->context;
+				close(connector->sock);
+				OnConnectFail((ITcpSession*)connector->context);
+				delete connector;
+			}
+			break;
+		case URING_CMD_RELEASE: delete (UringConnection*)cmd->context; break;
+		}
+	}
+
+	//connection events are dropped as is, the connections themselves are released afterwards
+	void UringEngine::DropEvent(NetEvent* evt) {
+		switch (evt->evtType) {
+		case NET_ACCEPT: close(static_cast<NetSocketEvent*>(evt)->sock); break;
+		case NET_CONNECT_SUCCESS: {
+				close(static_cast<NetSocketEvent*>(evt)->sock);
+				OnConnectFail((ITcpSession*)evt->context);
+			}
+			break;
+		case NET_CONNECT_FAIL: OnConnectFail((ITcpSession*)evt->context); break;
+		case NET_SEND_RELEASE: DealEvent(evt); break;
+		}
+	}
+
+	void UringEngine::DealCompletion(UringWorker* worker, const io_uring_cqe& cqe, bool& wakeup) {
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			--worker->inflight;
+
+		void* owner = (void*)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
+		switch (cqe.user_data & URING_OP_MASK) {
+		case URING_OP_ACCEPT: DealAccept((UringSocket*)owner, cqe.res, cqe.flags); break;
+		case URING_OP_CONNECT: DealConnect((UringSocket*)owner, cqe.res); break;
+		case URING_OP_RECV: DealRecv((UringConnection*)owner, cqe.res, cqe.flags); break;
+		case URING_OP_SEND: DealSend((UringConnection*)owner, cqe.res); break;
+		case URING_OP_WAKEUP: wakeup = true; break;
+		}
+	}
+
+	void UringEngine::DealCommands(UringWorker* worker) {
+		if (!ArmWakeup(worker))
+			Wakeup(worker);
+
+		worker->commands.SweepOnce([this, worker](NetCommand* cmd) {
+			//a release frees the connection carrying the command
+			bool embedded = cmd->cmdType >= URING_CMD_ADD;
+			DealCommand(worker, cmd);
+			if (!embedded)
+				delete cmd;
+		});
+	}
+
+	void UringEngine::DealCommand(UringWorker* worker, NetCommand* cmd) {
+		switch (cmd->cmdType) {
+		case URING_CMD_LISTEN: {
+				UringSocket* acceptor = (UringSocket*)cmd->context;
+				worker->acceptors.insert(acceptor);
+				if (!ArmAccept(acceptor)) {
+					close(acceptor->sock);
+					acceptor->sock = -1;
+				}
+			}
+			break;
+		case NET_CMD_STOP: {
+				UringSocket* acceptor = (UringSocket*)cmd->context;
+				acceptor->stopped = true;
+				if (acceptor->armed) {
+					//the accept completes as cancelled and frees the acceptor
+					io_uring_sqe* sqe = GetSqe(worker, nullptr, URING_OP_NONE);
+					if (sqe) {
+						sqe->opcode = IORING_OP_ASYNC_CANCEL;
+						sqe->addr = (uint64_t)(uintptr_t)acceptor | URING_OP_ACCEPT;
+					}
+					else
+						shutdown(acceptor->sock, SHUT_RDWR);
+				}
+				else {
+					worker->acceptors.erase(acceptor);
+					if (acceptor->sock >= 0)
+						close(acceptor->sock);
+
+					delete acceptor;
+				}
+			}
+			break;
+		case NET_CMD_ACCEPT: {
+				NetSocketEvent* evt = (NetSocketEvent*)cmd->context;
+				OnAccept((ITcpServer*)evt->context, evt->sock, evt->sendSize, evt->recvSize, evt->remoteIp, evt->remotePort, worker);
+				RecycleEvent(evt);
+			}
+			break;
+		case NET_CMD_CONNECT: {
+				UringSocket* connector = (UringSocket*)cmd->context;
+				if (!ArmConnect(connector)) {
+					close(connector->sock);
+					worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+					if (IsRunToCompletion())
+						OnConnectFail((ITcpSession*)connector->context);
+					else
+						PushConnectFail(worker, (ITcpSession*)connector->context);
+
+					delete connector;
+				}
+				else
+					worker->connectors.insert(connector);
+			}
+			break;
+		case URING_CMD_ADD: {
+				UringConnection* connection = (UringConnection*)cmd->context;
+				if (!ArmRecv(connection))
+					DealFail(connection);
+			}
+			break;
+		case URING_CMD_SEND: {
+				UringConnection* connection = (UringConnection*)cmd->context;
+				if (!connection->_failed && !SubmitSend(connection))
+					DealFail(connection);
+			}
+			break;
+		case URING_CMD_RESUME: DealResume((UringConnection*)cmd->context); break;
+		case URING_CMD_RELEASE: delete (UringConnection*)cmd->context; break;
+		}
+	}
+
+	void UringEngine::DealAccept(UringSocket* acceptor, int32_t res, uint32_t flags) {
+		if (!(flags & IORING_CQE_F_MORE))
+			acceptor->armed = false;
+
+		if (res >= 0 && acceptor->stopped)
+			close(res);
+		else if (res >= 0) {
+			int32_t sock = res;
+
+			//multishot accept shares one address buffer between all the connections of a round, ask once here.
+			//TCP_NODELAY is inherited from the listener
+			sockaddr_storage addr;
+			memset(&addr, 0, sizeof(addr));
+			socklen_t len = sizeof(addr);
+			getpeername(sock, (sockaddr*)&addr, &len);
+			acceptor->worker->acceptCalls.fetch_add(1, std::memory_order_relaxed);
+
+			//a unix peer is rarely bound to a name, it is reported by its family and spread by its socket
+			char remoteIp[LIBNET_IP_SIZE];
+			int32_t remotePort = 0;
+			uint32_t remoteAddr = (uint32_t)sock;
+			if (addr.ss_family == AF_INET) {
+				const sockaddr_in& peer = (const sockaddr_in&)addr;
+				inet_ntop(AF_INET, &peer.sin_addr, remoteIp, sizeof(remoteIp));
+				remotePort = ntohs(peer.sin_port);
+				remoteAddr = peer.sin_addr.s_addr;
+			}
+			else
+				SafeSprintf(remoteIp, sizeof(remoteIp), "%s", LIBNET_UNIX_PREFIX);
+
+			//a reuseport acceptor keeps its connections, the kernel already spread them
+			UringWorker* worker = nullptr;
+			if (acceptor->reusePort) {
+				worker = acceptor->worker;
+				worker->pending.fetch_add(1, std::memory_order_relaxed);
+			}
+			else
+				worker = PlaceWorker(remoteAddr);
+
+			if (IsRunToCompletion()) {
+				if (worker == acceptor->worker)
+					OnAccept((ITcpServer*)acceptor->context, sock, acceptor->sendSize, acceptor->recvSize, remoteIp, remotePort, worker);
+				else
+					PostToWorker(worker, NET_CMD_ACCEPT, AllocAccept(acceptor->worker, sock, (ITcpServer*)acceptor->context, acceptor->sendSize, acceptor->recvSize, remoteIp, remotePort, worker));
+			}
+			else
+				PushAccept(acceptor->worker, sock, (ITcpServer*)acceptor->context, acceptor->sendSize, acceptor->recvSize, remoteIp, remotePort, worker);
+		}
+		else if (!acceptor->armed && !acceptor->stopped && res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+			//acceptor is still owned by _servers and freed by Stop
+			close(acceptor->sock);
+			acceptor->sock = -1;
+		}
+
+		if (!acceptor->armed) {
+			if (acceptor->stopped) {
+				acceptor->worker->acceptors.erase(acceptor);
+				if (acceptor->sock >= 0)
+					close(acceptor->sock);
+
+				delete acceptor;
+			}
+			else if (acceptor->sock >= 0 && !ArmAccept(acceptor)) {
+				close(acceptor->sock);
+				acceptor->sock = -1;
+			}
+		}
+	}
+
+	void UringEngine::DealConnect(UringSocket* connector, int32_t res) {
+		UringWorker* worker = connector->worker;
+		worker->connectors.erase(connector);
+
+		if (res == 0) {
+			const int32_t nodelay = 1;
+			setsockopt(connector->sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+
+			if (IsRunToCompletion())
+				OnConnect((ITcpSession*)connector->context, connector->sock, connector->sendSize, connector->recvSize, connector->remoteIp, connector->remotePort, worker);
+			else
+				PushConnectSuccess(worker, connector->sock, (ITcpSession*)connector->context, connector->sendSize, connector->recvSize, connector->remoteIp, connector->remotePort);
+		}
+		else {
+			close(connector->sock);
+			worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+			if (IsRunToCompletion())
+				OnConnectFail((ITcpSession*)connector->context);
+			else
+				PushConnectFail(worker, (ITcpSession*)connector->context);
+		}
+
+		delete connector;
+	}
+
+	void UringEngine::DealRecv(UringConnection* connection, int32_t res, uint32_t flags) {
+		UringWorker* worker = connection->_worker;
+		if (!(flags & IORING_CQE_F_MORE)) {
+			connection->_recvArmed = false;
+			connection->_recvCancelling = false;
+		}
+
+		if (res > 0) {
+			uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+			worker->recvBytes.fetch_add(res, std::memory_order_relaxed);
+
+			//counted before the session can give it back
+			if (!connection->_failed)
+				connection->_recvDelivered.store(connection->_recvDelivered.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+			if (connection->_failed)
+				ReturnBuffer(worker, bid);
+			else if (IsRunToCompletion()) {
+				NetRecvEvent* evt = AllocRecv(worker, connection, bid, res);
+				if (connection->OnRecv(evt))
+					ReleaseRecv(evt);
+			}
+			else
+				PushRecv(worker, connection, bid, res);
+
+			if (!connection->_failed && PauseRecv(connection))
+				CancelRecv(connection);
+			else if (!connection->_recvArmed && !connection->_failed && !ArmRecv(connection))
+				connection->_failed = true;
+		}
+		else if (res == -ENOBUFS && !connection->_failed) {
+			//rearmed once buffers come back
+			connection->_starved = true;
+			worker->starvedConnections.push_back(connection);
+			worker->starved = true;
+		}
+		else if (res == -ECANCELED && !connection->_failed) {
+			//stopped for a pause, a resume that came in meanwhile left it to be rearmed here
+			if (!connection->_recvPaused.load(std::memory_order_relaxed) && !ArmRecv(connection))
+				connection->_failed = true;
+		}
+		else if (res <= 0 && res != -ENOBUFS)
+			connection->_failed = true;
+
+		if (connection->_failed)
+			DealFail(connection);
+	}
+
+	void UringEngine::DealSend(UringConnection* connection, int32_t res) {
+		UringWorker* worker = connection->_worker;
+		connection->_sendInflight = false;
+
+		if (res < 0 || connection->_failed) {
+			DealFail(connection);
+			return;
+		}
+
+		//the socket became writable, the file goes out from here
+		if (connection->IsSendingFile()) {
+			connection->SetCorked(false);
+			res = SendFile(connection);
+			if (res < 0) {
+				DealFail(connection);
+				return;
+			}
+
+			if (res == 0) {
+				if (!SubmitSend(connection))
+					DealFail(connection);
+				return;
+			}
+		}
+
+		worker->sendBytes.fetch_add(res, std::memory_order_relaxed);
+		if (connection->Out(res) > 0) {
+			if (!SubmitSend(connection))
+				DealFail(connection);
+		}
+		else if (IsRunToCompletion())
+			connection->OnSendDone();
+		else
+			PushSendDone(worker, connection);
+	}
+
+	void UringEngine::DealFail(UringConnection* connection) {
+		if (!connection->_failReported && !connection->_failed) {
+			connection->_failed = true;
+			shutdown(connection->_fd, SHUT_RDWR);
+		}
+
+		//a starved recv is not in flight, nothing would report the connection while it waits for buffers
+		if (connection->_starved) {
+			std::vector<UringConnection*>& starved = connection->_worker->starvedConnections;
+			starved.erase(std::find(starved.begin(), starved.end(), connection));
+			connection->_starved = false;
+		}
+
+		//reported with the last completion, the connection is freed after that
+		if (connection->_recvArmed || connection->_sendInflight || connection->_failReported)
+			return;
+
+		connection->_failReported = true;
+		if (IsRunToCompletion())
+			connection->OnFail();
+		else
+			PushFail(connection->_worker, connection);
+	}
+
+	void UringEngine::DealReturned(UringWorker* worker) {
+		worker->returned.Sweep([this, worker](NetEvent* evt) {
+			ReturnBuffer(worker, static_cast<NetRecvEvent*>(evt)->bid);
+			worker->recvEvents.Recycle(static_cast<NetRecvEvent*>(evt));
+		});
+		worker->ring.CommitBuffers();
+
+		if (worker->starvedConnections.empty() || !worker->buffersReturned)
+			return;
+
+		worker->buffersReturned = false;
+		worker->starved = false;
+
+		std::vector<UringConnection*> starved;
+		starved.swap(worker->starvedConnections);
+		for (auto* conn : starved) {
+			conn->_starved = false;
+			//a paused recv waits for the session to resume it
+			if (conn->_failed || (!conn->_recvPaused.load(std::memory_order_relaxed) && !ArmRecv(conn)))
+				DealFail(conn);
+		}
+	}
+
+	void UringEngine::DealResume(UringConnection* connection) {
+		connection->_resumeQueued.store(false, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (connection->_failed || !connection->_recvPaused.load(std::memory_order_relaxed) || connection->IsRecvBacklogged())
+			return;
+
+		//a recv being cancelled is rearmed by its completion, a starved one once buffers come back
+		connection->_recvPaused.store(false, std::memory_order_relaxed);
+		if (!connection->_recvArmed && !connection->_starved && !ArmRecv(connection))
+			DealFail(connection);
+	}
+
+	void UringEngine::DealReady(UringWorker* worker) {
+		//callbacks may mark connections ready again, they wait for the next round
+		IntrusiveList<UringConnection> ready;
+		worker->ready.MoveTo(ready);
+
+		while (UringConnection* conn = ready.PopFront()) {
+			if (conn->NeedUpdateSend())
+				conn->UpdateSend();
+
+			conn->CheckReady();
+		}
+	}
+
+	bool UringEngine::ArmWakeup(UringWorker* worker) {
+		io_uring_sqe* sqe = GetSqe(worker, worker, URING_OP_WAKEUP);
+		if (!sqe)
+			return false;
+
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = worker->wakeupFd;
+		sqe->addr = (uint64_t)(uintptr_t)&worker->wakeupValue;
+		sqe->len = sizeof(worker->wakeupValue);
+		return true;
+	}
+
+	bool UringEngine::ArmAccept(UringSocket* acceptor) {
+		io_uring_sqe* sqe = GetSqe(acceptor->worker, acceptor, URING_OP_ACCEPT);
+		if (!sqe)
+			return false;
+
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = acceptor->sock;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		acceptor->armed = true;
+		return true;
+	}
+
+	bool UringEngine::ArmConnect(UringSocket* connector) {
+		io_uring_sqe* sqe = GetSqe(connector->worker, connector, URING_OP_CONNECT);
+		if (!sqe)
+			return false;
+
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = connector->sock;
+		sqe->addr = (uint64_t)(uintptr_t)&connector->remote;
+		sqe->off = connector->remoteLen;
+		connector->armed = true;
+		return true;
+	}
+
+	bool UringEngine::ArmRecv(UringConnection* connection) {
+		io_uring_sqe* sqe = GetSqe(connection->_worker, connection, URING_OP_RECV);
+		if (!sqe)
+			return false;
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = connection->_fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+		connection->_recvArmed = true;
+		return true;
+	}
+
+	//the session can't keep up, its recv stays down until it gave buffers back. it checks for the pause after giving
+	//them back, so checking again after pausing catches the buffers given back meanwhile
+	bool UringEngine::PauseRecv(UringConnection* connection) {
+		if (connection->_recvPaused.load(std::memory_order_relaxed))
+			return true;
+
+		if (!connection->IsRecvBacklogged())
+			return false;
+
+		connection->_recvPaused.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (connection->IsRecvBacklogged())
+			return true;
+
+		connection->_recvPaused.store(false, std::memory_order_relaxed);
+		return false;
+	}
+
+	//a multishot recv takes buffers until it is cancelled, it completes with -ECANCELED
+	void UringEngine::CancelRecv(UringConnection* connection) {
+		if (!connection->_recvArmed || connection->_recvCancelling)
+			return;
+
+		//without an sqe the recv runs on, the next buffer it takes tries again
+		io_uring_sqe* sqe = GetSqe(connection->_worker, nullptr, URING_OP_NONE);
+		if (!sqe)
+			return;
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)(uintptr_t)connection | URING_OP_RECV;
+		connection->_recvCancelling = true;
+	}
+
+	bool UringEngine::SubmitSend(UringConnection* connection) {
+		msghdr* msg = connection->PrepareSend();
+		//no splice between a file and a socket without a pipe in the middle, wait for room and sendfile
+		if (!msg && !connection->_nonBlocking) {
+			int32_t flags = fcntl(connection->_fd, F_GETFL, 0);
+			if (flags < 0 || fcntl(connection->_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+				return false;
+
+			connection->_nonBlocking = true;
+		}
+
+		io_uring_sqe* sqe = GetSqe(connection->_worker, connection, URING_OP_SEND);
+		if (!sqe)
+			return false;
+
+		if (!msg) {
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = connection->_fd;
+			sqe->poll32_events = POLLOUT;
+		}
+		else {
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = connection->_fd;
+			sqe->addr = (uint64_t)(uintptr_t)msg;
+			sqe->len = 1;
+
+			//a corked pipe tells the kernel more follows, it holds the partial segment until a flush pushes it
+			int32_t more = connection->IsCorked() ? MSG_MORE : 0;
+			sqe->msg_flags = MSG_NOSIGNAL | more;
+			connection->SetCorked(more != 0);
+		}
+		connection->_sendInflight = true;
+		return true;
+	}
+
+	//bytes sent from the file in flight, 0 when the socket filled up again, <0 on failure
+	int32_t UringEngine::SendFile(UringConnection* connection) {
+		SendPayload* payload = connection->_sendPayload;
+		off_t position = (off_t)(payload->position + payload->offset);
+		int64_t size = std::min<int64_t>(payload->size - payload->offset, MAX_SEND_FILE_SIZE);
+		int32_t len = (int32_t)sendfile(connection->_fd, payload->fd, &position, (size_t)size);
+		if (len < 0)
+			return errno == EAGAIN ? 0 : -1;
+
+		//the file got shorter than the range
+		return len > 0 ? len : -1;
+	}
+
+	void UringEngine::ReturnBuffer(UringWorker* worker, uint16_t bid) {
+		worker->ring.ReturnBuffer(bid);
+		worker->buffersReturned = true;
+	}
+
+	void UringEngine::ReleaseRecv(NetRecvEvent* evt) {
+		if (IsRunToCompletion()) {
+			UringWorker* worker = _workers[evt->owner];
+			ReturnBuffer(worker, evt->bid);
+			worker->recvEvents.Recycle(evt);
+		}
+		else
+			RecycleEvent(evt);
+	}
+
+	void UringEngine::ReleasePayload(UringWorker* worker, SendPayload* payload) {
+		//a file is the pipe's own duplicate, only buffers go back to the application's thread
+		if (IsRunToCompletion() || !payload->buffer)
+			FreePayload(payload);
+		else
+			PushEvent(worker, NET_SEND_RELEASE, payload);
+	}
+
+	bool UringEngine::StartRecv(UringConnection* connection) {
+		if (IsRunToCompletion())
+			return ArmRecv(connection);
+
+		PostToWorker(connection->_worker, &connection->_addCmd);
+		return true;
+	}
+
+	void UringEngine::ResumeRecv(UringConnection* connection) {
+		if (IsRunToCompletion())
+			DealResume(connection);
+		else
+			PostToWorker(connection->_worker, &connection->_resumeCmd);
+	}
+
+	void UringEngine::StartSend(UringConnection* connection) {
+		if (!IsRunToCompletion())
+			PostToWorker(connection->_worker, &connection->_sendCmd);
+		else if (!SubmitSend(connection))
+			connection->Shutdown();
+	}
+
+	void UringEngine::ReleaseConnection(UringConnection* connection) {
+		//in poll mode the worker may still hold commands for it, they are handled ahead of the release
+		if (IsRunToCompletion() || _terminate)
+			delete connection;
+		else
+			PostToWorker(connection->_worker, &connection->_releaseCmd);
+	}
+
+	void UringEngine::OnAccept(ITcpServer* server, int32_t sock, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port, UringWorker* worker) {
+		worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+		ITcpSession* session = server->MallocConnection();
+		if (!session) {
+			close(sock);
+			return;
+		}
+
+		UringConnection* connection = new (worker->arena) UringConnection(sock, this, worker, sendSize, recvSize, RingPool(worker));
+		connection->Attach(session);
+
+		connection->SetRemoteIp(ip);
+		connection->SetRemotePort(port);
+
+		if (!StartRecv(connection)) {
+			session->SetPipe(nullptr);
+			session->Release();
+
+			delete connection;
+			return;
+		}
+
+		Add(connection);
+		connection->OnConnected();
+	}
+
+	void UringEngine::OnConnect(ITcpSession* session, int32_t sock, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port, UringWorker* worker) {
+		worker->pending.fetch_sub(1, std::memory_order_relaxed);
+
+		UringConnection* connection = new (worker->arena) UringConnection(sock, this, worker, sendSize, recvSize, RingPool(worker));
+		connection->Attach(session);
+
+		connection->SetRemoteIp(ip);
+		connection->SetRemotePort(port);
+
+		if (!StartRecv(connection)) {
+			session->SetPipe(nullptr);
+			session->OnConnectFailed();
+
+			delete connection;
+			return;
+		}
+
+		Add(connection);
+		connection->OnConnected();
+	}
+
+	void UringEngine::OnConnectFail(ITcpSession* session) {
+		session->OnConnectFailed();
+	}
+
+	void UringEngine::PostToWorker(UringWorker* worker, NetCommand* cmd) {
+		if (worker->commands.InsertHead(cmd))
+			Wakeup(worker);
+	}
+
+	void UringEngine::PostToWorker(UringWorker* worker, int8_t cmdType, void* context) {
+		PostToWorker(worker, new NetCommand{ cmdType, context });
+	}
+
+	void UringEngine::Wakeup(UringWorker* worker) {
+		uint64_t value = 1;
+		write(worker->wakeupFd, &value, sizeof(value));
+	}
+
+	void UringEngine::Add(UringConnection* conn) {
+		UringWorker* worker = conn->GetWorker();
+		worker->connections.insert(conn);
+		worker->connectionCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void UringEngine::Remove(UringConnection* conn) {
+		UringWorker* worker = conn->GetWorker();
+		if (worker->connections.erase(conn) > 0)
+			worker->connectionCount.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void UringEngine::AddReady(UringConnection* conn) {
+		conn->GetWorker()->ready.PushBack(conn->GetReadyHook());
+	}
+
+	INetEngine* CreateUringEngine(const NetEngineConfig& config) {
+		UringEngine* engine = new UringEngine(config);
+		if (!engine->Start()) {
+			delete engine;
+			return nullptr;
+		}
+
+		return engine;
+	}
+}
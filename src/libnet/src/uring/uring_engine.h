@@ -0,0 +1,305 @@
+#ifndef __URING_ENGINE_H__
+#define __URING_ENGINE_H__
+#include "libnet.h"
+#include "net.h"
+#include "uring.h"
+
+#define URING_ENTRIES 1024
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_SIZE (16 << 10)
+#define URING_RECV_HELD (URING_BUFFER_COUNT / 16) //buffers one connection may keep from the worker before its recv is stopped
+
+namespace libnet {
+	//what a completion belongs to, kept in the low bits of user_data
+	enum {
+		URING_OP_NONE = 0,
+		URING_OP_ACCEPT,
+		URING_OP_CONNECT,
+		URING_OP_RECV,
+		URING_OP_SEND,
+		URING_OP_WAKEUP,
+		URING_OP_MASK = 7,
+	};
+
+	//commands from ADD on are carried by the connection itself, posted without allocating
+	enum {
+		URING_CMD_LISTEN = NET_CMD_CONNECT + 1,
+		URING_CMD_ADD,
+		URING_CMD_SEND,
+		URING_CMD_RESUME,
+		URING_CMD_RELEASE,
+	};
+
+	struct UringWorker;
+	struct alignas(8) UringSocket {
+		UringWorker* worker;
+		int32_t sock;
+		void* context;
+		int32_t sendSize;
+		int32_t recvSize;
+		bool reusePort; //acceptor keeps its connections on its own worker
+		bool armed; //multishot accept or connect in flight
+		bool stopped;
+		sockaddr_storage remote; //ipv4 or unix
+		socklen_t remoteLen;
+		char remoteIp[LIBNET_IP_SIZE];
+		int32_t remotePort;
+	};
+
+	//data received into a worker buffer, handed back to the worker once the session consumed it
+	struct NetRecvEvent : public NetEvent {
+		uint16_t bid;
+		int32_t size;
+		int32_t offset; //already copied to the connection's recv ring
+	};
+
+	class UringConnection;
+	struct UringWorker {
+		int16_t index = 0;
+		std::thread thread;
+		Uring ring;
+		int32_t wakeupFd = -1;
+		uint64_t wakeupValue = 0;
+		int32_t inflight = 0; //operations whose last completion is still due
+
+		int32_t cpu = -1;
+		NodeArena* arena = nullptr; //numa local allocations, only with sessions running on the worker
+		SendChunkPool chunks; //send queues past full rings, only touched by the thread dispatching the worker's sessions
+		BufferPool buffers; //ring storage of the worker's connections, only with sessions running on the worker
+
+		AtomicIntrusiveLinkedList<NetCommand, &NetCommand::next> commands;
+
+		NetEventPool<NetEvent> events;
+		NetEventPool<NetSocketEvent> socketEvents;
+		NetEventPool<NetRecvEvent> recvEvents;
+		AtomicIntrusiveLinkedList<NetEvent, &NetEvent::next> returned; //recv events done with by Poll
+		std::atomic<bool> starved = { false }; //a recv stopped for lack of buffers, Poll wakes the worker when returning one
+
+		//only touched by the thread dispatching this worker's sessions
+		std::unordered_set<UringConnection*> connections;
+		IntrusiveList<UringConnection> ready; //pending sends
+
+		//only touched by the worker thread
+		std::unordered_set<UringSocket*> acceptors;
+		std::unordered_set<UringSocket*> connectors;
+		std::vector<UringConnection*> starvedConnections;
+		bool buffersReturned = false; //since starved recvs were last rearmed
+		std::atomic<bool> drained = { false }; //nothing left to send, reported while the engine drains
+
+		//load counters, read by placement and GetWorkerStat from any thread
+		std::atomic<int32_t> connectionCount = { 0 };
+		std::atomic<int32_t> pending = { 0 }; //placed here but not registered yet
+		std::atomic<int64_t> recvBytes = { 0 };
+		std::atomic<int64_t> sendBytes = { 0 };
+		std::atomic<int64_t> enterCalls = { 0 };
+		std::atomic<int64_t> acceptCalls = { 0 };
+		std::atomic<int64_t> bytesPerSecond = { 0 };
+
+		//only touched by the worker thread
+		int64_t sampleBytes = 0;
+		int64_t sampleTime = 0;
+	};
+
+	/**
+	* INetEngine on io_uring, one ring per worker.
+	* Listeners keep a multishot accept and connections a multishot recv into the worker's provided buffers,
+	* sends go out from the connection's send ring. A worker submits and reaps everything with one io_uring_enter per round.
+	* Fast pipes are not supported, numaLocal only applies when sessions run on the workers.
+	*/
+	class UringEngine : public INetEngine {
+	public:
+		UringEngine(const NetEngineConfig& config);
+		~UringEngine();
+
+		bool Start();
+
+		using INetEngine::Listen;
+		virtual bool Listen(ITcpServer* server, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast, const ListenOptions& options);
+		virtual void Stop(ITcpServer* server);
+		virtual bool Connect(ITcpSession* session, const char* ip, const int32_t port, const int32_t sendSize, const int32_t recvSize, bool fast);
+
+		virtual PollResult Poll(int64_t frame, int32_t maxEvents);
+		virtual void Release();
+
+		virtual int32_t GetWorkerCount() const { return (int32_t)_workers.size(); }
+		virtual bool GetWorkerStat(int32_t index, NetWorkerStat& stat) const;
+
+		void ThreadProc(UringWorker* worker);
+		void SampleLoad(UringWorker* worker);
+		void Quiesce(UringWorker* worker);
+
+		void Drain();
+		bool HasPendingSend(UringWorker* worker);
+		void DropCommand(NetCommand* cmd);
+		void DropEvent(NetEvent* evt);
+
+		int32_t OpenListenSocket(const char* ip, const int32_t port, const ListenOptions& options);
+
+		bool DealEvent(NetEvent* evt);
+		void DealCompletion(UringWorker* worker, const io_uring_cqe& cqe, bool& wakeup);
+		void DealCommands(UringWorker* worker);
+		void DealCommand(UringWorker* worker, NetCommand* cmd);
+		void DealAccept(UringSocket* acceptor, int32_t res, uint32_t flags);
+		void DealConnect(UringSocket* connector, int32_t res);
+		void DealRecv(UringConnection* connection, int32_t res, uint32_t flags);
+		void DealSend(UringConnection* connection, int32_t res);
+		void DealFail(UringConnection* connection);
+		void DealResume(UringConnection* connection);
+		void DealReturned(UringWorker* worker);
+		void DealReady(UringWorker* worker);
+
+		bool ArmWakeup(UringWorker* worker);
+		bool ArmAccept(UringSocket* acceptor);
+		bool ArmConnect(UringSocket* connector);
+		bool ArmRecv(UringConnection* connection);
+		bool PauseRecv(UringConnection* connection);
+		void CancelRecv(UringConnection* connection);
+		bool SubmitSend(UringConnection* connection);
+		int32_t SendFile(UringConnection* connection);
+		void ReturnBuffer(UringWorker* worker, uint16_t bid);
+
+		//dispatching thread side of a connection
+		bool StartRecv(UringConnection* connection);
+		void ResumeRecv(UringConnection* connection);
+		void StartSend(UringConnection* connection);
+		void ReleaseConnection(UringConnection* connection);
+		void ReleaseRecv(NetRecvEvent* evt);
+		void ReleasePayload(UringWorker* worker, SendPayload* payload);
+
+		inline const char* GetRecvData(NetRecvEvent* evt) const { return _workers[evt->owner]->ring.GetBuffer(evt->bid) + evt->offset; }
+
+		void OnAccept(ITcpServer* server, int32_t sock, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port, UringWorker* worker);
+		void OnConnect(ITcpSession* session, int32_t sock, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port, UringWorker* worker);
+		void OnConnectFail(ITcpSession* session);
+
+		inline bool IsRunToCompletion() const { return _config.dispatchMode == NET_DISPATCH_WORKER; }
+		inline int32_t GetSendQueueLimit() const { return _config.sendQueueLimit; }
+		inline bool IsMirrorRecv() const { return _config.mirrorRecvBuffer; }
+		//sessions read straight from the provided buffers in both dispatch modes
+		inline bool IsSharedRecv() const { return _config.sharedRecvSize > 0; }
+		//poll mode connections are freed on the worker after Poll is done with them, their rings stay on the heap
+		inline BufferPool* RingPool(UringWorker* worker) { return IsRunToCompletion() ? &worker->buffers : nullptr; }
+
+		inline UringWorker* NextWorker() {
+			if (_workers.empty())
+				return nullptr;
+
+			return _workers[_nextIdx.fetch_add(1, std::memory_order_relaxed) % _workers.size()];
+		}
+
+		UringWorker* PlaceWorker(uint32_t remoteAddr);
+
+		void PostToWorker(UringWorker* worker, NetCommand* cmd);
+		void PostToWorker(UringWorker* worker, int8_t cmdType, void* context);
+		void Wakeup(UringWorker* worker);
+
+		inline io_uring_sqe* GetSqe(UringWorker* worker, void* owner, int8_t op) {
+			io_uring_sqe* sqe = worker->ring.GetSqe();
+			if (sqe) {
+				sqe->user_data = (uint64_t)(uintptr_t)owner | op;
+				++worker->inflight;
+			}
+			return sqe;
+		}
+
+		inline NetSocketEvent* AllocSocketEvent(UringWorker* worker, int8_t evtType, void* context, int32_t sock, int32_t sendSize, int32_t recvSize) {
+			NetSocketEvent* evt = worker->socketEvents.Alloc();
+			evt->evtType = evtType;
+			evt->owner = worker->index;
+			evt->context = context;
+			evt->sock = sock;
+			evt->sendSize = sendSize;
+			evt->recvSize = recvSize;
+			evt->fast = false;
+			evt->target = worker->index;
+			evt->remoteIp[0] = 0;
+			evt->remotePort = 0;
+			return evt;
+		}
+
+		inline void PushEvent(UringWorker* worker, int8_t evtType, void* context) {
+			NetEvent* evt = worker->events.Alloc();
+			evt->evtType = evtType;
+			evt->owner = worker->index;
+			evt->context = context;
+
+			_eventQueue.InsertHead(evt);
+		}
+
+		inline NetRecvEvent* AllocRecv(UringWorker* worker, UringConnection* connection, uint16_t bid, int32_t size) {
+			NetRecvEvent* evt = worker->recvEvents.Alloc();
+			evt->evtType = NET_RECV;
+			evt->owner = worker->index;
+			evt->context = connection;
+			evt->bid = bid;
+			evt->size = size;
+			evt->offset = 0;
+			return evt;
+		}
+
+		inline void PushRecv(UringWorker* worker, UringConnection* connection, uint16_t bid, int32_t size) {
+			_eventQueue.InsertHead(AllocRecv(worker, connection, bid, size));
+		}
+
+		//recv events go back through the worker, it still owns their buffer
+		inline void RecycleEvent(NetEvent* evt) {
+			UringWorker* worker = _workers[evt->owner];
+			if (evt->evtType == NET_RECV) {
+				worker->returned.InsertHead(evt);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (worker->starved.load(std::memory_order_relaxed))
+					Wakeup(worker);
+			}
+			else if (evt->evtType == NET_ACCEPT || evt->evtType == NET_CONNECT_SUCCESS)
+				worker->socketEvents.Recycle(static_cast<NetSocketEvent*>(evt));
+			else
+				worker->events.Recycle(evt);
+		}
+
+		inline NetSocketEvent* AllocAccept(UringWorker* worker, int32_t sock, ITcpServer* server, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port, UringWorker* target) {
+			NetSocketEvent* evt = AllocSocketEvent(worker, NET_ACCEPT, server, sock, sendSize, recvSize);
+			evt->target = target->index;
+			SafeSprintf(evt->remoteIp, sizeof(evt->remoteIp), "%s", ip);
+			evt->remotePort = port;
+			return evt;
+		}
+
+		inline void PushAccept(UringWorker* worker, int32_t sock, ITcpServer* server, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port, UringWorker* target) {
+			_eventQueue.InsertHead(AllocAccept(worker, sock, server, sendSize, recvSize, ip, port, target));
+		}
+
+		inline void PushConnectSuccess(UringWorker* worker, int32_t sock, ITcpSession* session, int32_t sendSize, int32_t recvSize, const char* ip, int32_t port) {
+			NetSocketEvent* evt = AllocSocketEvent(worker, NET_CONNECT_SUCCESS, session, sock, sendSize, recvSize);
+			SafeSprintf(evt->remoteIp, sizeof(evt->remoteIp), "%s", ip);
+			evt->remotePort = port;
+
+			_eventQueue.InsertHead(evt);
+		}
+
+		inline void PushConnectFail(UringWorker* worker, ITcpSession* session) { PushEvent(worker, NET_CONNECT_FAIL, session); }
+		inline void PushSendDone(UringWorker* worker, UringConnection* connection) { PushEvent(worker, NET_SEND_DONE, connection); }
+		inline void PushFail(UringWorker* worker, UringConnection* connection) { PushEvent(worker, NET_FAIL, connection); }
+
+		void Add(UringConnection* conn);
+		void Remove(UringConnection* conn);
+		void AddReady(UringConnection* conn);
+
+	private:
+		std::atomic<bool> _terminate = { false };
+		std::atomic<bool> _draining = { false };
+		NetEngineConfig _config;
+		bool _pollPinned = false;
+
+		std::atomic<uint32_t> _nextIdx = { 0 };
+		std::vector<UringWorker*> _workers;
+		AtomicIntrusiveLinkedList<NetEvent, &NetEvent::next> _eventQueue;
+		AtomicIntrusiveLinkedFetchedList<NetEvent, &NetEvent::next> _pendingEvents; //fetched but out of Poll budget
+
+		std::unordered_map<ITcpServer*, std::vector<UringSocket*>> _servers;
+	};
+
+	INetEngine* CreateUringEngine(const NetEngineConfig& config);
+}
+
+#endif //__URING_ENGINE_H__
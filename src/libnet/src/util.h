@@ -12,6 +12,61 @@ extern "C" {
 
 #define SafeSprintf snprintf
 
+#ifndef WIN32
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <dirent.h>
+
+namespace libnet {
+	//in a spin loop, keeps a hyperthread sibling going and the loop from flooding the memory pipeline
+	inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+	}
+
+	//a write to a reset peer leaves SIGPIPE pending on the thread and fails with EPIPE instead of killing the process.
+	//sendfile takes no MSG_NOSIGNAL, every io worker blocks it
+	inline void BlockSigPipe() {
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &set, nullptr);
+	}
+
+	inline bool PinThread(int32_t cpu) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+	}
+
+	//sysfs lists the node as a nodeN entry in the cpu directory, hosts without numa report none
+	inline int32_t NodeOfCpu(int32_t cpu) {
+		char path[64];
+		SafeSprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+		DIR* dir = opendir(path);
+		if (!dir)
+			return -1;
+
+		int32_t node = -1;
+		while (dirent* entry = readdir(dir)) {
+			if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+				node = atoi(entry->d_name + 4);
+				break;
+			}
+		}
+
+		closedir(dir);
+		return node;
+	}
+}
+#endif
+
 #ifdef _DEBUG
 #define LIBNET_ASSERT(p, format, ...) { \
     char debug[4096]; \
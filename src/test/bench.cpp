@@ -0,0 +1,1807 @@
+#include "libnet.h"
+#include "bench.h"
+#include <new>
+#include <string>
+#include <malloc.h>
+
+#define BENCH_IDLE_CONNECTION 4000
+#define BENCH_POLL_ROUND 1000
+#define BENCH_STORM_CONNECTION 20000
+#define BENCH_STORM_WINDOW 128
+#define BENCH_STORM_CLIENT 2
+#define BENCH_BALANCE_CONNECTION 2000
+#define BENCH_BALANCE_STREAM 4
+#define BENCH_STREAM_BLOCK 256
+#define BENCH_BULK_BYTES (256 << 20)
+#define BENCH_BULK_CHUNK (64 << 10)
+#define BENCH_BULK_BUFFER (64 << 10)
+#define BENCH_BULK_FRAME 1000
+#define BENCH_BULK_SEND_BUFFER (1 << 20)
+#define BENCH_BLOB_SIZE (4 << 20)
+#define BENCH_BLOB_COUNT 16
+#define BENCH_BLOB_ZERO_COPY (64 << 10)
+#define BENCH_UDP_DATAGRAM 1200
+#define BENCH_UDP_COUNT 200000
+#define BENCH_UDP_WINDOW 64
+#define BENCH_FLUSH_PARTS 8 //small writes making up one reply
+#define BENCH_FLUSH_PART 64
+#define BENCH_BURST_CONNECTION 256
+#define BENCH_BURST_BYTES 256000 //each accepted connection sends it right away
+#define BENCH_BURST_BLOCK 4000
+#define BENCH_BURST_SOCKET_BUFFER (16 << 10) //SO_SNDBUF of the server sockets, loopback autotunes past the whole burst otherwise
+#define BENCH_BROADCAST_CONNECTION 1000
+#define BENCH_BROADCAST_ROUND 200
+#define BENCH_CHURN_CONNECTION 5000
+#define BENCH_CHURN_WINDOW 64
+#define BENCH_PARSER_BYTES (64 << 20)
+#define BENCH_SCRATCH_CONNECTION 2000
+#define BENCH_SCRATCH_FRAME 1000
+#define BENCH_ORDER_CONNECTION 8
+#define BENCH_ORDER_BYTES (8 << 20) //each connection's stream
+#define BENCH_ORDER_PIECE (64 << 10) //largest piece of it handed over in one call, ring sends take at most BENCH_BURST_BLOCK
+#define BENCH_ORDER_QUEUE (8 << 20) //sendQueueLimit, the whole stream may wait past the ring
+#define BENCH_INTERLEAVE_CONNECTION 4
+#define BENCH_INTERLEAVE_PIECE 2048 //largest ring send or payload, small pieces queue many of both while a send is in flight
+#define BENCH_INTERLEAVE_WINDOW (256 << 10) //bytes the session keeps queued ahead of what the client acked
+#define BENCH_INTERLEAVE_RING_RUN 8 //every one of this many pieces is a payload, the worker mostly sends ring bytes with no payload fetched
+#define BENCH_INTERLEAVE_RECV (64 << 10) //room for the acks piling up while the session is busy queueing
+#define BENCH_FLOOD_PING 5
+#define BENCH_FLOOD_BLOCK (64 << 10)
+#define BENCH_FLOOD_TIMEOUT_MS 1000 //a ping answered later counts as lost
+#define BENCH_SCRATCH_STREAM_RUN 7 //stream runs per mode, one run is too noisy to compare them, the median is reported
+
+static std::atomic<int64_t> g_allocCount = { 0 };
+
+void* operator new(size_t size) {
+	++g_allocCount;
+	void* p = malloc(size);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+//the pair above allocates with malloc, gcc checks the inlined free against the library's operator new
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+#pragma GCC diagnostic pop
+
+static int32_t BenchLatency(const NetEngineConfig& config, const char* ip = "127.0.0.1") {
+	BenchServer server;
+	PingSession ping;
+	EnginePtr engine = StartServer(config, &server, 4096, 4096, BENCH_PORT, ListenOptions(), ip);
+	if (!engine)
+		return -1;
+
+	if (!engine->Connect(&ping, ip, BENCH_PORT, 4096, 4096, false)) {
+		printf("connect failed\n");
+		return -1;
+	}
+
+	int64_t start = NowNs();
+	int64_t cpuStart = CpuUs();
+	bool done = ping.Run(engine.get());
+	int64_t elapsed = NowNs() - start;
+	int64_t cpu = CpuUs() - cpuStart;
+	if (!Expect(done, "latency %d of %d rounds", (int32_t)ping.rounds, BENCH_ROUND) && ping.rtts.empty())
+		return -1;
+
+	//io_uring_enter calls on the uring backend
+	NetWorkerStat stat = SumWorkerStats(engine.get());
+	int64_t calls = stat.recvCalls + stat.sendCalls;
+
+	int32_t rounds = (int32_t)ping.rtts.size();
+	printf("latency rounds %d in %.1f ms, cpu %.1f ms, %.1f worker syscalls per round\n", rounds, elapsed / 1000000.0, cpu / 1000.0, (double)calls / rounds);
+	printf("latency rtt us: p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n", ping.Percentile(0.5), ping.Percentile(0.9), ping.Percentile(0.99), ping.Percentile(0.999), ping.Percentile(1.0));
+	return 0;
+}
+
+class IdleSession : public ITcpSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) { return buffer.Size(); }
+	virtual void OnConnected() { ++connected; }
+	virtual void OnConnectFailed() { ++failed; }
+	virtual void OnDisconnect() {}
+	virtual void Release() {}
+
+	static std::atomic<int32_t> connected;
+	static std::atomic<int32_t> failed;
+};
+
+std::atomic<int32_t> IdleSession::connected = { 0 };
+std::atomic<int32_t> IdleSession::failed = { 0 };
+
+//connects sessions[begin, end), keeping the outstanding connects below the listen backlog. returns how many made it
+static int32_t ConnectIdle(INetEngine* engine, std::vector<IdleSession>& sessions, int32_t begin, int32_t end) {
+	int32_t issued = begin;
+	int32_t base = IdleSession::connected + IdleSession::failed;
+	int32_t connected = IdleSession::connected;
+	WaitUntil(engine, [&]() {
+		int32_t settled = IdleSession::connected + IdleSession::failed - base;
+		while (issued < end && issued - begin - settled < 64)
+			engine->Connect(&sessions[issued++], "127.0.0.1", BENCH_PORT, 1024, 1024, false);
+		return settled >= end - begin;
+	}, 10000);
+	return IdleSession::connected - connected;
+}
+
+static int32_t BenchPoll(const NetEngineConfig& config) {
+	BenchServer server;
+	std::vector<IdleSession> sessions(BENCH_IDLE_CONNECTION);
+	EnginePtr engine = StartServer(config, &server, 1024, 1024);
+	if (!engine)
+		return -1;
+
+	int32_t connected = ConnectIdle(engine.get(), sessions, 0, BENCH_IDLE_CONNECTION);
+	Expect(connected == BENCH_IDLE_CONNECTION, "poll %d of %d connections", connected, BENCH_IDLE_CONNECTION);
+
+	//let accepted sides settle as well
+	SettleFor(engine.get(), 100);
+
+	int64_t start = NowNs();
+	for (int32_t i = 0; i < BENCH_POLL_ROUND; ++i)
+		engine->Poll(0);
+	int64_t elapsed = NowNs() - start;
+
+	printf("poll %d idle connections (%d failed), %.2f us per Poll\n", connected * 2, (int32_t)IdleSession::failed, elapsed / 1000.0 / BENCH_POLL_ROUND);
+	return 0;
+}
+
+static int32_t BenchAlloc(const NetEngineConfig& config) {
+	BenchServer server;
+	PingSession ping;
+	EnginePtr engine = StartServer(config, &server, 4096, 4096);
+	if (!engine)
+		return -1;
+
+	if (!engine->Connect(&ping, "127.0.0.1", BENCH_PORT, 4096, 4096, false)) {
+		printf("connect failed\n");
+		return -1;
+	}
+
+	ping.rtts.reserve(BENCH_ROUND);
+	ping.Run(engine.get(), BENCH_ROUND / 10);
+
+	int32_t startRound = ping.rounds;
+	int64_t startCount = g_allocCount;
+	bool done = ping.Run(engine.get());
+
+	int32_t messages = (ping.rounds - startRound) * 2;
+	if (!Expect(done && messages > 0, "alloc %d of %d rounds", (int32_t)ping.rounds, BENCH_ROUND))
+		return -1;
+
+	printf("alloc %lld allocations for %d messages, %.3f per message\n", (long long)(g_allocCount - startCount), messages, (double)(g_allocCount - startCount) / messages);
+	return 0;
+}
+
+static int32_t BenchIdle(const NetEngineConfig& config) {
+	EnginePtr engine(CreateNetEngine(config));
+	if (!engine)
+		return -1;
+
+	int64_t cpuStart = CpuUs();
+	std::this_thread::sleep_for(std::chrono::seconds(2));
+	printf("idle cpu %.2f ms per second\n", (CpuUs() - cpuStart) / 2000.0);
+	return 0;
+}
+
+//keeps a block bouncing against an EchoSession for as long as it lives,
+//small enough to fit the 1024 byte buffers of the bench servers
+class StreamSession : public EchoSession {
+public:
+	virtual void OnConnected() {
+		static char block[BENCH_STREAM_BLOCK] = { 0 };
+		Send(block, sizeof(block));
+	}
+
+	virtual void Release() {}
+};
+
+static void PrintWorkers(INetEngine* engine, const char* phase) {
+	int32_t minCount = 0;
+	int32_t maxCount = 0;
+	for (int32_t i = 0; i < engine->GetWorkerCount(); ++i) {
+		NetWorkerStat stat;
+		engine->GetWorkerStat(i, stat);
+		printf("balance %s worker %d: %d connections, %.1f MB/s\n", phase, i, stat.connections, stat.bytesPerSecond / 1048576.0);
+
+		minCount = (i == 0 || stat.connections < minCount) ? stat.connections : minCount;
+		maxCount = (i == 0 || stat.connections > maxCount) ? stat.connections : maxCount;
+	}
+	printf("balance %s spread %d\n", phase, maxCount - minCount);
+}
+
+//streams on a few connections, then churns idle ones so the survivors are uneven before a second wave arrives
+static int32_t BenchBalance(const NetEngineConfig& config) {
+	BenchServer server;
+	std::vector<StreamSession> streams(BENCH_BALANCE_STREAM);
+	std::vector<IdleSession> sessions(BENCH_BALANCE_CONNECTION * 2);
+	EnginePtr engine = StartServer(config, &server, 1024, 1024);
+	if (!engine)
+		return -1;
+
+	for (auto& stream : streams)
+		engine->Connect(&stream, "127.0.0.1", BENCH_PORT, 1024, 1024, false);
+	SettleFor(engine.get(), 1500);
+
+	//rates cover the last second, settle past one sample so they show the streams alone
+	int32_t connected = ConnectIdle(engine.get(), sessions, 0, BENCH_BALANCE_CONNECTION);
+	Expect(connected == BENCH_BALANCE_CONNECTION, "balance %d of %d connections", connected, BENCH_BALANCE_CONNECTION);
+	SettleFor(engine.get(), 1200);
+	PrintWorkers(engine.get(), "connect");
+
+	for (int32_t i = 1; i < BENCH_BALANCE_CONNECTION; i += 2)
+		sessions[i].Close();
+	SettleFor(engine.get(), 1200);
+	PrintWorkers(engine.get(), "churn");
+
+	connected = ConnectIdle(engine.get(), sessions, BENCH_BALANCE_CONNECTION, BENCH_BALANCE_CONNECTION * 2);
+	Expect(connected == BENCH_BALANCE_CONNECTION, "balance refill %d of %d connections", connected, BENCH_BALANCE_CONNECTION);
+	SettleFor(engine.get(), 1200);
+	PrintWorkers(engine.get(), "refill");
+	return 0;
+}
+
+//blocking connects reset on close, so neither side piles up sockets or TIME_WAIT
+static void StormClient(BenchServer& server, std::atomic<int32_t>& issued, std::atomic<int32_t>& failed, int32_t port) {
+	std::vector<int32_t> socks;
+	while (issued < BENCH_STORM_CONNECTION) {
+		if (issued - server.accepted - failed >= BENCH_STORM_WINDOW) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		if (issued++ >= BENCH_STORM_CONNECTION)
+			break;
+
+		int32_t sock = ConnectTo(port);
+		if (sock < 0) {
+			++failed;
+			continue;
+		}
+
+		linger opt = { 1, 0 };
+		setsockopt(sock, SOL_SOCKET, SO_LINGER, &opt, sizeof(opt));
+		socks.push_back(sock);
+
+		if ((int32_t)socks.size() >= BENCH_STORM_WINDOW)
+			CloseAll(socks);
+	}
+
+	CloseAll(socks);
+}
+
+//half the clients never send, with TCP_DEFER_ACCEPT only the other half reach a session
+static int32_t BenchDeferAccept(const NetEngineConfig& base) {
+	for (int32_t defer : { 0, 5 }) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+
+		BenchServer server;
+		ListenOptions options;
+		options.deferAccept = defer;
+		int32_t port = BENCH_PORT + 100 + defer;
+		EnginePtr engine = StartServer(config, &server, 1024, 1024, port, options);
+		if (!engine)
+			return -1;
+
+		std::vector<int32_t> socks = ConnectMany(port, BENCH_STORM_WINDOW);
+		int32_t sending = 0;
+		for (size_t i = 0; i < socks.size(); i += 2) {
+			char c = 0;
+			if (send(socks[i], &c, 1, MSG_NOSIGNAL) == 1)
+				++sending;
+		}
+
+		SettleFor(engine.get(), 500);
+
+		int32_t count = (int32_t)socks.size();
+		printf("defer accept %ds: %d of %d connections reached a session, %d sent data\n", defer, (int32_t)server.accepted, count, sending);
+		Expect(count == BENCH_STORM_WINDOW && server.accepted == (defer > 0 ? sending : count), "defer accept %ds: %d sessions", defer, (int32_t)server.accepted);
+		CloseAll(socks);
+	}
+	return 0;
+}
+
+static int32_t BenchAccept(const NetEngineConfig& base) {
+	int32_t round = 0;
+	for (int32_t threadCount : { 1, 2, 4 }) {
+		for (bool reusePort : { false, true }) {
+			NetEngineConfig config = base;
+			config.threadCount = threadCount;
+
+			//a fresh port each round, a reuseport group must not pick up the previous listeners
+			BenchServer server;
+			ListenOptions options;
+			options.reusePort = reusePort;
+			int32_t port = BENCH_PORT + round++;
+			EnginePtr engine = StartServer(config, &server, 1024, 1024, port, options);
+			if (!engine)
+				return -1;
+
+			std::atomic<int32_t> issued = { 0 };
+			std::atomic<int32_t> failed = { 0 };
+
+			int64_t start = NowNs();
+			std::vector<std::thread> clients;
+			for (int32_t i = 0; i < BENCH_STORM_CLIENT; ++i)
+				clients.emplace_back(StormClient, std::ref(server), std::ref(issued), std::ref(failed), port);
+
+			WaitUntil(engine.get(), [&]() { return server.accepted + failed >= BENCH_STORM_CONNECTION; });
+			int64_t elapsed = NowNs() - start;
+
+			for (auto& client : clients)
+				client.join();
+
+			int64_t calls = SumWorkerStats(engine.get()).acceptCalls;
+			printf("accept workers %d %s: %d connections (%d failed) in %.1f ms, %.0f per second, %.2f syscalls per connection\n", threadCount, reusePort ? "reuseport" : "single",
+				(int32_t)server.accepted, (int32_t)failed, elapsed / 1000000.0, server.accepted * 1000000000.0 / elapsed, server.accepted > 0 ? (double)calls / server.accepted : 0.0);
+			Expect(server.accepted == BENCH_STORM_CONNECTION, "accept %d of %d connections", (int32_t)server.accepted, BENCH_STORM_CONNECTION);
+		}
+	}
+
+	return BenchDeferAccept(base);
+}
+
+static char g_bulkFrames[BENCH_BULK_BUFFER];
+
+class SinkSession : public ITcpSession {
+public:
+	SinkSession(std::atomic<int64_t>& received, bool echo) : _received(received), _echo(echo) {}
+
+	//whole frames only, the partial one left behind keeps moving the ring's write position.
+	//echoed frames go out as one block, which wraps the send ring the same way
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int32_t size = buffer.Size() / BENCH_BULK_FRAME * BENCH_BULK_FRAME;
+		if (_echo && size > 0)
+			Send(g_bulkFrames, size);
+
+		_received += size;
+		return size;
+	}
+
+	virtual void OnConnected() {}
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() {}
+	virtual void Release() { delete this; }
+
+private:
+	std::atomic<int64_t>& _received;
+	bool _echo;
+};
+
+//the echo sends back zeroed frames, read checks every byte of them
+static void BulkClient(int32_t port, bool echo, int64_t expect, std::atomic<int64_t>& echoed) {
+	int32_t sock = ConnectTo(port);
+	if (sock < 0)
+		return;
+
+	std::thread reader;
+	if (echo)
+		reader = std::thread([sock, expect, &echoed]() { echoed = RecvAll(sock, expect, 0); });
+
+	std::vector<char> chunk(BENCH_BULK_CHUNK, 'x');
+	int64_t sent = 0;
+	while (sent < BENCH_BULK_BYTES) {
+		ssize_t len = send(sock, chunk.data(), chunk.size(), MSG_NOSIGNAL);
+		if (len <= 0)
+			break;
+		sent += len;
+	}
+
+	if (reader.joinable())
+		reader.join();
+	close(sock);
+}
+
+//one stream pushed through a ring smaller than what the kernel hands over per wakeup, the ring wraps on most reads.
+//sessions run on the workers, a poll mode ring filling up ahead of Poll is dropped as a failed connection
+static int32_t BenchBulk(const NetEngineConfig& base, bool echo) {
+	NetEngineConfig config = base;
+	config.threadCount = 1;
+	config.dispatchMode = NET_DISPATCH_WORKER;
+
+	std::atomic<int64_t> received = { 0 };
+	BenchServer server([&received, echo]() { return new SinkSession(received, echo); });
+	EnginePtr engine = StartServer(config, &server, BENCH_BULK_SEND_BUFFER, BENCH_BULK_BUFFER);
+	if (!engine)
+		return -1;
+
+	const int64_t expect = (int64_t)BENCH_BULK_BYTES / BENCH_BULK_FRAME * BENCH_BULK_FRAME;
+	std::atomic<int64_t> echoed = { 0 };
+	int64_t start = NowNs();
+	std::thread client(BulkClient, BENCH_PORT, echo, expect, std::ref(echoed));
+	WaitUntil(engine.get(), [&]() { return received >= expect; });
+	int64_t elapsed = NowNs() - start;
+	client.join();
+
+	NetWorkerStat stat = SumWorkerStats(engine.get());
+	double mb = received / (1024.0 * 1024.0);
+	printf("bulk %s %.0f MB in %.1f ms, %.0f MB/s, %lld recv calls, %.1f per MB, %lld send calls, %.1f per MB\n", echo ? "echo" : "sink",
+		mb, elapsed / 1000000.0, mb * 1000000000.0 / elapsed, (long long)stat.recvCalls, stat.recvCalls / mb, (long long)stat.sendCalls, stat.sendCalls / mb);
+	Expect(received == expect, "bulk %s received %lld of %lld bytes", echo ? "echo" : "sink", (long long)received, (long long)expect);
+	Expect(!echo || echoed == expect, "bulk echo read back %lld of %lld bytes", (long long)echoed, (long long)expect);
+	return 0;
+}
+
+enum {
+	BLOB_COPY = 0,
+	BLOB_PAYLOAD,
+	BLOB_ZERO_COPY,
+	BLOB_READ,
+	BLOB_FILE,
+};
+
+static std::vector<char> g_blob(BENCH_BLOB_SIZE, 'b');
+static std::atomic<int32_t> g_blobReleased = { 0 };
+static int32_t g_blobFile = -1; //the blob on disk, unlinked
+
+//every send refers to the one blob, released counts the sends the kernel is done with
+struct BlobBuffer : public ISendBuffer {
+	virtual const char* Data() const { return g_blob.data(); }
+	virtual int32_t Size() const { return (int32_t)g_blob.size(); }
+	virtual void Release() { ++g_blobReleased; delete this; }
+};
+
+class BlobSession : public ITcpSession {
+public:
+	BlobSession(int8_t mode) : _mode(mode) {}
+
+	virtual int32_t OnRecv(const NetBuffer& buffer) { return buffer.Size(); }
+
+	virtual void OnConnected() {
+		for (int32_t i = 0; i < BENCH_BLOB_COUNT; ++i) {
+			if (_mode == BLOB_COPY)
+				Send(g_blob.data(), (int32_t)g_blob.size());
+			else if (_mode == BLOB_READ) {
+				//what serving a file costs without SendFile, read into user memory then copied into the ring
+				std::vector<char> data(BENCH_BLOB_SIZE);
+				if (pread(g_blobFile, data.data(), data.size(), 0) == (ssize_t)data.size())
+					Send(data.data(), (int32_t)data.size());
+			}
+			else if (_mode == BLOB_FILE)
+				SendFile(g_blobFile, 0, BENCH_BLOB_SIZE);
+			else
+				Send(new BlobBuffer);
+		}
+	}
+
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() {}
+	virtual void Release() { delete this; }
+
+private:
+	int8_t _mode;
+};
+
+static void BlobClient(int32_t port, std::atomic<int64_t>& read, std::atomic<bool>& done) {
+	int32_t sock = ConnectTo(port);
+	if (sock >= 0) {
+		read = RecvAll(sock, (int64_t)BENCH_BLOB_SIZE * BENCH_BLOB_COUNT, 'b');
+		close(sock);
+	}
+	done = true;
+}
+
+//snapshot sized blobs to one reader: copied into a send ring holding them all, handed over as payloads, and as zero-copy payloads.
+//loopback never sends from user pages, the kernel copies zero-copy sends there and the connection falls back after the first.
+//then the same blob from a file, read and copied into the ring, and streamed with SendFile
+static int32_t BenchBlob(const NetEngineConfig& base) {
+	char path[] = "/tmp/libnet_blobXXXXXX";
+	g_blobFile = mkstemp(path);
+	if (g_blobFile < 0)
+		return -1;
+
+	unlink(path);
+	if (write(g_blobFile, g_blob.data(), g_blob.size()) != (ssize_t)g_blob.size()) {
+		close(g_blobFile);
+		return -1;
+	}
+
+	const char* names[] = { "copy", "payload", "zerocopy", "read", "sendfile" };
+	for (int8_t mode : { BLOB_COPY, BLOB_PAYLOAD, BLOB_ZERO_COPY, BLOB_READ, BLOB_FILE }) {
+		bool released = mode == BLOB_PAYLOAD || mode == BLOB_ZERO_COPY;
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.zeroCopyThreshold = mode == BLOB_ZERO_COPY ? BENCH_BLOB_ZERO_COPY : 0;
+
+		g_blobReleased = 0;
+		BenchServer server([mode]() { return new BlobSession(mode); });
+		int32_t sendSize = mode == BLOB_COPY || mode == BLOB_READ ? BENCH_BLOB_SIZE * BENCH_BLOB_COUNT : BENCH_BULK_SEND_BUFFER;
+		EnginePtr engine = StartServer(config, &server, sendSize, BENCH_BULK_BUFFER, BENCH_PORT + mode);
+		if (!engine) {
+			close(g_blobFile);
+			return -1;
+		}
+
+		const int64_t expect = (int64_t)BENCH_BLOB_SIZE * BENCH_BLOB_COUNT;
+		std::atomic<int64_t> read = { 0 };
+		std::atomic<bool> done = { false };
+		int64_t start = NowNs();
+		int64_t cpuStart = CpuUs();
+		std::thread client(BlobClient, BENCH_PORT + mode, std::ref(read), std::ref(done));
+		WaitUntil(engine.get(), [&]() { return done && (!released || g_blobReleased >= BENCH_BLOB_COUNT); });
+		int64_t elapsed = NowNs() - start;
+		int64_t cpu = CpuUs() - cpuStart;
+		client.join();
+
+		NetWorkerStat stat = SumWorkerStats(engine.get());
+		double mb = stat.sendBytes / (1024.0 * 1024.0);
+		printf("blob %s %.0f MB in %.1f ms, %.0f MB/s, cpu %.1f ms, %lld send calls, %d released\n", names[mode],
+			mb, elapsed / 1000000.0, mb * 1000000000.0 / elapsed, cpu / 1000.0, (long long)stat.sendCalls, (int32_t)g_blobReleased);
+		Expect(read == expect, "blob %s read %lld of %lld bytes, -1 for corrupt data", names[mode], (long long)read, (long long)expect);
+		Expect(!released || g_blobReleased == BENCH_BLOB_COUNT, "blob %s released %d of %d payloads", names[mode], (int32_t)g_blobReleased, BENCH_BLOB_COUNT);
+	}
+
+	close(g_blobFile);
+	return 0;
+}
+
+class UdpEchoSession : public IUdpSession {
+public:
+	virtual void OnRecv(const char* context, const int32_t size, const NetAddress& from) { SendTo(context, size, from); }
+	virtual void OnClose() {}
+	virtual void Release() {}
+};
+
+//keeps a window of datagrams in flight to the echo, each one back sends the next
+class UdpFloodSession : public IUdpSession {
+public:
+	virtual void OnBind() { Fill(); }
+	virtual void OnRecv(const char* context, const int32_t size, const NetAddress& from) {
+		++received;
+		Fill();
+	}
+	virtual void OnClose() {}
+	virtual void Release() {}
+
+	void Fill() {
+		while (sent < BENCH_UDP_COUNT && sent - received < BENCH_UDP_WINDOW && SendTo(datagram, BENCH_UDP_DATAGRAM, peer))
+			++sent;
+	}
+
+	NetAddress peer;
+	char datagram[BENCH_UDP_DATAGRAM] = {};
+	int32_t sent = 0;
+	std::atomic<int32_t> received = { 0 };
+};
+
+//datagrams echoed on one worker, one by one and as gso runs coalesced again by gro.
+//a naive loop takes a recvfrom and a sendto per datagram on each side, 2 syscalls per datagram
+static int32_t BenchUdp(const NetEngineConfig& base) {
+	if (base.backend == NET_BACKEND_URING) {
+		printf("udp skipped, the uring backend has no datagram sockets\n");
+		return 0;
+	}
+
+	for (bool segment : { false, true }) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+
+		UdpEchoSession echo;
+		UdpFloodSession flood;
+		EnginePtr engine(CreateNetEngine(config));
+		if (!engine)
+			return -1;
+
+		UdpOptions options;
+		options.gso = segment;
+		options.gro = segment;
+		options.recvSize = 1 << 20;
+		if (!engine->Bind(&echo, "127.0.0.1", 0, options)) {
+			printf("bind failed\n");
+			return -1;
+		}
+
+		//the flood starts sending from OnBind, it needs the echo's port first
+		flood.peer = echo.GetPipe()->GetLocalAddress();
+		int64_t start = NowNs();
+		int64_t cpuStart = CpuUs();
+		if (!engine->Bind(&flood, "127.0.0.1", 0, options)) {
+			printf("bind failed\n");
+			return -1;
+		}
+
+		//a lost datagram shrinks the window for good, stop once nothing comes back
+		int32_t last = 0;
+		int64_t progress = start;
+		while (flood.received < BENCH_UDP_COUNT && NowNs() - progress < 200000000ll) {
+			if (config.dispatchMode == NET_DISPATCH_WORKER)
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			else if (engine->Poll(0).processed == 0)
+				std::this_thread::yield();
+
+			if (flood.received != last) {
+				last = flood.received;
+				progress = NowNs();
+			}
+		}
+		int64_t elapsed = NowNs() - start;
+		int64_t cpu = CpuUs() - cpuStart;
+
+		NetWorkerStat stat = SumWorkerStats(engine.get());
+		printf("udp %s %d datagrams echoed in %.1f ms, %.0f per second, cpu %.1f ms, %.3f recvmmsg %.3f sendmmsg per datagram, %lld dropped\n",
+			segment ? "gso+gro" : "plain", (int32_t)flood.received, elapsed / 1000000.0, flood.received * 1000000000.0 / elapsed, cpu / 1000.0,
+			stat.recvDatagrams > 0 ? (double)stat.recvCalls / stat.recvDatagrams : 0.0, stat.sendDatagrams > 0 ? (double)stat.sendCalls / stat.sendDatagrams : 0.0,
+			(long long)stat.dropDatagrams);
+		Expect(flood.received == BENCH_UDP_COUNT, "udp %s %d of %d datagrams echoed", segment ? "gso+gro" : "plain", (int32_t)flood.received, BENCH_UDP_COUNT);
+	}
+	return 0;
+}
+
+//the ping pong over loopback tcp and over unix sockets, a file path and an abstract name
+static int32_t BenchUnix(const NetEngineConfig& config) {
+	for (const char* ip : { "127.0.0.1", "unix:/tmp/libnet_bench.sock", "unix:@libnet_bench" }) {
+		printf("%s\n", ip);
+		if (BenchLatency(config, ip) != 0)
+			return -1;
+	}
+
+	unlink("/tmp/libnet_bench.sock");
+	return 0;
+}
+
+//the ping pong with workers blocking in the kernel, spinning on it, with the Poll side spinning as well
+//and with kernel busy polling on top. spinning threads share the cores with everything else here
+static int32_t BenchBusy(const NetEngineConfig& base) {
+	struct Mode {
+		const char* name;
+		int8_t waitMode;
+		int32_t pollSpin;
+		int32_t busyPoll;
+	};
+
+	const Mode modes[] = {
+		{ "block", NET_WAIT_BLOCK, 0, 0 },
+		{ "spin", NET_WAIT_SPIN, 0, 0 },
+		{ "spin pollspin", NET_WAIT_SPIN, 1000, 0 },
+		{ "spin pollspin busypoll", NET_WAIT_SPIN, 1000, 50 },
+	};
+
+	int32_t cores = (int32_t)std::thread::hardware_concurrency();
+	for (const Mode& mode : modes) {
+		//sharing a core, the Poll thread only runs once the scheduler preempts the worker, milliseconds a round
+		if (mode.waitMode == NET_WAIT_SPIN && base.dispatchMode == NET_DISPATCH_POLL && cores < 2) {
+			printf("%s skipped, the spinning worker needs a core besides the Poll thread\n", mode.name);
+			continue;
+		}
+
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.waitMode = mode.waitMode;
+		config.pollSpin = mode.pollSpin;
+		config.busyPoll = mode.busyPoll;
+
+		printf("%s\n", mode.name);
+		if (BenchLatency(config) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+//answers every timestamp with BENCH_FLUSH_PARTS small writes, the timestamp leading the first
+class PartsSession : public ITcpSession {
+public:
+	PartsSession(int8_t policy) : _policy(policy) {}
+
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int32_t offset = 0;
+		int64_t data = 0;
+		while (buffer.Read(offset, data)) {
+			char part[BENCH_FLUSH_PART] = {};
+			memcpy(part, &data, sizeof(data));
+			for (int32_t i = 0; i < BENCH_FLUSH_PARTS; ++i)
+				Send(part, sizeof(part));
+			offset += sizeof(data);
+		}
+
+		if (_policy == NET_FLUSH_CORK)
+			Flush();
+		return offset;
+	}
+
+	virtual void OnConnected() { SetFlushPolicy(_policy); }
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() {}
+	virtual void Release() { delete this; }
+
+private:
+	int8_t _policy;
+};
+
+class PartsPingSession : public PingSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		const int32_t reply = BENCH_FLUSH_PARTS * BENCH_FLUSH_PART;
+		int32_t offset = 0;
+		int64_t start = 0;
+		while (buffer.Size() - offset >= reply && buffer.Read(offset, start)) {
+			offset += reply;
+			rtts.push_back(NowNs() - start);
+			rounds = (int32_t)rtts.size();
+			Ping();
+		}
+		return offset;
+	}
+
+	virtual void OnConnected() {
+		SetFlushPolicy(policy);
+		connected = true;
+		Ping();
+	}
+
+	inline void Ping() {
+		PingSession::Ping();
+		if (policy == NET_FLUSH_CORK)
+			Flush();
+	}
+
+	int8_t policy = NET_FLUSH_ROUND;
+};
+
+//a request answered with several small writes under each flush policy, write-through costs a syscall
+//per write, cork one per reply with the kernel filling whole segments, round leaves it to the end of the round
+static int32_t BenchFlush(const NetEngineConfig& base) {
+	const int8_t policies[] = { NET_FLUSH_ROUND, NET_FLUSH_WRITE_THROUGH, NET_FLUSH_CORK };
+	const char* names[] = { "round", "write-through", "cork" };
+	for (int32_t i = 0; i < 3; ++i) {
+		int8_t policy = policies[i];
+		BenchServer server([policy]() { return new PartsSession(policy); });
+		PartsPingSession ping;
+		ping.policy = policy;
+
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		EnginePtr engine = StartServer(config, &server, 4096, 4096);
+		if (!engine)
+			return -1;
+
+		if (!engine->Connect(&ping, "127.0.0.1", BENCH_PORT, 4096, 4096, false)) {
+			printf("connect failed\n");
+			return -1;
+		}
+
+		int64_t start = NowNs();
+		bool done = ping.Run(engine.get());
+		int64_t elapsed = NowNs() - start;
+		if (!Expect(done, "%s %d of %d rounds", names[i], (int32_t)ping.rounds, BENCH_ROUND) && ping.rtts.empty())
+			return -1;
+
+		NetWorkerStat stat = SumWorkerStats(engine.get());
+		int32_t rounds = (int32_t)ping.rtts.size();
+		printf("%-13s rounds %d in %.1f ms, %.2f send %.2f recv syscalls per round, rtt us p50 %.1f p99 %.1f\n", names[i], rounds,
+			elapsed / 1000000.0, (double)stat.sendCalls / rounds, (double)stat.recvCalls / rounds, ping.Percentile(0.5), ping.Percentile(0.99));
+	}
+	return 0;
+}
+
+//a stream counting up in 32 bit words, a block out of order or lost shows in the reader's compare
+static std::vector<char> MakeCounters(int32_t size) {
+	std::vector<char> counters(size);
+	for (int32_t i = 0; i < size / (int32_t)sizeof(int32_t); ++i)
+		memcpy(counters.data() + i * sizeof(int32_t), &i, sizeof(int32_t));
+	return counters;
+}
+
+//drains every socket until done, received only counts bytes matching counters at their position in the stream.
+//read is handed every read's socket index and length once it was checked
+static void DrainCounters(const std::vector<int32_t>& socks, const std::vector<char>& counters, std::atomic<int64_t>& received, std::atomic<int32_t>& corrupt,
+	std::atomic<bool>& done, const std::function<void(int32_t, int32_t)>& read = nullptr) {
+	std::vector<int64_t> positions(socks.size(), 0);
+	DrainAll(socks, done, [&](int32_t index, const char* data, int32_t len) {
+		int64_t& position = positions[index];
+		if (position + len > (int64_t)counters.size() || memcmp(data, counters.data() + position, len) != 0)
+			++corrupt;
+		else
+			received += len;
+		position += len;
+
+		if (read)
+			read(index, len);
+	});
+}
+
+static const std::vector<char> g_burst = MakeCounters(BENCH_BURST_BYTES);
+
+//sends a burst far larger than a small send buffer the moment it is accepted
+class BurstSession : public ITcpSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) { return buffer.Size(); }
+	virtual void OnConnected() {
+		for (int32_t sent = 0; sent < BENCH_BURST_BYTES; sent += BENCH_BURST_BLOCK)
+			Send(g_burst.data() + sent, BENCH_BURST_BLOCK);
+	}
+
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() { ++failed; }
+	virtual void Release() { delete this; }
+
+	static std::atomic<int32_t> failed;
+};
+
+std::atomic<int32_t> BurstSession::failed = { 0 };
+
+//connects every socket with a small receive window, lets the bursts pile up on the server, then drains them
+static void BurstClient(int32_t port, std::atomic<int64_t>& received, std::atomic<int32_t>& corrupt, std::atomic<bool>& done) {
+	std::vector<int32_t> socks = ConnectMany(port, BENCH_BURST_CONNECTION, 16 << 10);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	DrainCounters(socks, g_burst, received, corrupt, done);
+	CloseAll(socks);
+}
+
+//every connection bursts at once into a peer that reads later, with send buffers sized for the burst and with
+//small ones spilling into pooled chunks. the kernel keeps a small send buffer so the burst stays with the engine.
+//reserved counts ring capacity plus the peak of chunks in use
+static int32_t BenchSendQueue(const NetEngineConfig& base) {
+	struct Mode {
+		const char* name;
+		int32_t sendSize;
+		int32_t limit;
+	};
+
+	const Mode modes[] = {
+		{ "ring 256K", 256 << 10, 0 },
+		{ "ring 4K + chunks", 4 << 10, 1 << 20 },
+	};
+
+	for (const Mode& mode : modes) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.sendQueueLimit = mode.limit;
+
+		BenchServer server([]() { return new BurstSession; });
+		ListenOptions options;
+		options.sendBuffer = BENCH_BURST_SOCKET_BUFFER;
+		EnginePtr engine = StartServer(config, &server, mode.sendSize, 1024, BENCH_PORT, options);
+		if (!engine)
+			return -1;
+
+		std::atomic<int64_t> received = { 0 };
+		std::atomic<int32_t> corrupt = { 0 };
+		std::atomic<bool> done = { false };
+		BurstSession::failed = 0;
+		int64_t start = NowNs();
+		std::thread client(BurstClient, BENCH_PORT, std::ref(received), std::ref(corrupt), std::ref(done));
+
+		const int64_t expect = (int64_t)BENCH_BURST_CONNECTION * BENCH_BURST_BYTES;
+		int32_t peakChunks = 0;
+		WaitUntil(engine.get(), [&]() {
+			peakChunks = std::max(peakChunks, SumWorkerStats(engine.get()).sendChunks);
+			return received >= expect || BurstSession::failed > 0 || corrupt > 0;
+		});
+		int64_t elapsed = NowNs() - start;
+
+		done = true;
+		client.join();
+
+		NetWorkerStat stat = SumWorkerStats(engine.get());
+		int64_t reserved = (int64_t)BENCH_BURST_CONNECTION * mode.sendSize + (int64_t)peakChunks * (16 << 10);
+		printf("%-16s %s %.1f MB in %.1f ms, send memory reserved %.1f MB, peak chunks %d, %d after\n", mode.name,
+			received == expect ? "delivered" : "FAILED", received / 1048576.0, elapsed / 1000000.0, reserved / 1048576.0, peakChunks, stat.sendChunks);
+		Expect(received == expect && corrupt == 0, "%s received %lld of %lld bytes in order, %d reads out of order", mode.name, (long long)received, (long long)expect, (int32_t)corrupt);
+		Expect(mode.limit == 0 || peakChunks > 0, "%s never queued past the ring", mode.name);
+	}
+	return 0;
+}
+
+static const std::vector<char> g_order = MakeCounters(BENCH_ORDER_BYTES);
+static int32_t g_orderFile = -1; //g_order on disk, unlinked
+
+//a piece of g_order handed over as a payload, released counts the ones the connection is done with
+struct OrderBuffer : public ISendBuffer {
+	OrderBuffer(int32_t offset, int32_t size) : offset(offset), size(size) { ++created; }
+
+	virtual const char* Data() const { return g_order.data() + offset; }
+	virtual int32_t Size() const { return size; }
+	virtual void Release() { ++released; delete this; }
+
+	int32_t offset;
+	int32_t size;
+
+	static std::atomic<int32_t> created;
+	static std::atomic<int32_t> released;
+};
+
+std::atomic<int32_t> OrderBuffer::created = { 0 };
+std::atomic<int32_t> OrderBuffer::released = { 0 };
+
+enum {
+	ORDER_RING = 0,
+	ORDER_PAYLOAD,
+	ORDER_SHARED,
+	ORDER_FILE,
+	ORDER_KIND,
+};
+
+//g_order cut into pieces of random size, each one copied into the ring, queued as a payload, as a shared buffer or
+//from the file. the pieces queue up at once, the connection has to send them in the order they were handed over
+class OrderSession : public ITcpSession {
+public:
+	OrderSession(uint32_t seed) : _seed(seed) {}
+
+	virtual int32_t OnRecv(const NetBuffer& buffer) { return buffer.Size(); }
+	virtual void OnConnected() {
+		for (int32_t offset = 0; offset < BENCH_ORDER_BYTES;) {
+			int32_t kind = rand_r(&_seed) % ORDER_KIND;
+			int32_t size = (int32_t)(rand_r(&_seed) % (BENCH_ORDER_PIECE / sizeof(int32_t)) + 1) * (int32_t)sizeof(int32_t);
+			size = std::min(std::min(size, kind == ORDER_RING ? BENCH_BURST_BLOCK : size), BENCH_ORDER_BYTES - offset);
+
+			if (kind == ORDER_RING)
+				Send(g_order.data() + offset, size);
+			else if (kind == ORDER_PAYLOAD)
+				Send(new OrderBuffer(offset, size));
+			else if (kind == ORDER_SHARED) {
+				SharedBuffer* buffer = SharedBuffer::Create(g_order.data() + offset, size);
+				Send(buffer);
+				buffer->Release();
+			}
+			else
+				SendFile(g_orderFile, offset, size);
+
+			++pieces[kind];
+			offset += size;
+		}
+	}
+
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() { ++failed; }
+	virtual void Release() { delete this; }
+
+	static std::atomic<int32_t> pieces[ORDER_KIND];
+	static std::atomic<int32_t> failed;
+
+private:
+	uint32_t _seed;
+};
+
+std::atomic<int32_t> OrderSession::pieces[ORDER_KIND] = {};
+std::atomic<int32_t> OrderSession::failed = { 0 };
+
+static void OrderClient(int32_t port, std::atomic<int64_t>& received, std::atomic<int32_t>& corrupt, std::atomic<bool>& done) {
+	std::vector<int32_t> socks = ConnectMany(port, BENCH_ORDER_CONNECTION);
+	DrainCounters(socks, g_order, received, corrupt, done);
+	CloseAll(socks);
+}
+
+//a few connections each queueing its stream through every kind of send at once, against a small kernel send buffer
+//so the ring, the send queue chunks and the payload queue all hold a share of it. the reader checks every byte is
+//where the stream puts it
+static int32_t BenchOrder(const NetEngineConfig& base) {
+	struct Mode {
+		const char* name;
+		int32_t sendSize;
+		int32_t zeroCopy;
+	};
+
+	const Mode modes[] = {
+		{ "ring 256K", 256 << 10, 0 },
+		{ "ring 4K", 4 << 10, 0 },
+		{ "ring 4K zerocopy", 4 << 10, BENCH_BLOB_ZERO_COPY },
+	};
+
+	char path[] = "/tmp/libnet_orderXXXXXX";
+	g_orderFile = mkstemp(path);
+	if (g_orderFile < 0)
+		return -1;
+
+	unlink(path);
+	if (write(g_orderFile, g_order.data(), g_order.size()) != (ssize_t)g_order.size()) {
+		close(g_orderFile);
+		return -1;
+	}
+
+	for (const Mode& mode : modes) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.sendQueueLimit = BENCH_ORDER_QUEUE;
+		config.zeroCopyThreshold = mode.zeroCopy;
+
+		std::atomic<uint32_t> seed = { 1 };
+		BenchServer server([&seed]() { return new OrderSession(seed++); });
+		ListenOptions options;
+		options.sendBuffer = BENCH_BURST_SOCKET_BUFFER;
+		EnginePtr engine = StartServer(config, &server, mode.sendSize, 1024, BENCH_PORT, options);
+		if (!engine) {
+			close(g_orderFile);
+			return -1;
+		}
+
+		OrderBuffer::created = 0;
+		OrderBuffer::released = 0;
+		OrderSession::failed = 0;
+		for (auto& pieces : OrderSession::pieces)
+			pieces = 0;
+
+		std::atomic<int64_t> received = { 0 };
+		std::atomic<int32_t> corrupt = { 0 };
+		std::atomic<bool> done = { false };
+		int64_t start = NowNs();
+		std::thread client(OrderClient, BENCH_PORT, std::ref(received), std::ref(corrupt), std::ref(done));
+
+		const int64_t expect = (int64_t)BENCH_ORDER_CONNECTION * BENCH_ORDER_BYTES;
+		int32_t peakChunks = 0;
+		WaitUntil(engine.get(), [&]() {
+			peakChunks = std::max(peakChunks, SumWorkerStats(engine.get()).sendChunks);
+			return received >= expect || corrupt > 0 || OrderSession::failed > 0;
+		});
+		int64_t elapsed = NowNs() - start;
+		bool failed = OrderSession::failed > 0;
+
+		done = true;
+		client.join();
+		bool released = WaitUntil(engine.get(), []() { return OrderBuffer::released >= OrderBuffer::created; }, 1000);
+
+		printf("%-16s %s %.0f MB in %.1f ms, pieces ring %d payload %d shared %d file %d, peak chunks %d\n", mode.name,
+			received == expect && corrupt == 0 ? "in order" : "FAILED", received / 1048576.0, elapsed / 1000000.0, (int32_t)OrderSession::pieces[ORDER_RING],
+			(int32_t)OrderSession::pieces[ORDER_PAYLOAD], (int32_t)OrderSession::pieces[ORDER_SHARED], (int32_t)OrderSession::pieces[ORDER_FILE], peakChunks);
+		Expect(received == expect && corrupt == 0 && !failed, "%s received %lld of %lld bytes in order, %d reads out of order, %s", mode.name,
+			(long long)received, (long long)expect, (int32_t)corrupt, failed ? "a connection dropped" : "no connection dropped");
+		Expect(released, "%s released %d of %d payloads", mode.name, (int32_t)OrderBuffer::released, (int32_t)OrderBuffer::created);
+	}
+
+	close(g_orderFile);
+	return 0;
+}
+
+//g_order as ring sends with a payload now and then, queued from OnRecv as the client acks what it read. under poll dispatch
+//they are queued on the Poll thread while the worker gathers what was queued before
+class InterleaveSession : public ITcpSession {
+public:
+	InterleaveSession(uint32_t seed) : _seed(seed) {}
+
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int32_t offset = 0;
+		int32_t acked = 0;
+		while (buffer.Read(offset, acked)) {
+			_acked += acked;
+			offset += sizeof(acked);
+		}
+
+		Feed();
+		return offset;
+	}
+
+	virtual void OnConnected() { Feed(); }
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() { ++failed; }
+	virtual void Release() { delete this; }
+
+	static std::atomic<int32_t> failed;
+
+private:
+	void Feed() {
+		while (_sent < BENCH_ORDER_BYTES && _sent - _acked < BENCH_INTERLEAVE_WINDOW) {
+			int32_t size = (int32_t)(rand_r(&_seed) % (BENCH_INTERLEAVE_PIECE / sizeof(int32_t)) + 1) * (int32_t)sizeof(int32_t);
+			size = std::min(size, BENCH_ORDER_BYTES - _sent);
+
+			if (++_pieces % BENCH_INTERLEAVE_RING_RUN == 0)
+				Send(new OrderBuffer(_sent, size));
+			else
+				Send(g_order.data() + _sent, size);
+
+			_sent += size;
+		}
+	}
+
+private:
+	uint32_t _seed;
+	int32_t _sent = 0;
+	int32_t _acked = 0;
+	int32_t _pieces = 0;
+};
+
+std::atomic<int32_t> InterleaveSession::failed = { 0 };
+
+//acks every read with its length, the session queues more as the acks come in. the small receive window keeps
+//the socket full, the worker sends instead of the session
+static void InterleaveClient(int32_t port, std::atomic<int64_t>& received, std::atomic<int32_t>& corrupt, std::atomic<bool>& done) {
+	std::vector<int32_t> socks = ConnectMany(port, BENCH_INTERLEAVE_CONNECTION, BENCH_BURST_SOCKET_BUFFER);
+	DrainCounters(socks, g_order, received, corrupt, done, [&socks](int32_t index, int32_t len) {
+		SendAll(socks[index], (const char*)&len, sizeof(len));
+	});
+	CloseAll(socks);
+}
+
+//ring bytes and payloads queued while earlier ones are being sent, every payload lands right behind ring bytes the worker
+//may have missed on its last read of the ring. the reader checks every byte is where the stream puts it
+static int32_t BenchInterleave(const NetEngineConfig& base) {
+	struct Mode {
+		const char* name;
+		int32_t sendSize;
+	};
+
+	const Mode modes[] = {
+		{ "ring 256K", 256 << 10 },
+		{ "ring 4K", 4 << 10 },
+	};
+
+	for (const Mode& mode : modes) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.sendQueueLimit = BENCH_ORDER_QUEUE;
+
+		std::atomic<uint32_t> seed = { 1 };
+		BenchServer server([&seed]() { return new InterleaveSession(seed++); });
+		ListenOptions options;
+		options.sendBuffer = BENCH_BURST_SOCKET_BUFFER;
+		EnginePtr engine = StartServer(config, &server, mode.sendSize, BENCH_INTERLEAVE_RECV, BENCH_PORT, options);
+		if (!engine)
+			return -1;
+
+		OrderBuffer::created = 0;
+		OrderBuffer::released = 0;
+		InterleaveSession::failed = 0;
+
+		std::atomic<int64_t> received = { 0 };
+		std::atomic<int32_t> corrupt = { 0 };
+		std::atomic<bool> done = { false };
+		int64_t start = NowNs();
+		std::thread client(InterleaveClient, BENCH_PORT, std::ref(received), std::ref(corrupt), std::ref(done));
+
+		const int64_t expect = (int64_t)BENCH_INTERLEAVE_CONNECTION * BENCH_ORDER_BYTES;
+		WaitUntil(engine.get(), [&]() { return received >= expect || corrupt > 0 || InterleaveSession::failed > 0; });
+		int64_t elapsed = NowNs() - start;
+		bool failed = InterleaveSession::failed > 0;
+
+		done = true;
+		client.join();
+		bool released = WaitUntil(engine.get(), []() { return OrderBuffer::released >= OrderBuffer::created; }, 1000);
+
+		printf("%-16s %s %.0f MB in %.1f ms, %d payloads\n", mode.name, received == expect && corrupt == 0 ? "in order" : "FAILED",
+			received / 1048576.0, elapsed / 1000000.0, (int32_t)OrderBuffer::created);
+		Expect(received == expect && corrupt == 0 && !failed, "%s received %lld of %lld bytes in order, %d reads out of order, %s", mode.name,
+			(long long)received, (long long)expect, (int32_t)corrupt, failed ? "a connection dropped" : "no connection dropped");
+		Expect(released, "%s released %d of %d payloads", mode.name, (int32_t)OrderBuffer::released, (int32_t)OrderBuffer::created);
+	}
+	return 0;
+}
+
+//BENCH_FLOOD_PING values bounced off the echo server one at a time, returns how many came back in time
+static int32_t PingEcho(int32_t sock) {
+	timeval timeout = { BENCH_FLOOD_TIMEOUT_MS / 1000, (BENCH_FLOOD_TIMEOUT_MS % 1000) * 1000 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	int32_t answered = 0;
+	for (int64_t i = 0; i < BENCH_FLOOD_PING; ++i) {
+		int64_t back = -1;
+		if (!SendAll(sock, (const char*)&i, sizeof(i)) || recv(sock, (char*)&back, sizeof(back), MSG_WAITALL) != sizeof(back))
+			break;
+
+		if (back == i)
+			++answered;
+	}
+	return answered;
+}
+
+//sends as fast as the server takes it and never reads the echo
+static void FloodEcho(int32_t sock, const std::atomic<bool>& stop) {
+	std::vector<char> block(BENCH_FLOOD_BLOCK, 0);
+	while (!stop) {
+		if (send(sock, block.data(), block.size(), MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+			continue;
+
+		if (errno != EAGAIN)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+//a peer that sends without reading backs its echo session up, what it sends meanwhile waits on the server.
+//another connection on the same worker pings the echo server while it floods and after it left
+static int32_t BenchFlood(const NetEngineConfig& base) {
+	NetEngineConfig config = base;
+	config.threadCount = 1;
+
+	BenchServer server;
+	EnginePtr engine = StartServer(config, &server, BENCH_FLOOD_BLOCK, BENCH_FLOOD_BLOCK);
+	if (!engine)
+		return -1;
+
+	int32_t flooder = ConnectTo(BENCH_PORT);
+	int32_t pinger = ConnectTo(BENCH_PORT);
+	if (flooder < 0 || pinger < 0) {
+		printf("connect failed\n");
+		if (flooder >= 0)
+			close(flooder);
+		if (pinger >= 0)
+			close(pinger);
+		return -1;
+	}
+
+	std::atomic<int32_t> during = { 0 };
+	std::atomic<int32_t> after = { 0 };
+	std::atomic<bool> done = { false };
+	std::thread client([&]() {
+		std::atomic<bool> stop = { false };
+		std::thread flood(FloodEcho, flooder, std::ref(stop));
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		during = PingEcho(pinger);
+
+		stop = true;
+		flood.join();
+		close(flooder);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		after = PingEcho(pinger);
+
+		close(pinger);
+		done = true;
+	});
+
+	WaitUntil(engine.get(), [&done]() { return done.load(); });
+	client.join();
+
+	printf("flood pings answered %d of %d while flooded, %d of %d after\n", (int32_t)during, BENCH_FLOOD_PING, (int32_t)after, BENCH_FLOOD_PING);
+	Expect(during == BENCH_FLOOD_PING, "flood %d of %d pings answered while flooded", (int32_t)during, BENCH_FLOOD_PING);
+	Expect(after == BENCH_FLOOD_PING, "flood %d of %d pings answered after the flood", (int32_t)after, BENCH_FLOOD_PING);
+	return 0;
+}
+
+//a room member, the bench fans every packet out to all of them
+class MemberSession : public ITcpSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) { return buffer.Size(); }
+	virtual void OnConnected() { members.push_back(this); }
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() {
+		++failed;
+		members.erase(std::find(members.begin(), members.end(), this));
+	}
+	virtual void Release() { delete this; }
+
+	static std::vector<MemberSession*> members;
+	static std::atomic<int32_t> failed;
+};
+
+std::vector<MemberSession*> MemberSession::members;
+std::atomic<int32_t> MemberSession::failed = { 0 };
+
+//raw receivers draining whatever the room sends
+static void MemberClient(int32_t port, std::atomic<int32_t>& connected, std::atomic<int64_t>& received, std::atomic<bool>& done) {
+	std::vector<int32_t> socks = ConnectMany(port, BENCH_BROADCAST_CONNECTION);
+	connected = (int32_t)socks.size();
+	DrainAll(socks, done, [&received](int32_t, const char*, int32_t len) { received += len; });
+	CloseAll(socks);
+}
+
+//one packet to every member per round behind a header of its own, the body copied into each send ring against one shared
+//block referenced by all of them. fan out is the Poll side time spent in the Send calls
+static int32_t BenchBroadcast(const NetEngineConfig& base) {
+	const int32_t sizes[] = { 512, 16 << 10 };
+	for (int32_t size : sizes) {
+		std::vector<char> packet(size, 'p');
+		for (int32_t shared = 0; shared < 2; ++shared) {
+			NetEngineConfig config = base;
+			config.dispatchMode = NET_DISPATCH_POLL;
+
+			BenchServer server([]() { return new MemberSession; });
+			EnginePtr engine = StartServer(config, &server, 64 << 10, 1024);
+			if (!engine)
+				return -1;
+
+			std::atomic<int32_t> connected = { -1 };
+			std::atomic<int64_t> received = { 0 };
+			std::atomic<bool> done = { false };
+			MemberSession::failed = 0;
+			std::thread client(MemberClient, BENCH_PORT, std::ref(connected), std::ref(received), std::ref(done));
+
+			WaitUntil(engine.get(), [&]() { return connected >= 0 && (int32_t)MemberSession::members.size() >= connected; });
+			int64_t members = (int64_t)MemberSession::members.size();
+			int64_t calls = -SumWorkerStats(engine.get()).sendCalls;
+
+			int64_t fanout = 0;
+			int64_t start = NowNs();
+			int64_t cpuStart = CpuUs();
+			int64_t deadline = start + BENCH_TIMEOUT_MS * 1000000ll;
+			for (int32_t round = 0; round < BENCH_BROADCAST_ROUND && MemberSession::failed == 0; ++round) {
+				int64_t sendStart = NowNs();
+				int64_t header = round;
+				SharedBuffer* buffer = shared ? SharedBuffer::Create(packet.data(), size) : nullptr;
+				for (MemberSession* member : MemberSession::members) {
+					member->Send((const char*)&header, sizeof(header));
+					if (buffer)
+						member->Send(buffer);
+					else
+						member->Send(packet.data(), size);
+				}
+				if (buffer)
+					buffer->Release();
+				fanout += NowNs() - sendStart;
+
+				//spins, the round time is part of what it measures
+				const int64_t expect = members * (size + sizeof(header)) * (round + 1);
+				while (received < expect && MemberSession::failed == 0 && NowNs() < deadline) {
+					if (engine->Poll(0).processed == 0)
+						std::this_thread::yield();
+				}
+			}
+			int64_t elapsed = NowNs() - start;
+			int64_t cpu = CpuUs() - cpuStart;
+			calls += SumWorkerStats(engine.get()).sendCalls;
+
+			const int64_t expect = members * (size + sizeof(int64_t)) * BENCH_BROADCAST_ROUND;
+			printf("%6d bytes %-6s %s %lld members, fan out %.1f us, round %.1f us, cpu %.1f us per round, %.2f sends per member\n", size, shared ? "shared" : "copy",
+				received == expect ? "delivered" : "FAILED", (long long)members, fanout / 1000.0 / BENCH_BROADCAST_ROUND, elapsed / 1000.0 / BENCH_BROADCAST_ROUND,
+				(double)cpu / BENCH_BROADCAST_ROUND, (double)calls / BENCH_BROADCAST_ROUND / std::max<int64_t>(members, 1));
+			Expect(members == BENCH_BROADCAST_CONNECTION && received == expect, "broadcast %lld members received %lld of %lld bytes", (long long)members, (long long)received, (long long)expect);
+
+			done = true;
+			client.join();
+			engine.reset();
+			MemberSession::members.clear();
+		}
+	}
+	return 0;
+}
+
+//grows its send ring as soon as it is up, a client closes right after
+class ChurnSession : public ITcpSession {
+public:
+	ChurnSession(int32_t size, bool client) : _size(size), _client(client) {}
+
+	virtual int32_t OnRecv(const NetBuffer& buffer) { return buffer.Size(); }
+	virtual void OnConnected() {
+		AdjustSendBuffSize(_size * 4);
+		if (_client) {
+			++connected;
+			Close();
+		}
+	}
+
+	virtual void OnConnectFailed() { ++failed; }
+	virtual void OnDisconnect() {
+		if (_client)
+			++closed;
+	}
+
+	virtual void Release() { delete this; }
+
+	static std::atomic<int32_t> connected;
+	static std::atomic<int32_t> failed;
+	static std::atomic<int32_t> closed;
+
+private:
+	int32_t _size;
+	bool _client;
+};
+
+std::atomic<int32_t> ChurnSession::connected = { 0 };
+std::atomic<int32_t> ChurnSession::failed = { 0 };
+std::atomic<int32_t> ChurnSession::closed = { 0 };
+
+//short lived connections with rings of 1K to 64K, each grown four times right after connecting. every connection
+//makes four rings and two reallocs on the client side and on the server side
+static int32_t BenchChurn(const NetEngineConfig& config) {
+	const int32_t sizes[] = { 1024, 4096, 16384, 65536 };
+
+	BenchServer server([]() { return new ChurnSession(4096, false); });
+	EnginePtr engine = StartServer(config, &server, 4096, 4096);
+	if (!engine)
+		return -1;
+
+	ChurnSession::connected = 0;
+	ChurnSession::failed = 0;
+	ChurnSession::closed = 0;
+
+	int32_t issued = 0;
+	int64_t start = NowNs();
+	int64_t cpuStart = CpuUs();
+	WaitUntil(engine.get(), [&]() {
+		while (issued < BENCH_CHURN_CONNECTION && issued - ChurnSession::closed - ChurnSession::failed < BENCH_CHURN_WINDOW) {
+			int32_t size = sizes[issued++ % 4];
+			if (!engine->Connect(new ChurnSession(size, true), "127.0.0.1", BENCH_PORT, size, size, false))
+				++ChurnSession::failed;
+		}
+		return ChurnSession::closed + ChurnSession::failed >= BENCH_CHURN_CONNECTION;
+	}, BENCH_TIMEOUT_MS * 2);
+	int64_t elapsed = NowNs() - start;
+	int64_t cpu = CpuUs() - cpuStart;
+
+	NetWorkerStat total = SumWorkerStats(engine.get());
+	struct mallinfo2 heap = mallinfo2();
+	int64_t rings = total.ringHits + total.ringMisses;
+	printf("churn %d connections (%d failed) in %.1f ms, %.1f us and %.1f us cpu per connection\n", (int32_t)ChurnSession::closed, (int32_t)ChurnSession::failed,
+		elapsed / 1000000.0, elapsed / 1000.0 / BENCH_CHURN_CONNECTION, (double)cpu / BENCH_CHURN_CONNECTION);
+	printf("ring blocks %lld, %.1f%% from the worker pools, %.1f KB kept, heap %.1f MB in use of %.1f MB\n", (long long)rings, rings > 0 ? total.ringHits * 100.0 / rings : 0.0,
+		total.ringCached / 1024.0, heap.uordblks / 1048576.0, heap.arena / 1048576.0);
+	Expect(ChurnSession::closed == BENCH_CHURN_CONNECTION, "churn %d of %d connections closed", (int32_t)ChurnSession::closed, BENCH_CHURN_CONNECTION);
+	return 0;
+}
+
+//header lines of every length up to 80 bytes, repeated by the client
+static std::vector<char> MakeLines(size_t size) {
+	std::vector<char> lines;
+	lines.reserve(size);
+	for (int32_t n = 0; lines.size() < size; ++n) {
+		char line[128];
+		int32_t len = snprintf(line, sizeof(line), "x-field-%d: %.*s\r\n", n % 1000, n % 64, "abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijkl");
+		lines.insert(lines.end(), line, line + len);
+	}
+	lines.resize(size);
+	lines.back() = '\n';
+	return lines;
+}
+
+//splits whole lines at the colon, in place when the buffer is one span and the session may, otherwise through
+//NetBuffer's Find and ReadBlock like a parser that can't rely on the layout
+class LineSession : public ITcpSession {
+public:
+	LineSession(bool inPlace) : _inPlace(inPlace) {}
+
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int64_t start = NowNs();
+		int32_t offset = 0;
+		int64_t lines = 0;
+		if (_inPlace && buffer.IsContiguous()) {
+			const char* data = buffer.Data();
+			const char* end = data + buffer.Size();
+			const char* p = data;
+			while (const char* eol = (const char*)memchr(p, '\n', end - p)) {
+				ParseLine(p, (int32_t)(eol - p));
+				p = eol + 1;
+				++lines;
+			}
+			offset = (int32_t)(p - data);
+		}
+		else {
+			int32_t eol = 0;
+			while ((eol = buffer.Find(offset, '\n')) >= 0) {
+				std::string line = buffer.ReadBlock(offset, eol);
+				ParseLine(line.data(), (int32_t)line.size());
+				offset = eol + 1;
+				++lines;
+			}
+		}
+
+		if (!buffer.IsContiguous())
+			++split;
+		++calls;
+		parseNs += NowNs() - start;
+		parsed += lines;
+		received += offset;
+		return offset;
+	}
+
+	virtual void OnConnected() {}
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() {}
+	virtual void Release() { delete this; }
+
+	static std::atomic<int64_t> received;
+	static std::atomic<int64_t> parseNs;
+	static std::atomic<int64_t> parsed;
+	static std::atomic<int64_t> calls;
+	static std::atomic<int64_t> split;
+	static std::atomic<int64_t> checksum;
+
+private:
+	//name and value lengths, every mode has to come out with the same sum
+	static void ParseLine(const char* line, int32_t size) {
+		const char* colon = (const char*)memchr(line, ':', size);
+		checksum.fetch_add(colon ? (colon - line) * 31 + size : size, std::memory_order_relaxed);
+	}
+
+	bool _inPlace;
+};
+
+std::atomic<int64_t> LineSession::received = { 0 };
+std::atomic<int64_t> LineSession::parseNs = { 0 };
+std::atomic<int64_t> LineSession::parsed = { 0 };
+std::atomic<int64_t> LineSession::calls = { 0 };
+std::atomic<int64_t> LineSession::split = { 0 };
+std::atomic<int64_t> LineSession::checksum = { 0 };
+
+static void LineClient(int32_t port, const std::vector<char>* lines) {
+	int32_t sock = ConnectTo(port);
+	if (sock < 0)
+		return;
+
+	for (int64_t sent = 0; sent < BENCH_PARSER_BYTES; sent += (int64_t)lines->size()) {
+		if (!SendAll(sock, lines->data(), std::min<int64_t>(lines->size(), BENCH_PARSER_BYTES - sent)))
+			break;
+	}
+	close(sock);
+}
+
+//a stream of header lines through a 64K recv ring, split where the ring wraps against mirrored, parsed through
+//NetBuffer's accessors and in place. parse is the time spent in OnRecv
+static int32_t BenchParser(const NetEngineConfig& base) {
+	struct Mode {
+		const char* name;
+		bool mirrored;
+		bool inPlace;
+	};
+
+	const Mode modes[] = {
+		{ "ring, Find + ReadBlock", false, false },
+		{ "mirrored, Find + ReadBlock", true, false },
+		{ "mirrored, in place", true, true },
+	};
+
+	std::vector<char> lines = MakeLines(1 << 20);
+	int64_t firstParsed = -1;
+	int64_t firstChecksum = -1;
+	for (const Mode& mode : modes) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.dispatchMode = NET_DISPATCH_WORKER;
+		config.mirrorRecvBuffer = mode.mirrored;
+
+		bool inPlace = mode.inPlace;
+		BenchServer server([inPlace]() { return new LineSession(inPlace); });
+		EnginePtr engine = StartServer(config, &server, 4096, BENCH_BULK_BUFFER);
+		if (!engine)
+			return -1;
+
+		LineSession::received = 0;
+		LineSession::parseNs = 0;
+		LineSession::parsed = 0;
+		LineSession::calls = 0;
+		LineSession::split = 0;
+		LineSession::checksum = 0;
+
+		int64_t start = NowNs();
+		std::thread client(LineClient, BENCH_PORT, &lines);
+		WaitUntil(engine.get(), []() { return LineSession::received >= BENCH_PARSER_BYTES; });
+		int64_t elapsed = NowNs() - start;
+		client.join();
+
+		double mb = LineSession::received / (1024.0 * 1024.0);
+		printf("%-28s %s %.0f MB, %lld lines in %.1f ms, parse %.2f ms per MB, %.1f ns per line, %.0f%% of OnRecv calls split\n", mode.name,
+			LineSession::received == BENCH_PARSER_BYTES ? "parsed" : "FAILED", mb, (long long)LineSession::parsed, elapsed / 1000000.0,
+			LineSession::parseNs / 1000000.0 / mb, (double)LineSession::parseNs / std::max<int64_t>(LineSession::parsed, 1),
+			LineSession::split * 100.0 / std::max<int64_t>(LineSession::calls, 1));
+
+		if (firstParsed < 0) {
+			firstParsed = LineSession::parsed;
+			firstChecksum = LineSession::checksum;
+		}
+		Expect(LineSession::received == BENCH_PARSER_BYTES, "%s received %lld of %d bytes", mode.name, (long long)LineSession::received, BENCH_PARSER_BYTES);
+		Expect(LineSession::parsed == firstParsed && LineSession::checksum == firstChecksum, "%s parsed %lld lines, checksum %lld, the first mode %lld, %lld", mode.name,
+			(long long)LineSession::parsed, (long long)LineSession::checksum, (long long)firstParsed, (long long)firstChecksum);
+	}
+	return 0;
+}
+
+//length prefixed frames, only whole frames are consumed so a partial one stays with the connection.
+//a negative length announces a frame that large, the recv ring is grown ahead of it
+class FrameSession : public ITcpSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int32_t offset = 0;
+		int32_t size = 0;
+		while (buffer.Read(offset, size) && buffer.Size() - offset - (int32_t)sizeof(size) >= size) {
+			if (size < 0) {
+				AdjustRecvBuffSize((int32_t)sizeof(size) - size);
+				offset += (int32_t)sizeof(size);
+				continue;
+			}
+
+			offset += (int32_t)sizeof(size) + size;
+			++frames;
+		}
+		received += offset;
+		return offset;
+	}
+
+	virtual void OnConnected() { ++connected; }
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() { ++disconnected; }
+	virtual void Release() { delete this; }
+
+	static std::atomic<int32_t> connected;
+	static std::atomic<int32_t> disconnected;
+	static std::atomic<int64_t> frames;
+	static std::atomic<int64_t> received;
+};
+
+std::atomic<int32_t> FrameSession::connected = { 0 };
+std::atomic<int32_t> FrameSession::disconnected = { 0 };
+std::atomic<int64_t> FrameSession::frames = { 0 };
+std::atomic<int64_t> FrameSession::received = { 0 };
+
+//idle connections with 64K recv rings, then each one holding half a frame, then the frames completed, a frame larger
+//than the ring announced while the ring drains, and a stream of frames over one connection. heap is what the server
+//side adds to the process, the clients are plain sockets
+static int32_t BenchScratch(const NetEngineConfig& base) {
+	std::vector<char> frame(sizeof(int32_t) + BENCH_SCRATCH_FRAME, 'f');
+	*(int32_t*)frame.data() = BENCH_SCRATCH_FRAME;
+	std::vector<char> stream;
+	while (stream.size() < BENCH_BULK_CHUNK)
+		stream.insert(stream.end(), frame.begin(), frame.end());
+
+	const int32_t half = (int32_t)frame.size() / 2;
+	const int32_t grown = BENCH_BULK_BUFFER * 4;
+	std::vector<char> large(sizeof(int32_t) + grown, 'g');
+	*(int32_t*)large.data() = grown;
+	std::vector<char> announce(frame.begin() + half, frame.end());
+	announce.resize(announce.size() + sizeof(int32_t));
+	*(int32_t*)(announce.data() + announce.size() - sizeof(int32_t)) = -grown;
+
+	for (int32_t shared = 0; shared < 2; ++shared) {
+		NetEngineConfig config = base;
+		config.threadCount = 1;
+		config.dispatchMode = NET_DISPATCH_WORKER;
+		config.sharedRecvSize = shared ? BENCH_BULK_BUFFER : 0;
+
+		BenchServer server([]() { return new FrameSession(); });
+		EnginePtr engine = StartServer(config, &server, 4096, BENCH_BULK_BUFFER);
+		if (!engine)
+			return -1;
+
+		FrameSession::connected = 0;
+		FrameSession::disconnected = 0;
+		FrameSession::frames = 0;
+		FrameSession::received = 0;
+
+		int64_t before = (int64_t)mallinfo2().uordblks;
+		std::vector<int32_t> socks = ConnectMany(BENCH_PORT, BENCH_SCRATCH_CONNECTION);
+		bool connectOk = WaitUntil(engine.get(), [&]() { return FrameSession::connected >= (int32_t)socks.size(); });
+		SettleFor(engine.get(), 100);
+		int64_t idle = (int64_t)mallinfo2().uordblks - before;
+
+		for (int32_t sock : socks)
+			SendAll(sock, frame.data(), half);
+		SettleFor(engine.get(), 100);
+		bool partialOk = FrameSession::received == 0;
+		int64_t partial = (int64_t)mallinfo2().uordblks - before;
+
+		for (int32_t sock : socks)
+			SendAll(sock, frame.data() + half, (int32_t)frame.size() - half);
+		bool completeOk = WaitUntil(engine.get(), [&]() { return FrameSession::frames >= (int64_t)socks.size(); });
+		SettleFor(engine.get(), 100);
+		int64_t frames = FrameSession::frames;
+
+		//the rest of a held frame and the announcement in one read, the session grows the ring it then drains
+		SendAll(socks[0], frame.data(), half);
+		SettleFor(engine.get(), 50);
+		SendAll(socks[0], announce.data(), (int64_t)announce.size());
+		SettleFor(engine.get(), 50);
+		SendAll(socks[0], large.data(), (int64_t)large.size());
+		bool grownOk = WaitUntil(engine.get(), [&]() { return FrameSession::frames >= frames + 2 || FrameSession::disconnected > 0; }) &&
+			FrameSession::frames == frames + 2 && FrameSession::disconnected == 0;
+		int64_t complete = (int64_t)mallinfo2().uordblks - before;
+
+		const int64_t chunks = BENCH_PARSER_BYTES / (int64_t)stream.size();
+		const int64_t bytes = chunks * (int64_t)stream.size();
+		int64_t expect = FrameSession::received;
+		bool streamOk = true;
+		std::vector<double> rates;
+		for (int32_t run = 0; run < BENCH_SCRATCH_STREAM_RUN && streamOk; ++run) {
+			expect += bytes;
+			int64_t start = NowNs();
+			std::thread client([&]() {
+				for (int64_t i = 0; i < chunks; ++i)
+					SendAll(socks[0], stream.data(), (int64_t)stream.size());
+			});
+			streamOk = WaitUntil(engine.get(), [&]() { return FrameSession::received >= expect || FrameSession::disconnected > 0; }) && FrameSession::received == expect;
+			rates.push_back(bytes / 1048576.0 / ((NowNs() - start) / 1e9));
+			client.join();
+		}
+		std::sort(rates.begin(), rates.end());
+
+		const char* name = shared ? "scratch" : "rings";
+		printf("%-7s %d connections, heap idle %.1f MB, half a frame each %.1f MB, frames done %.1f MB, %s\n", name, (int32_t)socks.size(),
+			idle / 1048576.0, partial / 1048576.0, complete / 1048576.0, partialOk && completeOk ? "delivered" : "FAILED");
+		printf("%-7s frame grown mid-frame to %d KB %s\n", name, grown >> 10, grownOk ? "delivered" : "FAILED");
+		printf("%-7s stream %s %d runs of %.0f MB, median %.1f MB/s, min %.1f max %.1f\n", name, streamOk ? "delivered" : "FAILED",
+			(int32_t)rates.size(), bytes / 1048576.0, rates[rates.size() / 2], rates.front(), rates.back());
+		Expect(connectOk && (int32_t)socks.size() == BENCH_SCRATCH_CONNECTION, "%s %d of %d connections", name, (int32_t)FrameSession::connected, BENCH_SCRATCH_CONNECTION);
+		Expect(partialOk && completeOk && frames == (int64_t)socks.size(), "%s %lld of %d frames, half frames consumed %s", name,
+			(long long)frames, (int32_t)socks.size(), partialOk ? "no" : "yes");
+		Expect(grownOk, "%s grown frame, %lld of %lld frames, %d disconnected", name, (long long)FrameSession::frames, (long long)frames + 2, (int32_t)FrameSession::disconnected);
+		Expect(streamOk, "%s stream %lld of %lld bytes", name, (long long)FrameSession::received, (long long)expect);
+
+		CloseAll(socks);
+		engine.reset();
+	}
+	return 0;
+}
+
+//the same ping pong and bulk echo on each backend
+static int32_t BenchEcho(const NetEngineConfig& base) {
+	const int8_t backends[] = { NET_BACKEND_EPOLL, NET_BACKEND_URING };
+	const char* names[] = { "epoll", "uring" };
+	for (int32_t i = 0; i < 2; ++i) {
+		NetEngineConfig config = base;
+		config.backend = backends[i];
+		printf("backend %s, %s dispatch\n", names[i], config.dispatchMode == NET_DISPATCH_WORKER ? "worker" : "poll");
+		if (BenchLatency(config) != 0 || BenchBulk(config, true) != 0) {
+			printf("backend %s unavailable\n", names[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int32_t DispatchBench(const char* name, const NetEngineConfig& config) {
+	//builds its own engines, one per worker count
+	if (strcmp(name, "bench_accept") == 0)
+		return BenchAccept(config);
+
+	if (strcmp(name, "bench_latency") == 0)
+		return BenchLatency(config);
+	else if (strcmp(name, "bench_poll") == 0)
+		return BenchPoll(config);
+	else if (strcmp(name, "bench_alloc") == 0)
+		return BenchAlloc(config);
+	else if (strcmp(name, "bench_idle") == 0)
+		return BenchIdle(config);
+	else if (strcmp(name, "bench_balance") == 0)
+		return BenchBalance(config);
+
+	else if (strcmp(name, "bench_bulk") == 0)
+		return BenchBulk(config, false) == 0 ? BenchBulk(config, true) : -1;
+	else if (strcmp(name, "bench_echo") == 0)
+		return BenchEcho(config);
+	else if (strcmp(name, "bench_blob") == 0)
+		return BenchBlob(config);
+	else if (strcmp(name, "bench_udp") == 0)
+		return BenchUdp(config);
+	else if (strcmp(name, "bench_unix") == 0)
+		return BenchUnix(config);
+	else if (strcmp(name, "bench_busy") == 0)
+		return BenchBusy(config);
+	else if (strcmp(name, "bench_flush") == 0)
+		return BenchFlush(config);
+	else if (strcmp(name, "bench_sendqueue") == 0)
+		return BenchSendQueue(config);
+	else if (strcmp(name, "bench_order") == 0)
+		return BenchOrder(config);
+	else if (strcmp(name, "bench_interleave") == 0)
+		return BenchInterleave(config);
+	else if (strcmp(name, "bench_flood") == 0)
+		return BenchFlood(config);
+	else if (strcmp(name, "bench_broadcast") == 0)
+		return BenchBroadcast(config);
+	else if (strcmp(name, "bench_churn") == 0)
+		return BenchChurn(config);
+	else if (strcmp(name, "bench_parser") == 0)
+		return BenchParser(config);
+	else if (strcmp(name, "bench_scratch") == 0)
+		return BenchScratch(config);
+
+	printf("unknown bench %s\n", name);
+	return -1;
+}
+
+int32_t RunBench(int32_t argc, char** argv) {
+	NetEngineConfig config;
+	for (int32_t i = 2; i < argc; ++i) {
+		if (strcmp(argv[i], "sleep") == 0)
+			config.waitMode = NET_WAIT_SLEEP;
+		else if (strcmp(argv[i], "spin") == 0)
+			config.waitMode = NET_WAIT_SPIN;
+		else if (strcmp(argv[i], "worker") == 0)
+			config.dispatchMode = NET_DISPATCH_WORKER;
+		else if (strcmp(argv[i], "least_conn") == 0)
+			config.placement = NET_PLACE_LEAST_CONNECTIONS;
+		else if (strcmp(argv[i], "least_bytes") == 0)
+			config.placement = NET_PLACE_LEAST_BYTES;
+		else if (strcmp(argv[i], "hash") == 0)
+			config.placement = NET_PLACE_HASH_ADDRESS;
+		else if (strcmp(argv[i], "uring") == 0)
+			config.backend = NET_BACKEND_URING;
+		else if (strcmp(argv[i], "pin") == 0) {
+			//workers spread over the cpus, Poll on the first one
+			int32_t cpus = (int32_t)std::thread::hardware_concurrency();
+			for (int32_t c = 0; c < config.threadCount; ++c)
+				config.workerCpus.push_back(c % (cpus > 0 ? cpus : 1));
+			config.pollCpu = 0;
+			config.numaLocal = true;
+		}
+	}
+
+	//a bench fails when it couldn't run or any of its checks did, the exit code tells a script which
+	int32_t ret = DispatchBench(argv[1], config);
+	if (ret == 0 && g_benchFailures > 0)
+		ret = -1;
+
+	printf("%s %s\n", argv[1], ret == 0 ? "passed" : "FAILED");
+	return ret;
+}
@@ -0,0 +1,308 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+#include "libnet.h"
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+using namespace libnet;
+
+#define BENCH_PORT 5600
+#define BENCH_ROUND 10000
+#define BENCH_TIMEOUT_MS 30000
+#define BENCH_READ_CHUNK (64 << 10)
+
+int32_t RunBench(int32_t argc, char** argv);
+
+//checks that failed, RunBench returns nonzero when any did
+inline std::atomic<int32_t> g_benchFailures = { 0 };
+
+inline bool Expect(bool ok, const char* format, ...) {
+	if (ok)
+		return true;
+
+	++g_benchFailures;
+	va_list args;
+	va_start(args, format);
+	printf("FAILED ");
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+	return false;
+}
+
+inline int64_t NowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline int64_t CpuUs() {
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+//released before the sessions declared ahead of it go out of scope
+struct EngineRelease {
+	void operator()(INetEngine* engine) const { engine->Release(); }
+};
+typedef std::unique_ptr<INetEngine, EngineRelease> EnginePtr;
+
+//an engine listening on port, null once either step failed
+inline EnginePtr StartServer(const NetEngineConfig& config, ITcpServer* server, int32_t sendSize, int32_t recvSize,
+	int32_t port = BENCH_PORT, const ListenOptions& options = ListenOptions(), const char* ip = "127.0.0.1") {
+	EnginePtr engine(CreateNetEngine(config));
+	if (!engine) {
+		printf("create engine failed\n");
+		return nullptr;
+	}
+
+	if (!engine->Listen(server, ip, port, sendSize, recvSize, false, options)) {
+		printf("listen failed\n");
+		return nullptr;
+	}
+	return engine;
+}
+
+//polls until done, sessions on the workers leave Poll with nothing to do and the wait sleeps instead
+template <typename Done>
+inline bool WaitUntil(INetEngine* engine, Done done, int64_t timeoutMs = BENCH_TIMEOUT_MS) {
+	int64_t deadline = NowNs() + timeoutMs * 1000000ll;
+	while (!done()) {
+		if (NowNs() >= deadline)
+			return false;
+
+		if (engine->Poll(0).processed == 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	return true;
+}
+
+inline void SettleFor(INetEngine* engine, int32_t ms) {
+	WaitUntil(engine, []() { return false; }, ms);
+}
+
+inline NetWorkerStat SumWorkerStats(INetEngine* engine) {
+	NetWorkerStat total;
+	for (int32_t i = 0; i < engine->GetWorkerCount(); ++i) {
+		NetWorkerStat stat;
+		engine->GetWorkerStat(i, stat);
+		total.connections += stat.connections;
+		total.recvBytes += stat.recvBytes;
+		total.sendBytes += stat.sendBytes;
+		total.bytesPerSecond += stat.bytesPerSecond;
+		total.recvCalls += stat.recvCalls;
+		total.sendCalls += stat.sendCalls;
+		total.acceptCalls += stat.acceptCalls;
+		total.recvDatagrams += stat.recvDatagrams;
+		total.sendDatagrams += stat.sendDatagrams;
+		total.dropDatagrams += stat.dropDatagrams;
+		total.sendChunks += stat.sendChunks;
+		total.ringHits += stat.ringHits;
+		total.ringMisses += stat.ringMisses;
+		total.ringCached += stat.ringCached;
+	}
+	return total;
+}
+
+//a plain blocking socket connected to the bench server on loopback, -1 when it couldn't.
+//recvBuffer shrinks its receive window when set
+inline int32_t ConnectTo(int32_t port, int32_t recvBuffer = 0) {
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	int32_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0)
+		return -1;
+
+	if (recvBuffer > 0)
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&recvBuffer, sizeof(recvBuffer));
+
+	if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+//stops at the first socket that fails to connect
+inline std::vector<int32_t> ConnectMany(int32_t port, int32_t count, int32_t recvBuffer = 0) {
+	std::vector<int32_t> socks;
+	for (int32_t i = 0; i < count; ++i) {
+		int32_t sock = ConnectTo(port, recvBuffer);
+		if (sock < 0)
+			break;
+		socks.push_back(sock);
+	}
+	return socks;
+}
+
+inline void CloseAll(std::vector<int32_t>& socks) {
+	for (int32_t sock : socks) {
+		if (sock >= 0)
+			close(sock);
+	}
+	socks.clear();
+}
+
+//a peer gone shows as a failed send, not as SIGPIPE ending the bench
+inline bool SendAll(int32_t sock, const char* data, int64_t size) {
+	while (size > 0) {
+		ssize_t len = send(sock, data, (size_t)size, MSG_NOSIGNAL);
+		if (len <= 0)
+			return false;
+		data += len;
+		size -= len;
+	}
+	return true;
+}
+
+//reads until expect bytes came in or the peer closed, returns what was read.
+//fill checks every byte against it when it isn't -1, a mismatch ends the read with -1
+inline int64_t RecvAll(int32_t sock, int64_t expect, int32_t fill = -1) {
+	std::vector<char> chunk(BENCH_READ_CHUNK);
+	std::vector<char> pattern(fill >= 0 ? BENCH_READ_CHUNK : 0, (char)fill);
+	int64_t read = 0;
+	while (read < expect) {
+		ssize_t len = recv(sock, chunk.data(), chunk.size(), 0);
+		if (len <= 0)
+			break;
+
+		if (fill >= 0 && memcmp(chunk.data(), pattern.data(), len) != 0)
+			return -1;
+		read += len;
+	}
+	return read;
+}
+
+//drains every socket until done, data hands each read over with the index of its socket.
+//a closed socket is left out from then on, returns once all of them are
+inline void DrainAll(const std::vector<int32_t>& socks, const std::atomic<bool>& done, const std::function<void(int32_t, const char*, int32_t)>& data) {
+	std::vector<pollfd> fds;
+	for (int32_t sock : socks)
+		fds.push_back(pollfd{ sock, POLLIN, 0 });
+
+	std::vector<char> chunk(BENCH_READ_CHUNK);
+	size_t open = fds.size();
+	while (open > 0 && !done) {
+		if (poll(fds.data(), fds.size(), 100) <= 0)
+			continue;
+
+		for (size_t i = 0; i < fds.size(); ++i) {
+			pollfd& fd = fds[i];
+			if (fd.fd < 0 || !(fd.revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			ssize_t len = recv(fd.fd, chunk.data(), chunk.size(), MSG_DONTWAIT);
+			if (len > 0)
+				data((int32_t)i, chunk.data(), (int32_t)len);
+			else if (len == 0 || errno != EAGAIN) {
+				fd.fd = -1;
+				--open;
+			}
+		}
+	}
+}
+
+//answers every 8 byte value with itself
+class EchoSession : public ITcpSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int32_t offset = 0;
+		int64_t data = 0;
+		while (buffer.Read(offset, data)) {
+			Send((const char*)&data, sizeof(data));
+			offset += sizeof(data);
+		}
+		return offset;
+	}
+
+	virtual void OnConnected() {}
+	virtual void OnConnectFailed() {}
+	virtual void OnDisconnect() {}
+	virtual void Release() { delete this; }
+};
+
+//hands out the sessions a bench passes in, counting the accepted connections
+struct BenchServer : public ITcpServer {
+	BenchServer(const std::function<ITcpSession*()>& create = []() { return new EchoSession; }) : create(create) {}
+
+	virtual ITcpSession* MallocConnection() {
+		++accepted;
+		return create();
+	}
+
+	std::function<ITcpSession*()> create;
+	std::atomic<int32_t> accepted = { 0 };
+};
+
+//timestamps bounced off an EchoSession, one in flight until BENCH_ROUND came back
+class PingSession : public ITcpSession {
+public:
+	virtual int32_t OnRecv(const NetBuffer& buffer) {
+		int32_t offset = 0;
+		int64_t start = 0;
+		while (buffer.Read(offset, start)) {
+			offset += sizeof(start);
+			Pong(start);
+		}
+		return offset;
+	}
+
+	virtual void OnConnected() { connected = true; Ping(); }
+	virtual void OnConnectFailed() { failed = true; }
+	virtual void OnDisconnect() { failed = true; }
+	virtual void Release() {}
+
+	inline void Ping() {
+		if ((int32_t)rtts.size() < BENCH_ROUND) {
+			int64_t now = NowNs();
+			Send((const char*)&now, sizeof(now));
+		}
+	}
+
+	inline void Pong(int64_t start) {
+		rtts.push_back(NowNs() - start);
+		rounds = (int32_t)rtts.size();
+		Ping();
+	}
+
+	//polls until rounds came back or the connection failed, spinning to keep the rtts tight
+	bool Run(INetEngine* engine, int32_t until = BENCH_ROUND) {
+		while (!failed && rounds < until) {
+			engine->Poll(0);
+			std::this_thread::yield();
+		}
+		return rounds >= until;
+	}
+
+	//call once the rounds are done, sorts the rtts
+	double Percentile(double p) {
+		std::sort(rtts.begin(), rtts.end());
+		return rtts.empty() ? 0.0 : rtts[(size_t)((rtts.size() - 1) * p)] / 1000.0;
+	}
+
+	//session callbacks run on a worker when dispatchMode is NET_DISPATCH_WORKER
+	std::vector<int64_t> rtts;
+	std::atomic<int32_t> rounds = { 0 };
+	std::atomic<bool> connected = { false };
+	std::atomic<bool> failed = { false };
+};
+
+#endif //__BENCH_H__
@@ -1,5 +1,6 @@
 #include "libnet.h"
 #include "libhttp.h"
+#include "bench.h"
 #include <thread>
 #include <string>
 
@@ -157,6 +158,9 @@ struct HttpServer : public ITcpServer {
 };
 
 int main(int argc, char** argv) {
+	if (argc > 1 && strncmp(argv[1], "bench", 5) == 0)
+		return RunBench(argc, argv);
+
 	std::string testStr = "POST /abc/iii HTTP1.1\r\nHost: www.test.com\r\nuser-agent : testIE 10.x \r\n "
 		"Content-Type: application/x-www-form-urlencoded\r\nContent-Length";
 	std::string testStr2 = ": 40\r\nConnectioN: keep-alive\r\n"
@@ -187,7 +191,7 @@ int main(int argc, char** argv) {
 		g_engine->Connect(new TestConnectSession, "127.0.0.1", 5500, 1024, 1024, true);
 	
 	while (!g_terminate) {
-		g_engine->Poll(1);
+		g_engine->Poll(1000);
 		std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	}
 	